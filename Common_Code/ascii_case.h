@@ -0,0 +1,122 @@
+/*
+ * Conversão de caixa ASCII compartilhada pelos servidores TCP e UDP.
+ *
+ * Os servidores nunca chamam setlocale(), então o toupper() da libc roda no
+ * locale "C" e só altera 'a'..'z'. Estas rotinas fazem exatamente o mesmo
+ * (bytes fora da faixa, inclusive >= 0x80, ficam intactos), mas 16 ou 32
+ * bytes por vez com SSE2/AVX2. A variante é escolhida uma única vez, na
+ * primeira chamada, de acordo com a CPU; o caminho escalar é a referência e
+ * é usado em qualquer outra arquitetura ou compilador.
+ */
+
+#ifndef ASCII_CASE_H
+#define ASCII_CASE_H
+
+#include <stddef.h>
+
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_ASCII_SIMD
+#endif
+
+typedef void (*ascii_flip_fn)(char *buf, size_t len, char first, char last);
+
+//Inverte o bit 0x20 (maiúscula <-> minúscula) dos bytes em [first, last]
+static void ascii_flip_scalar(char *buf, size_t len, char first, char last) {
+    size_t j;
+    for (j = 0; j < len; ++j) {
+        unsigned char c = (unsigned char)buf[j];
+        if ((unsigned char)(c - (unsigned char)first) <=
+                (unsigned char)(last - first))
+            buf[j] = (char)(c ^ 0x20);
+    }
+}
+
+#if defined(HAVE_ASCII_SIMD)
+/*
+Os bytes são comparados como inteiros com sinal: tudo >= 0x80 vira negativo
+e nunca cai na faixa, que está inteira em 0x41..0x7a.
+*/
+__attribute__((target("sse2")))
+static void ascii_flip_sse2(char *buf, size_t len, char first, char last) {
+    const __m128i lo = _mm_set1_epi8((char)(first - 1));
+    const __m128i hi = _mm_set1_epi8((char)(last + 1));
+    const __m128i bit = _mm_set1_epi8(0x20);
+    size_t j = 0;
+    for (; j + 16 <= len; j += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(buf + j));
+        __m128i in = _mm_and_si128(_mm_cmpgt_epi8(x, lo), _mm_cmplt_epi8(x, hi));
+        _mm_storeu_si128((__m128i*)(buf + j),
+                _mm_xor_si128(x, _mm_and_si128(in, bit)));
+    }
+    ascii_flip_scalar(buf + j, len - j, first, last);
+}
+
+__attribute__((target("avx2")))
+static void ascii_flip_avx2(char *buf, size_t len, char first, char last) {
+    const __m256i lo = _mm256_set1_epi8((char)(first - 1));
+    const __m256i hi = _mm256_set1_epi8((char)(last + 1));
+    const __m256i bit = _mm256_set1_epi8(0x20);
+    size_t j = 0;
+    for (; j + 64 <= len; j += 64) {
+        __m256i x0 = _mm256_loadu_si256((const __m256i*)(buf + j));
+        __m256i x1 = _mm256_loadu_si256((const __m256i*)(buf + j + 32));
+        __m256i in0 = _mm256_and_si256(_mm256_cmpgt_epi8(x0, lo),
+                _mm256_cmpgt_epi8(hi, x0));
+        __m256i in1 = _mm256_and_si256(_mm256_cmpgt_epi8(x1, lo),
+                _mm256_cmpgt_epi8(hi, x1));
+        _mm256_storeu_si256((__m256i*)(buf + j),
+                _mm256_xor_si256(x0, _mm256_and_si256(in0, bit)));
+        _mm256_storeu_si256((__m256i*)(buf + j + 32),
+                _mm256_xor_si256(x1, _mm256_and_si256(in1, bit)));
+    }
+    for (; j + 32 <= len; j += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(buf + j));
+        __m256i in = _mm256_and_si256(_mm256_cmpgt_epi8(x, lo),
+                _mm256_cmpgt_epi8(hi, x));
+        _mm256_storeu_si256((__m256i*)(buf + j),
+                _mm256_xor_si256(x, _mm256_and_si256(in, bit)));
+    }
+    /*
+    A sobra vai para o código SSE2 sem codificação VEX. Sem zerar a metade
+    alta dos registradores antes, a CPU paga a transição AVX -> SSE a cada
+    chamada (o GCC não põe vzeroupper antes dessa chamada de cauda), o que
+    custava mais que converter 4 KB.
+    */
+    _mm256_zeroupper();
+    ascii_flip_sse2(buf + j, len - j, first, last);
+}
+#endif
+
+static ascii_flip_fn ascii_flip_select(void) {
+#if defined(HAVE_ASCII_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return ascii_flip_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return ascii_flip_sse2;
+#endif
+    return ascii_flip_scalar;
+}
+
+/*
+A escolha é guardada num ponteiro estático. Duas threads podem resolver ao
+mesmo tempo na primeira chamada, mas ambas escrevem o mesmo valor.
+*/
+static ascii_flip_fn ascii_flip_impl(void) {
+    static ascii_flip_fn fn;
+    if (!fn)
+        fn = ascii_flip_select();
+    return fn;
+}
+
+static inline void ascii_toupper(char *buf, size_t len) {
+    ascii_flip_impl()(buf, len, 'a', 'z');
+}
+
+static inline void ascii_tolower(char *buf, size_t len) {
+    ascii_flip_impl()(buf, len, 'A', 'Z');
+}
+
+#endif
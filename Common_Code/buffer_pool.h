@@ -0,0 +1,151 @@
+/*
+ * Pool de buffers por classes de tamanho (2 KB, 4 KB, ... 512 KB).
+ *
+ * Cada classe tem uma lista livre LIFO: o buffer devolvido por último é o
+ * próximo a ser entregue, e por isso costuma ainda estar no cache. Os buffers
+ * são recortados de blocos de 2 MB obtidos com mmap(), opcionalmente com
+ * MAP_HUGETLB (se o kernel não tiver huge pages reservadas, usa páginas
+ * normais). A memória nunca volta ao sistema: um buffer liberado só é
+ * reaproveitado por outra conexão.
+ *
+ * Um pool não é thread-safe; cada worker deve ter o seu.
+ */
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+
+#define POOL_MIN_SHIFT 11           //2 KB
+#define POOL_CLASSES 9              //2 KB .. 512 KB
+#define POOL_MAX_SIZE ((size_t)1 << (POOL_MIN_SHIFT + POOL_CLASSES - 1))
+#define POOL_CHUNK_SIZE ((size_t)2 << 20)
+
+struct buffer_pool {
+    void *free[POOL_CLASSES];   //o início de cada buffer livre guarda o próximo
+    void **chunks;
+    size_t nchunks, cap_chunks;
+    int hugepages;              //0: não, 1: tentar MAP_HUGETLB
+    size_t bytes_mapped;
+    size_t huge_chunks;         //blocos que de fato vieram de huge pages
+};
+
+static void pool_init(struct buffer_pool *p, int hugepages) {
+    memset(p, 0, sizeof(*p));
+    p->hugepages = hugepages;
+}
+
+static int pool_class(size_t size) {
+    int k = 0;
+    while (k < POOL_CLASSES - 1 && ((size_t)1 << (POOL_MIN_SHIFT + k)) < size)
+        ++k;
+    return k;
+}
+
+static void *pool_map_chunk(struct buffer_pool *p) {
+    void *chunk = 0;
+#if defined(_WIN32)
+    chunk = malloc(POOL_CHUNK_SIZE);
+#else
+#if defined(MAP_HUGETLB)
+    if (p->hugepages) {
+        chunk = mmap(0, POOL_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (chunk == MAP_FAILED)
+            chunk = 0;
+        else
+            p->huge_chunks++;
+    }
+#endif
+    if (!chunk) {
+        chunk = mmap(0, POOL_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED)
+            return 0;
+    }
+#endif
+
+    if (p->nchunks == p->cap_chunks) {
+        size_t cap = p->cap_chunks ? p->cap_chunks * 2 : 16;
+        void **list = (void**)realloc(p->chunks, cap * sizeof(void*));
+        if (!list) {
+#if defined(_WIN32)
+            free(chunk);
+#else
+            munmap(chunk, POOL_CHUNK_SIZE);
+#endif
+            return 0;
+        }
+        p->chunks = list;
+        p->cap_chunks = cap;
+    }
+    p->chunks[p->nchunks++] = chunk;
+    p->bytes_mapped += POOL_CHUNK_SIZE;
+    return chunk;
+}
+
+//Recorta um bloco novo em buffers da classe k
+static int pool_refill(struct buffer_pool *p, int k) {
+    size_t size = (size_t)1 << (POOL_MIN_SHIFT + k);
+    char *chunk = (char*)pool_map_chunk(p);
+    if (!chunk)
+        return -1;
+    size_t off;
+    for (off = 0; off + size <= POOL_CHUNK_SIZE; off += size) {
+        *(void**)(chunk + off) = p->free[k];
+        p->free[k] = chunk + off;
+    }
+    return 0;
+}
+
+/*
+Entrega um buffer com pelo menos size bytes; *cap recebe o tamanho real, que
+deve ser passado de volta a pool_free(). Acima de POOL_MAX_SIZE o pedido vai
+direto para malloc().
+*/
+static void *pool_alloc(struct buffer_pool *p, size_t size, size_t *cap) {
+    if (size > POOL_MAX_SIZE) {
+        *cap = size;
+        return malloc(size);
+    }
+    int k = pool_class(size);
+    if (!p->free[k] && pool_refill(p, k) < 0)
+        return 0;
+    void *buf = p->free[k];
+    p->free[k] = *(void**)buf;
+    *cap = (size_t)1 << (POOL_MIN_SHIFT + k);
+    return buf;
+}
+
+static void pool_free(struct buffer_pool *p, void *buf, size_t cap) {
+    if (!buf)
+        return;
+    if (cap > POOL_MAX_SIZE) {
+        free(buf);
+        return;
+    }
+    int k = pool_class(cap);
+    *(void**)buf = p->free[k];
+    p->free[k] = buf;
+}
+
+static void pool_destroy(struct buffer_pool *p) {
+    size_t i;
+    for (i = 0; i < p->nchunks; ++i) {
+#if defined(_WIN32)
+        free(p->chunks[i]);
+#else
+        munmap(p->chunks[i], POOL_CHUNK_SIZE);
+#endif
+    }
+    free(p->chunks);
+    memset(p, 0, sizeof(*p));
+}
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * Modo de baixa latência (-B) dos servidores TCP e UDP.
+ *
+ * Dormir em select()/epoll_wait() e ser acordado custa alguns microssegundos
+ * por mensagem (troca de contexto, a CPU saindo de um estado de economia) e
+ * é o que domina o p99 com pouca carga. Com -B o worker, antes de dormir,
+ * gira consultando os sockets sem bloquear durante um orçamento de tempo;
+ * só se nada chegar nesse intervalo ele volta a esperar como antes. Em troca,
+ * cada worker ocupa um núcleo inteiro, por isso -B também fixa o worker k na
+ * CPU k.
+ *
+ * Onde o kernel deixa, o socket também recebe SO_BUSY_POLL (o recv() e o
+ * epoll consultam a fila da placa de rede em vez de esperar a interrupção)
+ * e SO_PREFER_BUSY_POLL. Sem CAP_NET_ADMIN ou acima de net.core.busy_read
+ * o kernel recusa; o giro no espaço do usuário continua valendo. No
+ * loopback não há fila de placa e só o giro tem efeito.
+ */
+
+#ifndef BUSY_POLL_H
+#define BUSY_POLL_H
+
+#include "mono_clock.h"
+#include <stdint.h>
+
+#if defined(__linux__)
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#define HAVE_BUSY_POLL
+#endif
+
+#define BUSY_POLL_US 50         //orçamento padrão de -B, em microssegundos
+
+#if defined(HAVE_BUSY_POLL)
+//Liga o busy-poll do kernel no socket; avisa uma vez se não for permitido
+static inline void busy_poll_socket(int s, int usec) {
+    static int warned;
+    int fail = 0;
+#if defined(SO_BUSY_POLL)
+    fail |= setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, (void*)&usec, sizeof(usec));
+#endif
+#if defined(SO_PREFER_BUSY_POLL)
+    int yes = 1;
+    fail |= setsockopt(s, SOL_SOCKET, SO_PREFER_BUSY_POLL, (void*)&yes, sizeof(yes));
+#endif
+    if (fail && !warned) {
+        warned = 1;
+        fprintf(stderr, "SO_BUSY_POLL not permitted, spinning in user space only. (%d)\n",
+                errno);
+    }
+}
+
+/*
+Gira até o socket ficar legível ou o orçamento acabar. Retorna 1 se ele
+ficou legível; polls conta as consultas feitas.
+*/
+static inline int spin_readable(int s, uint64_t budget_ns, unsigned long *polls) {
+    uint64_t start = mono_ns();
+    struct pollfd pfd;
+    pfd.fd = s;
+    pfd.events = POLLIN;
+    do {
+        ++*polls;
+        if (poll(&pfd, 1, 0) > 0)
+            return 1;
+    } while (mono_ns() - start < budget_ns);
+    return 0;
+}
+#endif
+
+#endif
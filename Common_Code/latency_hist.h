@@ -0,0 +1,125 @@
+/*
+ * Histograma de latência no estilo HDR, com memória fixa.
+ *
+ * Valores até 127 ns têm balde próprio. Acima disso cada potência de dois é
+ * dividida em 64 baldes iguais, ou seja, o erro relativo fica abaixo de 1/64
+ * (~1,6%) em toda a faixa, de nanossegundos a horas. Registrar uma amostra é
+ * um deslocamento e um incremento: não há alocação nem ordenação, e os
+ * percentis são calculados só no relatório.
+ */
+
+#ifndef LATENCY_HIST_H
+#define LATENCY_HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define HIST_SUB_BITS 6                          //64 baldes por potência de dois
+#define HIST_SUB (1u << HIST_SUB_BITS)
+#define HIST_MAX_SHIFT 42                        //até ~2^48 ns (~3 dias)
+#define HIST_BUCKETS ((HIST_MAX_SHIFT + 2) * HIST_SUB)
+
+struct latency_hist {
+    uint64_t count;
+    uint64_t min, max;
+    uint64_t sum;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline void hist_init(struct latency_hist *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+static inline int hist_msb(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(v);
+#else
+    int m = 0;
+    while (v >>= 1)
+        ++m;
+    return m;
+#endif
+}
+
+static inline unsigned hist_index(uint64_t v) {
+    if (v < 2 * HIST_SUB)
+        return (unsigned)v;
+    unsigned shift = (unsigned)hist_msb(v) - HIST_SUB_BITS;
+    if (shift > HIST_MAX_SHIFT)
+        return HIST_BUCKETS - 1;
+    return shift * HIST_SUB + (unsigned)(v >> shift);
+}
+
+//Maior valor que cai no balde b (o que o HdrHistogram chama de equivalente)
+static inline uint64_t hist_bucket_high(unsigned b) {
+    if (b < 2 * HIST_SUB)
+        return b;
+    unsigned shift = b / HIST_SUB - 1;
+    uint64_t sub = b - shift * HIST_SUB;
+    return (sub << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+static inline void hist_record(struct latency_hist *h, uint64_t ns) {
+    h->buckets[hist_index(ns)]++;
+    h->count++;
+    h->sum += ns;
+    if (ns < h->min)
+        h->min = ns;
+    if (ns > h->max)
+        h->max = ns;
+}
+
+//Soma src em dst (ex.: histogramas de várias threads)
+static inline void hist_merge(struct latency_hist *dst, const struct latency_hist *src) {
+    unsigned b;
+    if (!src->count)
+        return;
+    for (b = 0; b < HIST_BUCKETS; ++b)
+        dst->buckets[b] += src->buckets[b];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+//Valor abaixo do qual estão p por cento das amostras
+static inline uint64_t hist_percentile(const struct latency_hist *h, double p) {
+    if (!h->count)
+        return 0;
+    uint64_t rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    unsigned b;
+    for (b = 0; b < HIST_BUCKETS; ++b) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint64_t v = hist_bucket_high(b);
+            return v > h->max ? h->max : v < h->min ? h->min : v;
+        }
+    }
+    return h->max;
+}
+
+static inline void hist_print(const struct latency_hist *h, const char *title) {
+    if (!h->count) {
+        printf("%s: no samples\n", title);
+        return;
+    }
+    printf("%s (us, %llu samples): min %.1f  p50 %.1f  p90 %.1f  "
+            "p99 %.1f  p99.9 %.1f  max %.1f  mean %.1f\n",
+            title, (unsigned long long)h->count,
+            h->min / 1e3,
+            hist_percentile(h, 50.0) / 1e3,
+            hist_percentile(h, 90.0) / 1e3,
+            hist_percentile(h, 99.0) / 1e3,
+            hist_percentile(h, 99.9) / 1e3,
+            h->max / 1e3,
+            (double)h->sum / h->count / 1e3);
+}
+
+#endif
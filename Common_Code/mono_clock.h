@@ -0,0 +1,33 @@
+/*
+ * Relógio monotônico em nanossegundos. Diferente de clock(), que mede tempo
+ * de CPU do processo, mede tempo de parede e não anda para trás se o relógio
+ * do sistema for ajustado.
+ */
+
+#ifndef MONO_CLOCK_H
+#define MONO_CLOCK_H
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+static inline uint64_t mono_ns(void) {
+#if defined(_WIN32)
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+#endif
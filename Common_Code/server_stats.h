@@ -0,0 +1,360 @@
+/*
+ * Métricas dos servidores TCP e UDP.
+ *
+ * Cada worker tem a sua struct server_stats, alinhada à linha de cache e
+ * escrita só por ele: incrementar um contador é um load e um store relaxados,
+ * sem lock, sem instrução atômica de leitura-modificação-escrita e sem
+ * disputar linha com outro worker. Quem lê (a thread de estatísticas) usa
+ * loads relaxados e pode ver um contador um pouco mais novo que outro, o que
+ * para monitoração não importa.
+ *
+ * A thread de estatísticas (stats_start()) responde a qualquer conexão na
+ * porta local pedida com um retrato em texto, um worker por linha no formato
+ * chave=valor (serve também para curl http://127.0.0.1:PORTA/), e/ou imprime
+ * o mesmo retrato a cada intervalo.
+ */
+
+#ifndef SERVER_STATS_H
+#define SERVER_STATS_H
+
+#include "mono_clock.h"
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#define HAVE_STATS_THREAD
+#endif
+
+#define CACHE_LINE 64
+
+#if defined(_MSC_VER)
+#define CACHE_ALIGNED __declspec(align(CACHE_LINE))
+#else
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE)))
+#endif
+
+//Níveis de log: por padrão só erros; -v liga as mensagens por conexão
+enum {
+    LOG_ERROR,
+    LOG_INFO,
+};
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((unused))
+#endif
+static int log_level = LOG_ERROR;
+
+#define log_info(...) \
+    do { if (log_level >= LOG_INFO) printf(__VA_ARGS__); } while (0)
+
+/*
+Tempo de cada iteração do laço de eventos (do retorno da espera até a
+próxima espera), num histograma log-linear: 4 baldes por potência de dois,
+erro abaixo de 25%.
+*/
+#define STATS_LOOP_SUB 4
+#define STATS_LOOP_BUCKETS (40 * STATS_LOOP_SUB)
+
+struct CACHE_ALIGNED server_stats {
+    unsigned long accepted;         //conexões aceitas (TCP)
+    unsigned long closed;           //conexões fechadas (TCP)
+    unsigned long timeouts;         //fechadas por prazo vencido (TCP, -I/-R)
+    unsigned long bytes_in, bytes_out;
+    unsigned long messages;         //leituras com dados, quadros ou datagramas
+    unsigned long recv_calls;       //recv/recvfrom/recvmmsg
+    unsigned long send_calls;       //send/sendmsg/sendto/sendmmsg; io_uring_enter
+                                    //só de submissão (fila cheia)
+    unsigned long wait_calls;       //select/epoll_wait/io_uring_enter
+    unsigned long spin_polls;       //consultas sem bloqueio do busy-poll (-B)
+    unsigned long partial_sends;    //envios que não couberam inteiros no socket
+    unsigned long tx_drops;         //datagramas descartados no envio (UDP)
+    unsigned long rx_drops;         //descartes na fila de recepção (UDP); vem do
+                                    //kernel, pelo SO_RXQ_OVFL ou no retrato
+    unsigned long rcvbuf;           //SO_RCVBUF atual, como o kernel informa (UDP)
+    unsigned long batches;          //recvmmsg() com dados (UDP)
+    unsigned long batch_buffers;    //entradas preenchidas nesses lotes (UDP)
+    unsigned long loop_ns;          //soma do tempo das iterações
+    unsigned long loop_max_ns;
+    unsigned long loop_hist[STATS_LOOP_BUCKETS];
+};
+
+static inline void counter_add(unsigned long *c, unsigned long n) {
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+#else
+    *c += n;
+#endif
+}
+
+static inline void counter_set(unsigned long *c, unsigned long v) {
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_store_n(c, v, __ATOMIC_RELAXED);
+#else
+    *c = v;
+#endif
+}
+
+static inline unsigned long counter_read(const unsigned long *c) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n(c, __ATOMIC_RELAXED);
+#else
+    return *(volatile const unsigned long*)c;
+#endif
+}
+
+static inline unsigned stats_loop_index(uint64_t ns) {
+    if (ns < 2 * STATS_LOOP_SUB)
+        return (unsigned)ns;
+    int msb = 63;
+#if defined(__GNUC__) || defined(__clang__)
+    msb = 63 - __builtin_clzll(ns);
+#else
+    while (!(ns >> msb))
+        --msb;
+#endif
+    unsigned b = (unsigned)(msb - 1) * STATS_LOOP_SUB +
+        (unsigned)((ns >> (msb - 2)) & (STATS_LOOP_SUB - 1));
+    return b < STATS_LOOP_BUCKETS ? b : STATS_LOOP_BUCKETS - 1;
+}
+
+//Maior valor que cai no balde b
+static inline uint64_t stats_loop_high(unsigned b) {
+    if (b < 2 * STATS_LOOP_SUB)
+        return b;
+    unsigned msb = b / STATS_LOOP_SUB + 1;
+    uint64_t sub = b % STATS_LOOP_SUB;
+    return ((uint64_t)(STATS_LOOP_SUB + sub + 1) << (msb - 2)) - 1;
+}
+
+static inline void stats_loop(struct server_stats *s, uint64_t ns) {
+    counter_add(&s->wait_calls, 1);
+    counter_add(&s->loop_ns, (unsigned long)ns);
+    if (ns > s->loop_max_ns)
+        counter_set(&s->loop_max_ns, (unsigned long)ns);
+    counter_add(&s->loop_hist[stats_loop_index(ns)], 1);
+}
+
+//Cópia coerente o bastante para relatório; só usa loads relaxados
+static inline void stats_read(const struct server_stats *s, struct server_stats *out) {
+    const unsigned long *src = (const unsigned long*)s;
+    unsigned long *dst = (unsigned long*)out;
+    size_t k;
+    for (k = 0; k < sizeof(*s) / sizeof(unsigned long); ++k)
+        dst[k] = counter_read(&src[k]);
+}
+
+static inline void stats_merge(struct server_stats *dst, const struct server_stats *src) {
+    unsigned long max = dst->loop_max_ns > src->loop_max_ns ?
+        dst->loop_max_ns : src->loop_max_ns;
+    unsigned long *d = (unsigned long*)dst;
+    const unsigned long *s = (const unsigned long*)src;
+    size_t k;
+    for (k = 0; k < sizeof(*dst) / sizeof(unsigned long); ++k)
+        d[k] += s[k];
+    dst->loop_max_ns = max;
+}
+
+static inline uint64_t stats_loop_percentile(const struct server_stats *s, double p) {
+    unsigned long total = 0, seen = 0;
+    unsigned b;
+    for (b = 0; b < STATS_LOOP_BUCKETS; ++b)
+        total += s->loop_hist[b];
+    if (!total)
+        return 0;
+    unsigned long rank = (unsigned long)(p / 100.0 * total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    for (b = 0; b < STATS_LOOP_BUCKETS; ++b) {
+        seen += s->loop_hist[b];
+        if (seen >= rank) {
+            uint64_t v = stats_loop_high(b);
+            return v > s->loop_max_ns ? s->loop_max_ns : v;
+        }
+    }
+    return s->loop_max_ns;
+}
+
+
+//Texto do retrato, crescendo conforme preciso
+struct stats_text {
+    char *buf;
+    size_t len, cap;
+};
+
+static inline void stats_printf(struct stats_text *t, const char *fmt, ...) {
+    while (1) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = t->buf ? vsnprintf(t->buf + t->len, t->cap - t->len, fmt, ap) : -1;
+        va_end(ap);
+        if (n >= 0 && t->len + (size_t)n < t->cap) {
+            t->len += n;
+            return;
+        }
+        size_t cap = t->cap ? t->cap * 2 : 4096;
+        char *p = (char*)realloc(t->buf, cap);
+        if (!p)
+            return;
+        t->buf = p;
+        t->cap = cap;
+    }
+}
+
+/*
+Uma linha do retrato. label identifica o worker ("worker=0") ou a soma
+("total"); udp escolhe os campos que fazem sentido para cada servidor.
+*/
+static inline void stats_format(struct stats_text *t, const char *label,
+        const struct server_stats *s, int udp) {
+    unsigned long calls = s->recv_calls + s->send_calls + s->wait_calls +
+        s->spin_polls;
+    stats_printf(t, "%s", label);
+    if (!udp)
+        stats_printf(t, " accepted=%lu closed=%lu open=%lu timeouts=%lu",
+                s->accepted, s->closed, s->accepted - s->closed, s->timeouts);
+    stats_printf(t, " bytes_in=%lu bytes_out=%lu messages=%lu"
+            " syscalls=%lu syscalls_per_msg=%.2f partial_sends=%lu spin_polls=%lu",
+            s->bytes_in, s->bytes_out, s->messages, calls,
+            s->messages ? (double)calls / s->messages : 0.0, s->partial_sends,
+            s->spin_polls);
+    if (udp)
+        stats_printf(t, " rx_drops=%lu tx_drops=%lu rcvbuf=%lu batch_fill=%.2f",
+                s->rx_drops, s->tx_drops, s->rcvbuf,
+                s->batches ? (double)s->batch_buffers / s->batches : 0.0);
+    stats_printf(t, " loop_iterations=%lu loop_mean_us=%.1f loop_p50_us=%.1f"
+            " loop_p99_us=%.1f loop_max_us=%.1f\n",
+            s->wait_calls,
+            s->wait_calls ? (double)s->loop_ns / s->wait_calls / 1e3 : 0.0,
+            stats_loop_percentile(s, 50.0) / 1e3,
+            stats_loop_percentile(s, 99.0) / 1e3,
+            s->loop_max_ns / 1e3);
+}
+
+
+typedef void (*stats_snapshot_fn)(void *arg, struct stats_text *out);
+
+struct stats_reporter {
+    int port;               //porta local do retrato (0 = nenhuma)
+    int interval;           //segundos entre impressões (0 = nunca)
+    stats_snapshot_fn snapshot;
+    void *arg;
+#if defined(HAVE_STATS_THREAD)
+    int listen_fd;
+    pthread_t thread;
+#endif
+};
+
+#if defined(HAVE_STATS_THREAD)
+static inline void stats_answer(struct stats_reporter *r, int fd) {
+    //descarta o pedido (se for HTTP, a primeira linha basta)
+    char req[1024];
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 100) > 0)
+        (void)recv(fd, req, sizeof(req), MSG_DONTWAIT);
+
+    struct stats_text t;
+    memset(&t, 0, sizeof(t));
+    stats_printf(&t, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n");
+    r->snapshot(r->arg, &t);
+    size_t off = 0;
+    while (t.buf && off < t.len) {
+        ssize_t n = send(fd, t.buf + off, t.len - off, MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        off += n;
+    }
+    free(t.buf);
+    close(fd);
+}
+
+static inline void *stats_thread(void *arg) {
+    struct stats_reporter *r = (struct stats_reporter*)arg;
+    uint64_t period = (uint64_t)r->interval * 1000000000u;
+    uint64_t deadline = mono_ns() + period;
+    while (1) {
+        //espera só o que falta até a próxima impressão, com ou sem conexões
+        int wait_ms = -1;
+        if (r->interval) {
+            uint64_t now = mono_ns();
+            wait_ms = now < deadline ? (int)((deadline - now + 999999) / 1000000) : 0;
+        }
+        struct pollfd pfd;
+        pfd.fd = r->listen_fd;
+        pfd.events = POLLIN;
+        int n = poll(&pfd, r->listen_fd >= 0 ? 1 : 0, wait_ms);
+        if (n > 0) {
+            int fd = accept(r->listen_fd, 0, 0);
+            if (fd >= 0)
+                stats_answer(r, fd);
+        }
+        if (r->interval && mono_ns() >= deadline) {
+            deadline += period;
+            //atrasou mais de um intervalo: não imprime em rajada
+            if (deadline < mono_ns())
+                deadline = mono_ns() + period;
+            struct stats_text t;
+            memset(&t, 0, sizeof(t));
+            r->snapshot(r->arg, &t);
+            if (t.buf)
+                fwrite(t.buf, 1, t.len, stdout);
+            fflush(stdout);
+            free(t.buf);
+        }
+    }
+    return 0;
+}
+#endif
+
+/*
+Abre a porta (só em 127.0.0.1) e inicia a thread. As impressões seguem um
+prazo absoluto que as conexões não adiam; cada uma pode atrasar no máximo o
+tempo de responder uma conexão (até 100 ms de espera pelo pedido). Retorna
+-1 em erro.
+*/
+static inline int stats_start(struct stats_reporter *r) {
+    if (!r->port && !r->interval)
+        return 0;
+#if defined(HAVE_STATS_THREAD)
+    r->listen_fd = -1;
+    if (r->port) {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((unsigned short)r->port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int yes = 1;
+        r->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (r->listen_fd < 0 ||
+                setsockopt(r->listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) ||
+                bind(r->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+                listen(r->listen_fd, 16)) {
+            fprintf(stderr, "stats port %d unavailable.\n", r->port);
+            if (r->listen_fd >= 0)
+                close(r->listen_fd);
+            return -1;
+        }
+    }
+    if (pthread_create(&r->thread, 0, stats_thread, r)) {
+        fprintf(stderr, "pthread_create() failed.\n");
+        return -1;
+    }
+    pthread_detach(r->thread);
+    return 0;
+#else
+    fprintf(stderr, "stats reporting requires threads.\n");
+    return -1;
+#endif
+}
+
+#endif
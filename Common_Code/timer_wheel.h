@@ -0,0 +1,243 @@
+/*
+ * Roda de temporizadores hierárquica, no estilo da que o kernel Linux usou
+ * por muito tempo: 4 níveis de 256 posições, tique de 1 ms. O nível 0 cobre
+ * os próximos 256 tiques, um tique por posição; cada nível acima cobre 256
+ * vezes mais tempo com a mesma quantidade de posições. Quando o nível 0 dá
+ * a volta, a posição correspondente do nível 1 é redistribuída ("cascata")
+ * pelo nível 0, e assim por diante.
+ *
+ * Armar, rearmar e cancelar são O(1): cada temporizador é um nó de uma lista
+ * duplamente encadeada, e a posição sai de alguns deslocamentos. Os nós
+ * ficam num vetor indexado pelo id (o descritor da conexão), com os elos
+ * guardados como índices, então o vetor pode crescer com realloc() sem
+ * invalidar nada. Com 100 mil conexões são 100 mil nós de 24 bytes e nenhuma
+ * varredura: o laço só toca as posições que vencem.
+ *
+ * Uso: tw_arm() a cada atividade, tw_cancel() ao fechar, tw_timeout() para o
+ * prazo da próxima espera e tw_expired() depois dela, até devolver TW_NONE.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TW_BITS 8
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_LEVELS 4
+#define TW_DUE (TW_LEVELS * TW_SLOTS)   //vencidos, ainda não entregues
+#define TW_NONE (-1)
+
+struct tw_node {
+    uint64_t expires;       //tique (ms) em que vence
+    int next, prev;
+    int list;               //posição onde está ou TW_NONE se desarmado
+};
+
+struct timer_wheel {
+    uint64_t next;          //próximo tique a processar
+    struct tw_node *nodes;  //indexado pelo id
+    int cap;
+    int count;              //temporizadores armados
+    uint64_t bits[TW_SLOTS / 64];   //posições não vazias do nível 0
+    int head[TW_DUE + 1];
+};
+
+static inline void tw_init(struct timer_wheel *tw, uint64_t now) {
+    int k;
+    memset(tw, 0, sizeof(*tw));
+    tw->next = now;
+    for (k = 0; k <= TW_DUE; ++k)
+        tw->head[k] = TW_NONE;
+}
+
+static inline void tw_destroy(struct timer_wheel *tw) {
+    free(tw->nodes);
+    tw->nodes = 0;
+    tw->cap = 0;
+    tw->count = 0;
+}
+
+static inline void tw_link(struct timer_wheel *tw, int id, int list) {
+    struct tw_node *n = &tw->nodes[id];
+    n->list = list;
+    n->prev = TW_NONE;
+    n->next = tw->head[list];
+    if (n->next != TW_NONE)
+        tw->nodes[n->next].prev = id;
+    tw->head[list] = id;
+    if (list < TW_SLOTS)
+        tw->bits[list / 64] |= (uint64_t)1 << (list % 64);
+}
+
+static inline void tw_unlink(struct timer_wheel *tw, int id) {
+    struct tw_node *n = &tw->nodes[id];
+    if (n->prev != TW_NONE)
+        tw->nodes[n->prev].next = n->next;
+    else
+        tw->head[n->list] = n->next;
+    if (n->next != TW_NONE)
+        tw->nodes[n->next].prev = n->prev;
+    if (n->list < TW_SLOTS && tw->head[n->list] == TW_NONE)
+        tw->bits[n->list / 64] &= ~((uint64_t)1 << (n->list % 64));
+    n->list = TW_NONE;
+}
+
+/*
+Posição para um temporizador que vence em expires, relativa ao próximo tique.
+O que já venceu vai para o próximo tique; o que passa de 2^32 tiques (49
+dias) fica no fim do último nível e é recolocado a cada cascata.
+*/
+static inline int tw_slot(const struct timer_wheel *tw, uint64_t expires) {
+    uint64_t e = expires < tw->next ? tw->next : expires;
+    uint64_t d = e - tw->next;
+    int level;
+    for (level = 0; level < TW_LEVELS - 1; ++level)
+        if (d < (uint64_t)1 << (TW_BITS * (level + 1)))
+            break;
+    if (d >> (TW_BITS * TW_LEVELS))
+        e = tw->next + (((uint64_t)1 << (TW_BITS * TW_LEVELS)) - 1);
+    return level * TW_SLOTS + (int)((e >> (TW_BITS * level)) & TW_MASK);
+}
+
+//Arma (ou rearma) o temporizador id para o tique expires. -1 sem memória.
+static inline int tw_arm(struct timer_wheel *tw, int id, uint64_t expires) {
+    if (id >= tw->cap) {
+        int cap = tw->cap ? tw->cap : 1024;
+        while (cap <= id)
+            cap *= 2;
+        struct tw_node *p = (struct tw_node*)realloc(tw->nodes,
+                cap * sizeof(*p));
+        if (!p)
+            return -1;
+        int k;
+        for (k = tw->cap; k < cap; ++k)
+            p[k].list = TW_NONE;
+        tw->nodes = p;
+        tw->cap = cap;
+    }
+    struct tw_node *n = &tw->nodes[id];
+    int list = tw_slot(tw, expires);
+    n->expires = expires;
+    //rearmar para a mesma posição (o caso comum com tráfego) não mexe na lista
+    if (n->list == list)
+        return 0;
+    if (n->list != TW_NONE)
+        tw_unlink(tw, id);
+    else
+        tw->count++;
+    tw_link(tw, id, list);
+    return 0;
+}
+
+static inline void tw_cancel(struct timer_wheel *tw, int id) {
+    if (id < tw->cap && tw->nodes[id].list != TW_NONE) {
+        tw_unlink(tw, id);
+        tw->count--;
+    }
+}
+
+//Redistribui a posição atual do nível level; devolve o índice dela
+static inline int tw_cascade(struct timer_wheel *tw, int level) {
+    int index = (int)((tw->next >> (TW_BITS * level)) & TW_MASK);
+    int list = level * TW_SLOTS + index;
+    int id = tw->head[list];
+    tw->head[list] = TW_NONE;
+    while (id != TW_NONE) {
+        int next = tw->nodes[id].next;
+        tw_link(tw, id, tw_slot(tw, tw->nodes[id].expires));
+        id = next;
+    }
+    return index;
+}
+
+/*
+Primeiro tique que precisa ser processado: a primeira posição ocupada do
+nível 0 antes da próxima virada ou a própria virada, onde pode haver cascata.
+Sem nada no nível 0, o laço acorda a cada 256 ms para isso.
+*/
+static inline uint64_t tw_next_tick(const struct timer_wheel *tw) {
+    uint64_t wrap = (tw->next + TW_MASK) & ~(uint64_t)TW_MASK;
+    int from = (int)(tw->next & TW_MASK);
+    int w;
+    if (!from)
+        return tw->next;
+    for (w = from / 64; w < TW_SLOTS / 64; ++w) {
+        uint64_t m = tw->bits[w];
+        if (w == from / 64)
+            m &= ~(uint64_t)0 << (from % 64);
+        if (m) {
+            int b = 0;
+#if defined(__GNUC__) || defined(__clang__)
+            b = __builtin_ctzll(m);
+#else
+            while (!(m & 1)) {
+                m >>= 1;
+                ++b;
+            }
+#endif
+            return tw->next + (uint64_t)(w * 64 + b - from);
+        }
+    }
+    return wrap;
+}
+
+//Milissegundos até o próximo vencimento, 0 se já há vencidos, -1 se nenhum
+static inline int tw_timeout(const struct timer_wheel *tw, uint64_t now) {
+    if (tw->head[TW_DUE] != TW_NONE)
+        return 0;
+    if (!tw->count)
+        return -1;
+    uint64_t at = tw_next_tick(tw);
+    if (at <= now)
+        return 0;
+    return at - now > INT_MAX ? INT_MAX : (int)(at - now);
+}
+
+/*
+Avança a roda até now e devolve um temporizador vencido (já desarmado) ou
+TW_NONE quando não há mais. Os tiques sem nada são pulados, então o custo
+não depende de quanto tempo o laço dormiu. Rearmar ou cancelar outros
+temporizadores entre as chamadas é permitido.
+*/
+static inline int tw_expired(struct timer_wheel *tw, uint64_t now) {
+    while (tw->head[TW_DUE] == TW_NONE) {
+        if (tw->next > now)
+            return TW_NONE;
+        if (!tw->count) {
+            tw->next = now + 1;
+            return TW_NONE;
+        }
+        uint64_t at = tw_next_tick(tw);
+        if (at > tw->next) {
+            tw->next = at < now + 1 ? at : now + 1;
+            continue;
+        }
+
+        int index = (int)(tw->next & TW_MASK);
+        int level;
+        if (!index)
+            for (level = 1; level < TW_LEVELS && !tw_cascade(tw, level); ++level)
+                ;
+        //a posição inteira passa para a lista de vencidos: o que for armado
+        //durante a entrega não cai nela
+        int id = tw->head[index];
+        while (id != TW_NONE) {
+            int next = tw->nodes[id].next;
+            tw_unlink(tw, id);
+            tw_link(tw, id, TW_DUE);
+            id = next;
+        }
+        tw->next++;
+    }
+    int id = tw->head[TW_DUE];
+    tw_unlink(tw, id);
+    tw->count--;
+    return id;
+}
+
+#endif
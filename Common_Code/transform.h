@@ -0,0 +1,448 @@
+/*
+ * Cadeia de transformações do conteúdo, comum aos servidores TCP e UDP.
+ *
+ * Uma cadeia é uma lista de estágios escolhida na partida (opção -x), por
+ * exemplo "upper", "rot13,xor:0x5a" ou "lower,crc32c":
+ *
+ *   upper, lower  caixa ASCII, como em ascii_case.h
+ *   rot13         gira as letras ASCII 13 posições
+ *   xor:N         ou-exclusivo de cada byte com N (0..255)
+ *   crc32c        acrescenta ao fim da mensagem o CRC32C (Castagnoli), em
+ *                 ordem de rede, dos bytes já transformados; só como último
+ *                 estágio
+ *
+ * Os estágios não fazem N passadas pelo buffer: o kernel carrega um bloco
+ * num registrador, aplica todos os estágios nele, grava uma vez e, se houver
+ * crc32c, alimenta o CRC com o mesmo registrador. O kernel é escolhido uma
+ * vez em xform_build(), pela CPU e pela cadeia:
+ *
+ *   - só upper ou só lower: os kernels de ascii_case.h, sem desvio nenhum;
+ *   - AVX2 (64 bytes por vez), com uma instância compilada para cada estágio
+ *     sozinho e uma genérica para cadeias, e SSE4.2 (16 bytes); o CRC usa a
+ *     instrução crc32;
+ *   - SSE2 quando não há crc32c;
+ *   - escalar: uma tabela de 256 bytes com a composição de todos os
+ *     estágios de byte e CRC por tabela. É a referência e cuida das sobras.
+ */
+
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "ascii_case.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define XFORM_MAX_STAGES 8
+#define XFORM_TRAILER 4         //bytes acrescentados pelo crc32c
+
+enum xform_op {
+    XF_UPPER,
+    XF_LOWER,
+    XF_ROT13,
+    XF_XOR,
+};
+
+struct xform_stage {
+    enum xform_op op;
+    unsigned char key;          //só xor
+};
+
+struct xform_chain;
+
+/*
+Transforma buf no lugar e devolve crc atualizado com os bytes transformados
+(crc é ignorado quando a cadeia não tem crc32c).
+*/
+typedef uint32_t (*xform_kernel)(const struct xform_chain *ch, char *buf,
+        size_t len, uint32_t crc);
+
+struct xform_chain {
+    int nstages;                //estágios de byte, sem o crc32c
+    struct xform_stage stage[XFORM_MAX_STAGES];
+    int crc;                    //acrescenta o CRC32C
+    size_t trailer;             //XFORM_TRAILER com crc32c, 0 sem
+    unsigned char lut[256];     //composição dos estágios de byte
+    xform_kernel kernel;
+    const char *kernel_name;
+};
+
+static uint32_t xform_crc_table[256];
+
+static inline void xform_crc_init(void) {
+    uint32_t b;
+    for (b = 0; b < 256; ++b) {
+        uint32_t c = b;
+        int k;
+        for (k = 0; k < 8; ++k)
+            c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
+        xform_crc_table[b] = c;
+    }
+}
+
+static inline unsigned char xform_byte(const struct xform_stage *s, unsigned char c) {
+    switch (s->op) {
+    case XF_UPPER:
+        return c >= 'a' && c <= 'z' ? (unsigned char)(c ^ 0x20) : c;
+    case XF_LOWER:
+        return c >= 'A' && c <= 'Z' ? (unsigned char)(c ^ 0x20) : c;
+    case XF_ROT13: {
+        unsigned char l = c | 0x20;
+        if (l >= 'a' && l <= 'm')
+            return (unsigned char)(c + 13);
+        if (l >= 'n' && l <= 'z')
+            return (unsigned char)(c - 13);
+        return c;
+    }
+    case XF_XOR:
+        return c ^ s->key;
+    }
+    return c;
+}
+
+static uint32_t xform_scalar(const struct xform_chain *ch, char *buf,
+        size_t len, uint32_t crc) {
+    unsigned char *p = (unsigned char*)buf;
+    size_t j;
+    if (!ch->crc) {
+        for (j = 0; j < len; ++j)
+            p[j] = ch->lut[p[j]];
+        return crc;
+    }
+    for (j = 0; j < len; ++j) {
+        unsigned char c = ch->lut[p[j]];
+        p[j] = c;
+        crc = xform_crc_table[(crc ^ c) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static uint32_t xform_flip_upper(const struct xform_chain *ch, char *buf,
+        size_t len, uint32_t crc) {
+    (void)ch;
+    ascii_toupper(buf, len);
+    return crc;
+}
+
+static uint32_t xform_flip_lower(const struct xform_chain *ch, char *buf,
+        size_t len, uint32_t crc) {
+    (void)ch;
+    ascii_tolower(buf, len);
+    return crc;
+}
+
+#if defined(HAVE_ASCII_SIMD)
+/*
+Um estágio sobre 16 bytes. As faixas de letras estão todas em 0x41..0x7a,
+então a comparação com sinal de ascii_case.h vale aqui também, inclusive
+depois de um xor que leve bytes para >= 0x80.
+*/
+__attribute__((target("sse2"), always_inline))
+static inline __m128i xform_stage128(__m128i x, const struct xform_stage *s) {
+    switch (s->op) {
+    case XF_UPPER:
+    case XF_LOWER: {
+        char first = s->op == XF_UPPER ? 'a' : 'A';
+        __m128i in = _mm_and_si128(
+                _mm_cmpgt_epi8(x, _mm_set1_epi8((char)(first - 1))),
+                _mm_cmplt_epi8(x, _mm_set1_epi8((char)(first + 26))));
+        return _mm_xor_si128(x, _mm_and_si128(in, _mm_set1_epi8(0x20)));
+    }
+    case XF_ROT13: {
+        __m128i l = _mm_or_si128(x, _mm_set1_epi8(0x20));
+        __m128i am = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)),
+                _mm_cmplt_epi8(l, _mm_set1_epi8('m' + 1)));
+        __m128i nz = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('n' - 1)),
+                _mm_cmplt_epi8(l, _mm_set1_epi8('z' + 1)));
+        const __m128i k13 = _mm_set1_epi8(13);
+        x = _mm_add_epi8(x, _mm_and_si128(am, k13));
+        return _mm_sub_epi8(x, _mm_and_si128(nz, k13));
+    }
+    case XF_XOR:
+        return _mm_xor_si128(x, _mm_set1_epi8((char)s->key));
+    }
+    return x;
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i xform_stage256(__m256i x, const struct xform_stage *s) {
+    switch (s->op) {
+    case XF_UPPER:
+    case XF_LOWER: {
+        char first = s->op == XF_UPPER ? 'a' : 'A';
+        __m256i in = _mm256_and_si256(
+                _mm256_cmpgt_epi8(x, _mm256_set1_epi8((char)(first - 1))),
+                _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(first + 26)), x));
+        return _mm256_xor_si256(x, _mm256_and_si256(in, _mm256_set1_epi8(0x20)));
+    }
+    case XF_ROT13: {
+        __m256i l = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+        __m256i am = _mm256_and_si256(
+                _mm256_cmpgt_epi8(l, _mm256_set1_epi8('a' - 1)),
+                _mm256_cmpgt_epi8(_mm256_set1_epi8('m' + 1), l));
+        __m256i nz = _mm256_and_si256(
+                _mm256_cmpgt_epi8(l, _mm256_set1_epi8('n' - 1)),
+                _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), l));
+        const __m256i k13 = _mm256_set1_epi8(13);
+        x = _mm256_add_epi8(x, _mm256_and_si256(am, k13));
+        return _mm256_sub_epi8(x, _mm256_and_si256(nz, k13));
+    }
+    case XF_XOR:
+        return _mm256_xor_si256(x, _mm256_set1_epi8((char)s->key));
+    }
+    return x;
+}
+
+__attribute__((target("sse2")))
+static uint32_t xform_sse2(const struct xform_chain *ch, char *buf,
+        size_t len, uint32_t crc) {
+    size_t j = 0;
+    int k;
+    for (; j + 16 <= len; j += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(buf + j));
+        for (k = 0; k < ch->nstages; ++k)
+            x = xform_stage128(x, &ch->stage[k]);
+        _mm_storeu_si128((__m128i*)(buf + j), x);
+    }
+    return xform_scalar(ch, buf + j, len - j, crc);
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t xform_sse42(const struct xform_chain *ch, char *buf,
+        size_t len, uint32_t crc) {
+    uint64_t c = crc;
+    size_t j = 0;
+    int k;
+    for (; j + 16 <= len; j += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(buf + j));
+        for (k = 0; k < ch->nstages; ++k)
+            x = xform_stage128(x, &ch->stage[k]);
+        _mm_storeu_si128((__m128i*)(buf + j), x);
+        if (ch->crc) {
+            c = _mm_crc32_u64(c, (uint64_t)_mm_cvtsi128_si64(x));
+            c = _mm_crc32_u64(c, (uint64_t)_mm_extract_epi64(x, 1));
+        }
+    }
+    if (!ch->crc)
+        return xform_scalar(ch, buf + j, len - j, crc);
+    crc = (uint32_t)c;
+    for (; j < len; ++j) {
+        unsigned char b = ch->lut[(unsigned char)buf[j]];
+        buf[j] = (char)b;
+        crc = _mm_crc32_u8(crc, b);
+    }
+    return crc;
+}
+
+/*
+Corpo dos kernels AVX2: 64 bytes por iteração, em dois registradores
+independentes. Ele é sempre expandido no lugar, e as instâncias abaixo fixam
+em tempo de compilação se há CRC e, para cadeias de um estágio só, qual é o
+estágio; o switch de xform_stage256() e o teste do CRC somem do laço.
+*/
+__attribute__((target("avx2,sse4.2"), always_inline))
+static inline uint32_t xform_avx2_body(const struct xform_chain *ch, char *buf,
+        size_t len, uint32_t crc, int nstages, const struct xform_stage *stage,
+        int do_crc) {
+    uint64_t c = crc;
+    size_t j = 0;
+    int k;
+    for (; j + 64 <= len; j += 64) {
+        __m256i x0 = _mm256_loadu_si256((const __m256i*)(buf + j));
+        __m256i x1 = _mm256_loadu_si256((const __m256i*)(buf + j + 32));
+        for (k = 0; k < nstages; ++k) {
+            x0 = xform_stage256(x0, &stage[k]);
+            x1 = xform_stage256(x1, &stage[k]);
+        }
+        _mm256_storeu_si256((__m256i*)(buf + j), x0);
+        _mm256_storeu_si256((__m256i*)(buf + j + 32), x1);
+        if (do_crc) {
+            c = _mm_crc32_u64(c, (uint64_t)_mm256_extract_epi64(x0, 0));
+            c = _mm_crc32_u64(c, (uint64_t)_mm256_extract_epi64(x0, 1));
+            c = _mm_crc32_u64(c, (uint64_t)_mm256_extract_epi64(x0, 2));
+            c = _mm_crc32_u64(c, (uint64_t)_mm256_extract_epi64(x0, 3));
+            c = _mm_crc32_u64(c, (uint64_t)_mm256_extract_epi64(x1, 0));
+            c = _mm_crc32_u64(c, (uint64_t)_mm256_extract_epi64(x1, 1));
+            c = _mm_crc32_u64(c, (uint64_t)_mm256_extract_epi64(x1, 2));
+            c = _mm_crc32_u64(c, (uint64_t)_mm256_extract_epi64(x1, 3));
+        }
+    }
+    //a sobra roda em SSE sem VEX: zera a metade alta antes (ver ascii_case.h)
+    _mm256_zeroupper();
+    if (do_crc)
+        return xform_sse42(ch, buf + j, len - j, (uint32_t)c);
+    return xform_sse2(ch, buf + j, len - j, crc);
+}
+
+#define XFORM_AVX2_CHAIN(name, do_crc) \
+    __attribute__((target("avx2,sse4.2"))) \
+    static uint32_t name(const struct xform_chain *ch, char *buf, \
+            size_t len, uint32_t crc) { \
+        return xform_avx2_body(ch, buf, len, crc, ch->nstages, ch->stage, do_crc); \
+    }
+
+#define XFORM_AVX2_ONE(name, stage_op, do_crc) \
+    __attribute__((target("avx2,sse4.2"))) \
+    static uint32_t name(const struct xform_chain *ch, char *buf, \
+            size_t len, uint32_t crc) { \
+        struct xform_stage one; \
+        one.op = stage_op; \
+        one.key = ch->stage[0].key; \
+        return xform_avx2_body(ch, buf, len, crc, 1, &one, do_crc); \
+    }
+
+XFORM_AVX2_CHAIN(xform_avx2, 0)
+XFORM_AVX2_CHAIN(xform_avx2_crc, 1)
+XFORM_AVX2_ONE(xform_avx2_upper_crc, XF_UPPER, 1)
+XFORM_AVX2_ONE(xform_avx2_lower_crc, XF_LOWER, 1)
+XFORM_AVX2_ONE(xform_avx2_rot13, XF_ROT13, 0)
+XFORM_AVX2_ONE(xform_avx2_rot13_crc, XF_ROT13, 1)
+XFORM_AVX2_ONE(xform_avx2_xor, XF_XOR, 0)
+XFORM_AVX2_ONE(xform_avx2_xor_crc, XF_XOR, 1)
+
+//Instância para a cadeia; upper e lower sem CRC ficam com ascii_case.h
+static xform_kernel xform_avx2_select(const struct xform_chain *ch) {
+    static const xform_kernel one[][2] = {
+        {0, xform_avx2_upper_crc},
+        {0, xform_avx2_lower_crc},
+        {xform_avx2_rot13, xform_avx2_rot13_crc},
+        {xform_avx2_xor, xform_avx2_xor_crc},
+    };
+    if (ch->nstages == 1 && one[ch->stage[0].op][ch->crc])
+        return one[ch->stage[0].op][ch->crc];
+    return ch->crc ? xform_avx2_crc : xform_avx2;
+}
+#endif
+
+/*
+Lê a especificação (estágios separados por vírgula) e monta a cadeia.
+Retorna -1 com mensagem em stderr se ela for inválida.
+*/
+static inline int xform_parse(const char *spec, struct xform_chain *ch) {
+    memset(ch, 0, sizeof(*ch));
+    while (*spec) {
+        size_t n = strcspn(spec, ",");
+        if (ch->crc) {
+            fprintf(stderr, "crc32c must be the last transform stage.\n");
+            return -1;
+        }
+        if (n == 6 && !strncmp(spec, "crc32c", 6)) {
+            ch->crc = 1;
+        } else {
+            if (ch->nstages == XFORM_MAX_STAGES) {
+                fprintf(stderr, "Too many transform stages (max %d).\n",
+                        XFORM_MAX_STAGES);
+                return -1;
+            }
+            struct xform_stage *s = &ch->stage[ch->nstages++];
+            if (n == 5 && !strncmp(spec, "upper", 5)) {
+                s->op = XF_UPPER;
+            } else if (n == 5 && !strncmp(spec, "lower", 5)) {
+                s->op = XF_LOWER;
+            } else if (n == 5 && !strncmp(spec, "rot13", 5)) {
+                s->op = XF_ROT13;
+            } else if (n > 4 && !strncmp(spec, "xor:", 4)) {
+                char *end;
+                long key = strtol(spec + 4, &end, 0);
+                if (end != spec + n || key < 0 || key > 255) {
+                    fprintf(stderr, "Bad xor key in '%.*s'.\n", (int)n, spec);
+                    return -1;
+                }
+                s->op = XF_XOR;
+                s->key = (unsigned char)key;
+            } else {
+                fprintf(stderr, "Unknown transform stage '%.*s'.\n", (int)n, spec);
+                return -1;
+            }
+        }
+        spec += n;
+        if (*spec == ',')
+            ++spec;
+    }
+    return 0;
+}
+
+//Compõe a tabela e escolhe o kernel; chamar uma vez, antes de usar a cadeia
+static inline void xform_build(struct xform_chain *ch) {
+    int b, k;
+    for (b = 0; b < 256; ++b) {
+        unsigned char c = (unsigned char)b;
+        for (k = 0; k < ch->nstages; ++k)
+            c = xform_byte(&ch->stage[k], c);
+        ch->lut[b] = c;
+    }
+    ch->trailer = ch->crc ? XFORM_TRAILER : 0;
+    if (ch->crc)
+        xform_crc_init();
+
+    ch->kernel = xform_scalar;
+    ch->kernel_name = "scalar";
+    if (ch->nstages == 1 && !ch->crc && ch->stage[0].op == XF_UPPER) {
+        ch->kernel = xform_flip_upper;
+        ch->kernel_name = "ascii_toupper";
+        return;
+    }
+    if (ch->nstages == 1 && !ch->crc && ch->stage[0].op == XF_LOWER) {
+        ch->kernel = xform_flip_lower;
+        ch->kernel_name = "ascii_tolower";
+        return;
+    }
+#if defined(HAVE_ASCII_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.2")) {
+        ch->kernel = xform_avx2_select(ch);
+        ch->kernel_name = ch->nstages == 1 ? "avx2 (1 stage)" : "avx2";
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        ch->kernel = xform_sse42;
+        ch->kernel_name = "sse4.2";
+    } else if (!ch->crc && __builtin_cpu_supports("sse2")) {
+        ch->kernel = xform_sse2;
+        ch->kernel_name = "sse2";
+    }
+#endif
+}
+
+//Só os estágios de byte, no lugar
+static inline void xform_bytes(const struct xform_chain *ch, char *buf, size_t len) {
+    if (ch->nstages)
+        ch->kernel(ch, buf, len, 0);
+}
+
+/*
+Mensagem em pedaços (ex.: um quadro TCP que atravessa várias leituras):
+crc começa em xform_crc_start(), passa por xform_update() a cada pedaço e
+xform_crc_put() grava o resultado.
+*/
+static inline uint32_t xform_crc_start(void) {
+    return 0xFFFFFFFFu;
+}
+
+static inline uint32_t xform_update(const struct xform_chain *ch, char *buf,
+        size_t len, uint32_t crc) {
+    return ch->kernel(ch, buf, len, crc);
+}
+
+static inline void xform_crc_put(unsigned char *t, uint32_t crc) {
+    crc = ~crc;
+    t[0] = (unsigned char)(crc >> 24);
+    t[1] = (unsigned char)(crc >> 16);
+    t[2] = (unsigned char)(crc >> 8);
+    t[3] = (unsigned char)crc;
+}
+
+/*
+Mensagem inteira em buf: transforma e, com crc32c, grava o CRC logo depois
+(buf precisa de ch->trailer bytes de folga). Retorna o novo tamanho.
+*/
+static inline size_t xform_apply(const struct xform_chain *ch, char *buf, size_t len) {
+    if (!ch->crc) {
+        xform_bytes(ch, buf, len);
+        return len;
+    }
+    xform_crc_put((unsigned char*)buf + len,
+            xform_update(ch, buf, len, xform_crc_start()));
+    return len + XFORM_TRAILER;
+}
+
+#endif
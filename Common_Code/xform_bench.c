@@ -0,0 +1,480 @@
+/*
+ * Custo de cada estágio de transform.h e da cadeia inteira.
+ *
+ * Para cada estágio sozinho e para a cadeia pedida com -x, transforma o
+ * mesmo buffer repetidas vezes e mostra GB/s e nanossegundos por KB, com o
+ * kernel que xform_build() escolheu. A cadeia é medida de duas formas: numa
+ * passada só (como os servidores a usam) e com uma passada por estágio, que
+ * é o que custaria encadear as funções uma depois da outra.
+ *
+ * Com -m vira um microbenchmark do laço quente, sem rede: para cada tamanho
+ * (16 B a 512 KB), deslocamento em relação à linha de cache, cache quente ou
+ * frio e cada kernel que a CPU suporta (o escalar e os vetoriais), mede
+ * amostras depois de um aquecimento e mostra ciclos por byte (mínimo,
+ * mediana e p90), GB/s da mediana e o coeficiente de variação. Antes de medir
+ * confere que o kernel produz os mesmos bytes e o mesmo CRC que o escalar.
+ *
+ * Os ciclos vêm do TSC, que anda na frequência nominal da CPU e não na do
+ * núcleo: com turbo ou economia de energia eles não são ciclos de núcleo,
+ * mas continuam comparáveis entre execuções na mesma máquina.
+ *
+ *   gcc -O2 xform_bench.c -o xform_bench -lm
+ *   ./xform_bench [-x chain] [-s bytes] [-n repetitions]
+ *   ./xform_bench -m [-x chain] [-S sizes] [-A offsets] [-r samples] [-w warm-up] [-c]
+ */
+
+#include "transform.h"
+#include "mono_clock.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#define MICRO_MAX_LIST 32
+#define MICRO_SAMPLE_BYTES (256 * 1024)         //bytes transformados por amostra
+#define MICRO_COLD_BYTES (64 * 1024 * 1024)     //maior que o último nível de cache
+#define MICRO_STRIDE 4096
+#define MICRO_MAX_VARIANTS 8
+
+static const char *single_stages[] = {
+    "upper", "lower", "rot13", "xor:0x5a", "crc32c",
+};
+
+static void fill_text(char *buf, size_t size) {
+    static const char text[] = "The quick brown fox jumps over the lazy dog 0123456789. ";
+    size_t k;
+    for (k = 0; k < size; ++k)
+        buf[k] = text[k % (sizeof(text) - 1)];
+}
+
+//Nanossegundos por passada de todas as cadeias em chains sobre buf
+static double time_pass(struct xform_chain *chains, int nchains, char *buf,
+        size_t size, long reps) {
+    long r;
+    int k;
+    //aquece o cache e o preditor antes de medir
+    for (r = 0; r < reps / 10 + 1; ++r)
+        for (k = 0; k < nchains; ++k)
+            xform_apply(&chains[k], buf, size);
+    uint64_t start = mono_ns();
+    for (r = 0; r < reps; ++r)
+        for (k = 0; k < nchains; ++k)
+            xform_apply(&chains[k], buf, size);
+    return (double)(mono_ns() - start) / reps;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: xform_bench [-x chain] [-s bytes] [-n repetitions]\n");
+    fprintf(stderr, "       xform_bench -m [-x chain] [-S sizes] [-A offsets] [-r samples] [-w warm-up] [-c]\n");
+    fprintf(stderr, "  -m     sweep sizes, alignments, warm/cold cache and every kernel\n");
+    fprintf(stderr, "  -S L   sizes for -m, e.g. 16,1024,65536 (default 16 B to 512 KB)\n");
+    fprintf(stderr, "  -A L   byte offsets from a cache-line boundary (default 0,1,32)\n");
+    fprintf(stderr, "  -r N   timed samples per point (default 31)\n");
+    fprintf(stderr, "  -w N   untimed warm-up samples per point (default 5)\n");
+    fprintf(stderr, "  -c     CSV output\n");
+}
+
+static void report(const char *name, const char *kernel, size_t size, double ns) {
+    printf("%-28s %-14s %9.2f GB/s %9.1f ns/KB\n", name, kernel,
+            size / ns, ns * 1024.0 / size);
+}
+
+
+/*
+Microbenchmark (-m). Cada amostra chama o kernel inner vezes, o bastante
+para transformar MICRO_SAMPLE_BYTES, e o tempo por chamada é o da amostra
+dividido por inner. Com cache quente todas as chamadas usam o mesmo buffer;
+com cache frio cada chamada pega um buffer diferente, numa ordem embaralhada
+(para o prefetcher não adivinhar) de uma região de MICRO_COLD_BYTES, e quando
+a ordem volta ao mesmo buffer ele já saiu do cache.
+*/
+struct micro_options {
+    size_t sizes[MICRO_MAX_LIST];
+    int nsizes;
+    size_t aligns[MICRO_MAX_LIST];
+    int naligns;
+    int samples;
+    int warmup;
+    int csv;
+};
+
+struct micro_variant {
+    const char *name;
+    xform_kernel kernel;
+};
+
+struct micro_summary {
+    double min, median, p90, mean, cv;
+};
+
+static volatile uint32_t micro_sink;
+
+static inline uint64_t micro_ticks(void) {
+#if defined(HAVE_TSC)
+    return __rdtsc();
+#else
+    return mono_ns();
+#endif
+}
+
+//Ticks do relógio de micro_ticks() por nanossegundo
+static double micro_calibrate(void) {
+#if defined(HAVE_TSC)
+    uint64_t ns0 = mono_ns(), t0 = micro_ticks(), ns1;
+    do
+        ns1 = mono_ns();
+    while (ns1 - ns0 < 50000000u);
+    return (double)(micro_ticks() - t0) / (double)(ns1 - ns0);
+#else
+    return 1.0;
+#endif
+}
+
+//Lista separada por vírgulas; retorna quantos valores ou -1
+static int parse_list(const char *arg, size_t *out, int max, size_t min_value) {
+    int n = 0;
+    char *p = (char*)arg;
+    while (*p) {
+        if (n == max)
+            return -1;
+        char *end;
+        long v = strtol(p, &end, 10);
+        if (end == p || v < (long)min_value || (*end && *end != ','))
+            return -1;
+        out[n++] = (size_t)v;
+        p = *end ? end + 1 : end;
+    }
+    return n ? n : -1;
+}
+
+//O escalar e cada kernel vetorial que esta CPU executa para a cadeia
+static int micro_variants(const struct xform_chain *ch, struct micro_variant *v) {
+    int n = 0;
+    v[n].name = "scalar";
+    v[n++].kernel = xform_scalar;
+    if (ch->kernel == xform_flip_upper || ch->kernel == xform_flip_lower) {
+        v[n].name = ch->kernel_name;
+        v[n++].kernel = ch->kernel;
+    }
+#if defined(HAVE_ASCII_SIMD)
+    __builtin_cpu_init();
+    if (!ch->crc && __builtin_cpu_supports("sse2")) {
+        v[n].name = "sse2";
+        v[n++].kernel = xform_sse2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        v[n].name = "sse4.2";
+        v[n++].kernel = xform_sse42;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.2")) {
+        v[n].name = "avx2";
+        v[n++].kernel = xform_avx2_select(ch);
+    }
+#endif
+    return n;
+}
+
+//Confere bytes e CRC do kernel contra o escalar; retorna -1 se divergirem
+static int micro_check(const struct xform_chain *ch, const struct micro_variant *v,
+        size_t size, size_t align) {
+    char *ref = (char*)malloc(size + align + 64);
+    char *got = (char*)malloc(size + align + 64);
+    int result = 0;
+    if (!ref || !got) {
+        fprintf(stderr, "Out of memory.\n");
+        result = -1;
+    } else {
+        size_t k;
+        fill_text(ref + align, size);
+        //bytes acima de 0x7f também precisam passar intactos pelos estágios
+        for (k = 0; k < size; k += 7)
+            ref[align + k] = (char)(0x80 | (k & 0x7f));
+        memcpy(got + align, ref + align, size);
+        uint32_t want = xform_scalar(ch, ref + align, size, xform_crc_start());
+        uint32_t crc = v->kernel(ch, got + align, size, xform_crc_start());
+        if (memcmp(ref + align, got + align, size) || (ch->crc && crc != want)) {
+            fprintf(stderr, "%s differs from scalar at %lu bytes, offset %lu.\n",
+                    v->name, (unsigned long)size, (unsigned long)align);
+            result = -1;
+        }
+    }
+    free(ref);
+    free(got);
+    return result;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void summarize(double *v, int n, struct micro_summary *out) {
+    double sum = 0, sq = 0;
+    int k;
+    qsort(v, n, sizeof(*v), compare_double);
+    for (k = 0; k < n; ++k)
+        sum += v[k];
+    out->mean = sum / n;
+    for (k = 0; k < n; ++k)
+        sq += (v[k] - out->mean) * (v[k] - out->mean);
+    out->min = v[0];
+    out->median = n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+    out->p90 = v[(int)(0.9 * (n - 1) + 0.5)];
+    out->cv = out->mean > 0 && n > 1 ? sqrt(sq / (n - 1)) / out->mean : 0;
+}
+
+//Uma amostra: inner chamadas seguindo order a partir de *pos
+static uint64_t micro_sample(const struct xform_chain *ch, xform_kernel kernel,
+        char *const *bufs, const size_t *order, size_t nbufs, size_t *pos,
+        size_t size, long inner) {
+    uint32_t crc = 0;
+    long i;
+    uint64_t start = micro_ticks();
+    for (i = 0; i < inner; ++i) {
+        crc ^= kernel(ch, bufs[order[*pos]], size, xform_crc_start());
+        if (++*pos == nbufs)
+            *pos = 0;
+    }
+    uint64_t ticks = micro_ticks() - start;
+    micro_sink = crc;
+    return ticks;
+}
+
+static int run_micro(const char *spec, const struct micro_options *mo) {
+    struct xform_chain chain;
+    if (xform_parse(spec, &chain))
+        return 1;
+    xform_build(&chain);
+    struct micro_variant variants[MICRO_MAX_VARIANTS];
+    int nvariants = micro_variants(&chain, variants);
+
+    size_t max_size = 0, max_align = 0;
+    int k;
+    for (k = 0; k < mo->nsizes; ++k)
+        if (mo->sizes[k] > max_size)
+            max_size = mo->sizes[k];
+    for (k = 0; k < mo->naligns; ++k)
+        if (mo->aligns[k] > max_align)
+            max_align = mo->aligns[k];
+
+    //região do cache frio, alinhada à página e já tocada (sem page faults na medida)
+    size_t region_size = MICRO_COLD_BYTES + max_size + max_align + 2 * MICRO_STRIDE;
+    char *region = (char*)malloc(region_size + MICRO_STRIDE);
+    size_t max_bufs = MICRO_COLD_BYTES / MICRO_STRIDE + 2;
+    char **bufs = (char**)malloc(max_bufs * sizeof(*bufs));
+    size_t *order = (size_t*)malloc(max_bufs * sizeof(*order));
+    double *samples = (double*)malloc(mo->samples * sizeof(*samples));
+    if (!region || !bufs || !order || !samples) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    char *base = (char*)(((uintptr_t)region + MICRO_STRIDE - 1) &
+            ~(uintptr_t)(MICRO_STRIDE - 1));
+    fill_text(base, region_size);
+
+    double ticks_ns = micro_calibrate();
+#if defined(HAVE_TSC)
+    int have_cycles = 1;
+#else
+    int have_cycles = 0;
+#endif
+
+    if (mo->csv) {
+        printf("chain,size,align,cache,kernel,cycles_per_byte_min,cycles_per_byte_median,"
+                "cycles_per_byte_p90,gb_per_s_median,ns_median,cv_pct\n");
+    } else {
+        printf("Chain %s (servers use %s), %d samples after %d warm-up\n",
+                spec, chain.kernel_name, mo->samples, mo->warmup);
+        if (have_cycles)
+            printf("Cycles are TSC ticks at %.3f GHz\n", ticks_ns);
+        else
+            printf("No cycle counter: cycles per byte not available\n");
+        printf("\n%8s %5s %5s %-15s %8s %8s %8s %9s %10s %6s\n", "bytes", "align",
+                "cache", "kernel", "min c/B", "med c/B", "p90 c/B", "GB/s", "ns/call", "cv%");
+    }
+
+    int si, ai, cold, vi;
+    for (si = 0; si < mo->nsizes; ++si) {
+        size_t size = mo->sizes[si];
+        long inner = (long)(MICRO_SAMPLE_BYTES / size);
+        if (inner < 1)
+            inner = 1;
+        for (ai = 0; ai < mo->naligns; ++ai) {
+            size_t align = mo->aligns[ai];
+            for (vi = 0; vi < nvariants; ++vi)
+                if (micro_check(&chain, &variants[vi], size, align))
+                    return 1;
+            for (cold = 0; cold < 2; ++cold) {
+                size_t nbufs = 1;
+                size_t stride = (size + align + MICRO_STRIDE - 1) /
+                    MICRO_STRIDE * MICRO_STRIDE;
+                if (cold) {
+                    nbufs = MICRO_COLD_BYTES / stride;
+                    if (nbufs < 2)
+                        nbufs = 2;
+                }
+                size_t b;
+                for (b = 0; b < nbufs; ++b) {
+                    bufs[b] = base + b * stride + align;
+                    order[b] = b;
+                }
+                //Fisher-Yates com um xorshift fixo: mesma ordem em toda execução
+                uint64_t x = 88172645463325252ull;
+                for (b = nbufs - 1; b > 0; --b) {
+                    x ^= x << 13;
+                    x ^= x >> 7;
+                    x ^= x << 17;
+                    size_t j = (size_t)(x % (b + 1)), t = order[b];
+                    order[b] = order[j];
+                    order[j] = t;
+                }
+
+                for (vi = 0; vi < nvariants; ++vi) {
+                    size_t pos = 0;
+                    int r;
+                    for (r = 0; r < mo->warmup; ++r)
+                        micro_sample(&chain, variants[vi].kernel, bufs, order,
+                                nbufs, &pos, size, inner);
+                    for (r = 0; r < mo->samples; ++r)
+                        samples[r] = (double)micro_sample(&chain, variants[vi].kernel,
+                                bufs, order, nbufs, &pos, size, inner) / inner;
+
+                    //ticks por chamada -> ciclos por byte e GB/s
+                    struct micro_summary st;
+                    summarize(samples, mo->samples, &st);
+                    double ns = st.median / ticks_ns;
+                    double gbs = ns > 0 ? size / ns : 0;
+                    const char *cache = cold ? "cold" : "warm";
+                    if (mo->csv) {
+                        //a cadeia tem vírgulas: vai entre aspas
+                        printf("\"%s\",%lu,%lu,%s,%s,", spec, (unsigned long)size,
+                                (unsigned long)align, cache, variants[vi].name);
+                        if (have_cycles)
+                            printf("%.4f,%.4f,%.4f,", st.min / size,
+                                    st.median / size, st.p90 / size);
+                        else
+                            printf(",,,");
+                        printf("%.3f,%.1f,%.2f\n", gbs, ns, st.cv * 100);
+                    } else if (have_cycles) {
+                        printf("%8lu %5lu %5s %-15s %8.3f %8.3f %8.3f %9.2f %10.1f %6.1f\n",
+                                (unsigned long)size, (unsigned long)align, cache,
+                                variants[vi].name, st.min / size, st.median / size,
+                                st.p90 / size, gbs, ns, st.cv * 100);
+                    } else {
+                        printf("%8lu %5lu %5s %-15s %8s %8s %8s %9.2f %10.1f %6.1f\n",
+                                (unsigned long)size, (unsigned long)align, cache,
+                                variants[vi].name, "-", "-", "-", gbs, ns, st.cv * 100);
+                    }
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+
+    free(samples);
+    free(order);
+    free(bufs);
+    free(region);
+    return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+    const char *spec = "upper,rot13,xor:0x5a,crc32c";
+    size_t size = 64 * 1024;
+    long reps = 20000;
+    int micro = 0;
+    struct micro_options mo;
+    memset(&mo, 0, sizeof(mo));
+    mo.nsizes = parse_list("16,64,256,1024,4096,16384,65536,262144,524288",
+            mo.sizes, MICRO_MAX_LIST, 1);
+    mo.naligns = parse_list("0,1,32", mo.aligns, MICRO_MAX_LIST, 0);
+    mo.samples = 31;
+    mo.warmup = 5;
+
+    int a;
+    for (a = 1; a < argc; ++a) {
+        if (!strcmp(argv[a], "-x") && a + 1 < argc) {
+            spec = argv[++a];
+        } else if (!strcmp(argv[a], "-s") && a + 1 < argc) {
+            size = (size_t)atol(argv[++a]);
+        } else if (!strcmp(argv[a], "-n") && a + 1 < argc) {
+            reps = atol(argv[++a]);
+        } else if (!strcmp(argv[a], "-m")) {
+            micro = 1;
+        } else if (!strcmp(argv[a], "-S") && a + 1 < argc) {
+            mo.nsizes = parse_list(argv[++a], mo.sizes, MICRO_MAX_LIST, 1);
+        } else if (!strcmp(argv[a], "-A") && a + 1 < argc) {
+            mo.naligns = parse_list(argv[++a], mo.aligns, MICRO_MAX_LIST, 0);
+        } else if (!strcmp(argv[a], "-r") && a + 1 < argc) {
+            mo.samples = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "-w") && a + 1 < argc) {
+            mo.warmup = atoi(argv[++a]);
+        } else if (!strcmp(argv[a], "-c")) {
+            mo.csv = 1;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (!size || reps < 1 || mo.nsizes < 0 || mo.naligns < 0 ||
+            mo.samples < 1 || mo.warmup < 0) {
+        usage();
+        return 1;
+    }
+    if (micro)
+        return run_micro(spec, &mo);
+
+    char *buf = (char*)malloc(size + XFORM_TRAILER);
+    if (!buf) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    fill_text(buf, size);
+    printf("%lu-byte buffer, %ld repetitions\n\n", (unsigned long)size, reps);
+
+    struct xform_chain chain;
+    if (xform_parse(spec, &chain))
+        return 1;
+    xform_build(&chain);
+
+    //um estágio por vez, inclusive os que não estão na cadeia
+    size_t k;
+    for (k = 0; k < sizeof(single_stages) / sizeof(single_stages[0]); ++k) {
+        struct xform_chain one;
+        xform_parse(single_stages[k], &one);
+        xform_build(&one);
+        report(single_stages[k], one.kernel_name, size,
+                time_pass(&one, 1, buf, size, reps));
+    }
+    printf("\n");
+
+    //a cadeia fundida e a mesma cadeia com uma passada por estágio
+    struct xform_chain split[XFORM_MAX_STAGES + 1];
+    int nsplit = 0, s;
+    for (s = 0; s < chain.nstages; ++s) {
+        memset(&split[nsplit], 0, sizeof(split[nsplit]));
+        split[nsplit].nstages = 1;
+        split[nsplit].stage[0] = chain.stage[s];
+        xform_build(&split[nsplit++]);
+    }
+    if (chain.crc) {
+        xform_parse("crc32c", &split[nsplit]);
+        xform_build(&split[nsplit++]);
+    }
+    double fused = time_pass(&chain, 1, buf, size, reps);
+    double passes = time_pass(split, nsplit, buf, size, reps);
+    char name[64];
+    report(spec, chain.kernel_name, size, fused);
+    snprintf(name, sizeof(name), "  %d separate passes", nsplit);
+    report(name, "", size, passes);
+    printf("Fused chain: %.2fx the speed of separate passes\n", passes / fused);
+
+    free(buf);
+    return 0;
+}
@@ -23,18 +23,30 @@
  */
 
 #include "chap03.h"
-
-#if defined(_WIN32)
-#include <conio.h>
-#endif
+#include "tcp_pipeline.h"
+#include "tcp_loadgen.h"
 
 #include <stdlib.h>
-#include <time.h>
 
 #define TAM_MESSAGE 512
 #define NUM_MESSAGE 512
 
 #define LOCAL_MACHINE // TEMPO DE EXECUÇÃO EM CASO DE CLIENTE/SERVIDOR RODAREM NA MESMA MAQUINA 
+#define MAX_WINDOWS 32
+
+static void usage(void) {
+    fprintf(stderr, "usage: tcp_client hostname port [-w window[,window...]] [-n messages] [-s size] [-F] [-o]\n");
+    fprintf(stderr, "       tcp_client hostname port -r rate [-c connections] [-t threads] [-d seconds] [-s size] [-F] [-o]\n");
+    fprintf(stderr, "  -w W   pipeline up to W messages; a list runs one pass per window\n");
+    fprintf(stderr, "  -n N   messages per pass (default %d)\n", NUM_MESSAGE);
+    fprintf(stderr, "  -s N   message size in bytes for -w and -r (default %d)\n", TAM_MESSAGE);
+    fprintf(stderr, "  -r R   open-loop load: R msgs/s in total, latency corrected for coordinated omission\n");
+    fprintf(stderr, "  -c C   connections for -r (default 1)\n");
+    fprintf(stderr, "  -t T   threads for -r (default 1)\n");
+    fprintf(stderr, "  -d S   duration of -r in seconds (default 10)\n");
+    fprintf(stderr, "  -F     length-prefixed frames for -w and -r (server started with -f)\n");
+    fprintf(stderr, "  -o     TCP Fast Open: send the first message with the SYN (server started with -o)\n");
+}
 
 int main(int argc, char *argv[]) {
 
@@ -47,10 +59,90 @@ int main(int argc, char *argv[]) {
 #endif
 
     if (argc < 3) {
-        fprintf(stderr, "usage: tcp_client hostname port\n");
+        usage();
         return 1;
     }
 
+    /*
+    Sem -w o cliente envia uma mensagem e espera o eco antes da próxima, como
+    antes. Com -w ele mantém até W mensagens em trânsito (tcp_pipeline.h);
+    -w 1,4,16,64 mede cada janela em sequência na mesma conexão. Com -r o
+    cliente vira gerador de carga em malha aberta (tcp_loadgen.h).
+    */
+    int windows[MAX_WINDOWS];
+    int nwindows = 0;
+    long num_messages = NUM_MESSAGE;
+    int message_size = TAM_MESSAGE;
+    int framed = 0;
+    int fastopen = 0;
+    struct load_options load;
+    memset(&load, 0, sizeof(load));
+    load.connections = 1;
+    load.threads = 1;
+    load.duration = 10;
+    int a;
+    for (a = 3; a < argc; ++a) {
+        if (!strcmp(argv[a], "-r") && a + 1 < argc) {
+            load.rate = atof(argv[++a]);
+            if (load.rate <= 0) {
+                usage();
+                return 1;
+            }
+        } else if (!strcmp(argv[a], "-c") && a + 1 < argc) {
+            load.connections = atoi(argv[++a]);
+            if (load.connections < 1) {
+                usage();
+                return 1;
+            }
+        } else if (!strcmp(argv[a], "-t") && a + 1 < argc) {
+            load.threads = atoi(argv[++a]);
+            if (load.threads < 1) {
+                usage();
+                return 1;
+            }
+#if !defined(HAVE_THREADS)
+            load.threads = 1;
+#endif
+        } else if (!strcmp(argv[a], "-d") && a + 1 < argc) {
+            load.duration = atof(argv[++a]);
+            if (load.duration <= 0) {
+                usage();
+                return 1;
+            }
+        } else if (!strcmp(argv[a], "-F")) {
+            framed = 1;
+        } else if (!strcmp(argv[a], "-o")) {
+            fastopen = 1;
+        } else if (!strcmp(argv[a], "-w") && a + 1 < argc) {
+            char *p = argv[++a];
+            while (*p && nwindows < MAX_WINDOWS) {
+                windows[nwindows] = (int)strtol(p, &p, 10);
+                if (windows[nwindows] < 1 || (*p && *p != ',')) {
+                    usage();
+                    return 1;
+                }
+                nwindows++;
+                if (*p == ',')
+                    p++;
+            }
+        } else if (!strcmp(argv[a], "-n") && a + 1 < argc) {
+            num_messages = atol(argv[++a]);
+            if (num_messages < 1) {
+                usage();
+                return 1;
+            }
+        } else if (!strcmp(argv[a], "-s") && a + 1 < argc) {
+            message_size = atoi(argv[++a]);
+            if (message_size < 1) {
+                usage();
+                return 1;
+            }
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
     printf("Configuring remote address...\n");
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
@@ -71,6 +163,18 @@ int main(int argc, char *argv[]) {
             NI_NUMERICHOST);
     printf("%s %s\n", address_buffer, service_buffer);
 
+    if (load.rate > 0) {
+        load.size = message_size;
+        load.framed = framed;
+        load.fastopen = fastopen;
+        int result = run_loadgen(peer_address, &load);
+        freeaddrinfo(peer_address);
+#if defined(_WIN32)
+        WSACleanup();
+#endif
+        printf("Finished.\n");
+        return result;
+    }
 
     printf("Creating socket...\n");
     SOCKET socket_peer;
@@ -82,6 +186,9 @@ int main(int argc, char *argv[]) {
     }
 
 
+    if (fastopen)
+        pipe_fastopen(socket_peer);
+
     printf("Connecting...\n");
     if (connect(socket_peer,
                 peer_address->ai_addr, peer_address->ai_addrlen)) {
@@ -91,6 +198,43 @@ int main(int argc, char *argv[]) {
     freeaddrinfo(peer_address);
 
     printf("Connected.\n\n");
+
+    if (nwindows) {
+        char *out = (char*)malloc(pipe_wire(message_size, framed));
+        char *expect = (char*)malloc(pipe_wire(message_size, framed));
+        if (!out || !expect) {
+            fprintf(stderr, "Out of memory.\n");
+            return 1;
+        }
+        printf("Pipelining %ld messages of %d bytes per window.\n",
+                num_messages, message_size);
+        int result = 0, w;
+        for (w = 0; w < nwindows && !result; ++w) {
+            struct pipeline_result res;
+            if (run_pipeline(socket_peer, windows[w], num_messages,
+                        message_size, framed, out, expect, &res))
+                result = 1;
+            print_pipeline(windows[w], message_size, &res);
+            if (fastopen && !w)
+                printf("Fast Open: %s\n", pipe_syn_data(socket_peer) > 0 ?
+                        "data sent with the SYN" : "regular handshake (no cookie yet)");
+            if (res.closed) {
+                printf("Connection closed by peer.\n");
+                result = 1;
+            }
+        }
+        free(out);
+        free(expect);
+
+        printf("\nClosing socket...\n");
+        CLOSESOCKET(socket_peer);
+#if defined(_WIN32)
+        WSACleanup();
+#endif
+        printf("Finished.\n");
+        return result;
+    }
+
     printf("To send data, enter text followed by enter.\n");
 
 
@@ -103,70 +247,88 @@ int main(int argc, char *argv[]) {
     char* received_messages = (char*)malloc(sizeof(char)*TAM_MESSAGE);//vetor para recebimento das mensagens
     long int total_receveid = 0;
 
-    
-    //Medição do tempo de round/trip
-    clock_t t; //variável para armazenar tempo
-    t = clock();
+    /*
+    RTT de cada mensagem: do send() até chegar o último byte do seu eco, em
+    tempo de parede (mono_ns()). Como o TCP entrega em ordem, a mensagem k está
+    respondida quando total_receveid passa de (k+1)*TAM_MESSAGE; um eco que
+    chega depois do limite de 100 ms ainda é creditado à mensagem certa.
+    */
+    uint64_t *sent_at = (uint64_t*)malloc(sizeof(uint64_t)*NUM_MESSAGE);
+    struct latency_hist rtt;
+    hist_init(&rtt);
+    long answered = 0;
+    int closed = 0;
+
+    for (int k = 0; k < TAM_MESSAGE; ++k)
+    {
+        send_messages[k] = 'a';
+    }
+
+    uint64_t wall_start = mono_ns();
 
-    while(i<NUM_MESSAGE) {
+    while(i<NUM_MESSAGE && !closed) {
 
         //-------------------------
         
-        for (int i = 0; i < TAM_MESSAGE; ++i)
-        {
-            send_messages[i] = 'a';
-        }
         //if (!fgets(read, 4096, stdin)) break;
         //printf("\nSending: %s\n", read);
-        int bytes_sent = send(socket_peer, send_messages, strlen(send_messages), 0);
+        sent_at[i] = mono_ns();
+        int bytes_sent = send(socket_peer, send_messages, TAM_MESSAGE, 0);
         printf("Sent %d bytes.\n", bytes_sent);
 
         //-------------------------
 
-        fd_set reads;
-        FD_ZERO(&reads);
-        FD_SET(socket_peer, &reads);
-#if !defined(_WIN32)
-        FD_SET(0, &reads);
-#endif
+        //espera o eco completo desta mensagem, por no máximo 100 ms
+        uint64_t deadline = sent_at[i] + 100000000u;
+        while (total_receveid < (long)(i + 1) * TAM_MESSAGE) {
+            uint64_t now = mono_ns();
+            if (now >= deadline)
+                break;
 
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 100000;
+            fd_set reads;
+            FD_ZERO(&reads);
+            FD_SET(socket_peer, &reads);
 
-        if (select(socket_peer+1, &reads, 0, 0, &timeout) < 0) {
-            fprintf(stderr, "select() failed. (%d)\n", GETSOCKETERRNO());
-            return 1;
-        }  
+            struct timeval timeout;
+            timeout.tv_sec = 0;
+            timeout.tv_usec = (long)((deadline - now) / 1000);
 
-        if (FD_ISSET(socket_peer, &reads)) {
-            int bytes_received = recv(socket_peer, received_messages, TAM_MESSAGE, 0);
-            if (bytes_received < 1) {
-                printf("Connection closed by peer.\n");
-                break;
+            if (select(socket_peer+1, &reads, 0, 0, &timeout) < 0) {
+                fprintf(stderr, "select() failed. (%d)\n", GETSOCKETERRNO());
+                return 1;
             }
-            /*printf("\nReceived (%d bytes): %.*s\n",
-                    bytes_received, bytes_received, received_messages);*/
-            printf("Received (%d bytes)\n",bytes_received );
-            total_receveid += bytes_received;
-        }
 
-
-#if defined(_WIN32)
-        if(_kbhit()) {
-#else
-        if(FD_ISSET(0, &reads)) {
-#endif
-    } 
+            if (FD_ISSET(socket_peer, &reads)) {
+                int bytes_received = recv(socket_peer, received_messages, TAM_MESSAGE, 0);
+                if (bytes_received < 1) {
+                    printf("Connection closed by peer.\n");
+                    closed = 1;
+                    break;
+                }
+                /*printf("\nReceived (%d bytes): %.*s\n",
+                        bytes_received, bytes_received, received_messages);*/
+                printf("Received (%d bytes)\n",bytes_received );
+                total_receveid += bytes_received;
+
+                uint64_t arrived = mono_ns();
+                while (total_receveid >= (answered + 1) * TAM_MESSAGE) {
+                    hist_record(&rtt, arrived - sent_at[answered]);
+                    answered++;
+                }
+            }
+        }
     i++;  
     } //end while(1)
 
+    double wall = (double)(mono_ns() - wall_start) / 1e9;
+
 #if defined(LOCAL_MACHINE)
-    //calculo do tempo para o caso de cliente/servidor ocuparem a mesma maquina
-    t = clock() - t;
-    double time = ((double)t)/((CLOCKS_PER_SEC/1000));//tempo em milisegundos
-    printf("\nTime in round/trip : %lf ms \n",time );
+    //tempo de parede da rajada; clock() media só o tempo de CPU do processo
+    printf("\nWall time : %.3lf ms \n", wall * 1e3);
 #endif
+    printf("Throughput : %.0f msgs/s, %.2f MB/s\n",
+            answered / wall, (double)total_receveid / wall / 1e6);
+    hist_print(&rtt, "RTT");
 
     //calculo de perda de dados
     double loss = 0.0;
@@ -183,6 +345,7 @@ int main(int argc, char *argv[]) {
     //Desaloca memoria dinamica
     free(send_messages);//libera o vetor send_messages
     free(received_messages);//libera o vetor received_messages
+    free(sent_at);
 
     printf("\nClosing socket...\n");
     CLOSESOCKET(socket_peer);
@@ -0,0 +1,32 @@
+/*
+ * Protocolo com quadros (opção -f do servidor, -F do cliente).
+ *
+ * Cada mensagem é um cabeçalho de 4 bytes com o tamanho do conteúdo, em
+ * ordem de rede, seguido do conteúdo. O servidor devolve o mesmo cabeçalho e
+ * o conteúdo convertido, e só responde quadros completos; o cliente sabe
+ * exatamente onde cada resposta começa e termina, independente de como o
+ * TCP fatiou os bytes.
+ */
+
+#ifndef TCP_FRAME_H
+#define TCP_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_HEADER 4
+#define FRAME_MAX (16u * 1024 * 1024)   //quadros maiores fecham a conexão
+
+static inline void frame_put_len(unsigned char *p, uint32_t len) {
+    p[0] = (unsigned char)(len >> 24);
+    p[1] = (unsigned char)(len >> 16);
+    p[2] = (unsigned char)(len >> 8);
+    p[3] = (unsigned char)len;
+}
+
+static inline uint32_t frame_get_len(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+        ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+#endif
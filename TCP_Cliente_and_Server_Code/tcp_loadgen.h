@@ -0,0 +1,556 @@
+/*
+ * Gerador de carga em malha aberta do tcp_client: C conexões divididas entre
+ * T threads, a uma taxa agregada alvo de R mensagens por segundo.
+ *
+ * Malha aberta: o horário de envio de cada mensagem é fixado de antemão e não
+ * depende de a resposta anterior já ter chegado. Cada thread percorre as suas
+ * conexões em rodízio; a mensagem k da conexão local c tem horário previsto
+ *
+ *     t0 + (c + k * Ct) * período,  período = 1 / (R * Ct / C)
+ *
+ * e por isso não é preciso guardar horários: dá para calculá-los.
+ *
+ * Omissão coordenada: se o servidor atrasa, um cliente em malha fechada
+ * também atrasa os envios seguintes e as amostras ruins somem da medição.
+ * Aqui a latência é medida a partir do horário previsto, não do envio real, e
+ * o atraso entre um e outro é reportado à parte ("send lag").
+ */
+
+#ifndef TCP_LOADGEN_H
+#define TCP_LOADGEN_H
+
+#include "chap03.h"
+#include "tcp_pipeline.h"
+#include "../Common_Code/mono_clock.h"
+#include "../Common_Code/latency_hist.h"
+#include <stdlib.h>
+#include <time.h>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#define HAVE_THREADS
+#endif
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#define HAVE_EPOLL
+#endif
+
+#define LOAD_DRAIN_NS 2000000000ull      //espera pelos ecos depois do fim
+#define LOAD_MAX_WAIT_NS 10000000ull     //maior espera sem olhar o relógio
+#define LOAD_PRINT_CONNS 32              //acima disso, só o resumo
+#define LOAD_MAX_EVENTS 256
+
+struct load_options {
+    int connections;
+    int threads;
+    double rate;            //mensagens por segundo, somando todas as conexões
+    double duration;        //segundos
+    int size;
+    int framed;             //mensagens em quadros (tcp_frame.h)
+    int fastopen;           //TCP Fast Open nas conexões (-o)
+};
+
+struct load_conn {
+    SOCKET s;
+    int closed;
+    int want_write;         //envio bloqueou com mensagens vencidas
+    long due;               //mensagens cujo horário já passou
+    long sent;              //mensagens escritas por inteiro
+    long received;          //ecos completos
+    long mismatched;
+    int out_off;            //bytes já escritos da mensagem sent
+    int in_off;             //bytes já conferidos do eco received
+    int match;
+    uint64_t lat_sum, lat_max;
+};
+
+struct load_thread {
+    int id;
+    const struct load_options *opts;
+    const struct addrinfo *peer;
+    struct load_conn *conns;
+    int nconns;
+    double period;          //ns entre envios desta thread
+    uint64_t t0, end;
+    struct latency_hist latency;    //corrigida: a partir do horário previsto
+    struct latency_hist lag;        //envio real menos horário previsto
+    long unsent;                    //venceram mas não chegaram a ser escritas
+    int result;
+#if defined(HAVE_THREADS)
+    pthread_t thread;
+#endif
+};
+
+//Sincroniza a partida: todas as threads conectam e depois esperam t0
+static volatile int load_ready;
+static volatile uint64_t load_t0;
+
+static uint64_t load_intended(const struct load_thread *t, int c, long k) {
+    return t->t0 + (uint64_t)(((double)c + (double)k * t->nconns) * t->period);
+}
+
+//Escreve as mensagens vencidas da conexão até o socket bloquear
+static int load_send(struct load_thread *t, int c, char *scratch) {
+    struct load_conn *lc = &t->conns[c];
+    int size = t->opts->size;
+    int wire = pipe_wire(size, t->opts->framed);
+    while (lc->sent < lc->due) {
+        pipe_message(scratch, size, lc->sent, 'a', t->opts->framed);
+        uint64_t now = mono_ns();
+        int r = send(lc->s, scratch + lc->out_off, wire - lc->out_off, SEND_FLAGS);
+        if (r < 0) {
+            if (SOCKETWOULDBLOCK()) {
+                lc->want_write = 1;
+                return 0;
+            }
+            return -1;
+        }
+        //o atraso conta uma vez por mensagem, quando o primeiro byte sai
+        if (lc->out_off == 0 && r > 0) {
+            uint64_t intended = load_intended(t, c, lc->sent);
+            hist_record(&t->lag, now > intended ? now - intended : 0);
+        }
+        lc->out_off += r;
+        if (lc->out_off == wire) {
+            lc->out_off = 0;
+            lc->sent++;
+        }
+    }
+    lc->want_write = 0;
+    return 0;
+}
+
+//Lê o que houver e fecha os ecos completos; -1 quando a conexão acabou
+static int load_recv(struct load_thread *t, int c, char *chunk, char *expect) {
+    struct load_conn *lc = &t->conns[c];
+    int size = t->opts->size;
+    int framed = t->opts->framed;
+    int wire = pipe_wire(size, framed);
+    while (1) {
+        int r = recv(lc->s, chunk, PIPE_RECV_CHUNK, 0);
+        if (r < 0)
+            return SOCKETWOULDBLOCK() ? 0 : -1;
+        if (r == 0)
+            return -1;
+
+        uint64_t now = mono_ns();
+        int off = 0;
+        pipe_message(expect, size, lc->received, 'A', framed);
+        while (off < r) {
+            int n = wire - lc->in_off < r - off ? wire - lc->in_off : r - off;
+            if (memcmp(chunk + off, expect + lc->in_off, n))
+                lc->match = 0;
+            lc->in_off += n;
+            off += n;
+            if (lc->in_off == wire) {
+                uint64_t intended = load_intended(t, c, lc->received);
+                uint64_t latency = now > intended ? now - intended : 0;
+                hist_record(&t->latency, latency);
+                lc->lat_sum += latency;
+                if (latency > lc->lat_max)
+                    lc->lat_max = latency;
+                if (!lc->match)
+                    lc->mismatched++;
+                lc->received++;
+                lc->in_off = 0;
+                lc->match = 1;
+                pipe_message(expect, size, lc->received, 'A', framed);
+            }
+        }
+        if (r < PIPE_RECV_CHUNK)
+            return 0;
+    }
+}
+
+static void load_close(struct load_thread *t, int c) {
+    struct load_conn *lc = &t->conns[c];
+    if (lc->closed)
+        return;
+    lc->closed = 1;
+    CLOSESOCKET(lc->s);
+}
+
+static int load_connect(struct load_thread *t) {
+    int c;
+    for (c = 0; c < t->nconns; ++c) {
+        struct load_conn *lc = &t->conns[c];
+        lc->match = 1;
+        lc->s = socket(t->peer->ai_family, t->peer->ai_socktype,
+                t->peer->ai_protocol);
+        if (!ISVALIDSOCKET(lc->s)) {
+            fprintf(stderr, "socket() failed. (%d)\n", GETSOCKETERRNO());
+            return -1;
+        }
+        if (t->opts->fastopen)
+            pipe_fastopen(lc->s);
+        if (connect(lc->s, t->peer->ai_addr, t->peer->ai_addrlen)) {
+            fprintf(stderr, "connect() failed. (%d)\n", GETSOCKETERRNO());
+            CLOSESOCKET(lc->s);
+            return -1;
+        }
+        pipe_nonblocking(lc->s, 1);
+    }
+    return 0;
+}
+
+#if defined(HAVE_EPOLL)
+/*
+epoll_wait() só aceita milissegundos, o que a taxas altas atrasaria os envios
+ou obrigaria a girar em falso. epoll_pwait2() (Linux 5.11) aceita
+nanossegundos; sem ele, arredonda para cima e o atraso aparece no send lag.
+*/
+static int load_epoll_wait(int epfd, struct epoll_event *events, int max,
+        uint64_t wait_ns) {
+#if defined(SYS_epoll_pwait2)
+    static int no_pwait2;
+    if (!no_pwait2) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)(wait_ns / 1000000000u);
+        ts.tv_nsec = (long)(wait_ns % 1000000000u);
+        int n = (int)syscall(SYS_epoll_pwait2, epfd, events, max, &ts, 0, 0);
+        if (n >= 0 || errno != ENOSYS)
+            return n;
+        no_pwait2 = 1;
+    }
+#endif
+    return epoll_wait(epfd, events, max, (int)((wait_ns + 999999) / 1000000));
+}
+
+static void load_epoll_update(int epfd, struct load_thread *t, int c, int op) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (t->conns[c].want_write ? EPOLLOUT : 0);
+    ev.data.u32 = (unsigned)c;
+    epoll_ctl(epfd, op, t->conns[c].s, &ev);
+}
+#endif
+
+static int load_pending(const struct load_thread *t) {
+    int c;
+    for (c = 0; c < t->nconns; ++c)
+        if (!t->conns[c].closed && t->conns[c].received < t->conns[c].sent)
+            return 1;
+    return 0;
+}
+
+static int load_run(struct load_thread *t) {
+    int wire = pipe_wire(t->opts->size, t->opts->framed);
+    char *scratch = (char*)malloc(wire);
+    char *expect = (char*)malloc(wire);
+    char *chunk = (char*)malloc(PIPE_RECV_CHUNK);
+    if (!scratch || !expect || !chunk) {
+        fprintf(stderr, "Out of memory.\n");
+        return -1;
+    }
+    int c;
+
+#if defined(HAVE_EPOLL)
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        fprintf(stderr, "epoll_create1() failed. (%d)\n", GETSOCKETERRNO());
+        return -1;
+    }
+    for (c = 0; c < t->nconns; ++c)
+        load_epoll_update(epfd, t, c, EPOLL_CTL_ADD);
+    struct epoll_event events[LOAD_MAX_EVENTS];
+#else
+    for (c = 0; c < t->nconns; ++c) {
+        if (t->conns[c].s >= FD_SETSIZE) {
+            fprintf(stderr, "select(): too many connections.\n");
+            return -1;
+        }
+    }
+#endif
+
+    long next = 0;          //próximo envio da thread, em ordem de horário
+    uint64_t drain_end = t->end + LOAD_DRAIN_NS;
+    while (1) {
+        uint64_t now = mono_ns();
+
+        //vence tudo cujo horário já passou e tenta escrever
+        while (now < t->end) {
+            uint64_t when = t->t0 + (uint64_t)(next * t->period);
+            if (when > now || when >= t->end)
+                break;
+            c = (int)(next % t->nconns);
+            next++;
+            struct load_conn *lc = &t->conns[c];
+            if (lc->closed)
+                continue;
+            lc->due++;
+            if (lc->want_write)
+                continue;
+            if (load_send(t, c, scratch) < 0) {
+                load_close(t, c);
+                continue;
+            }
+#if defined(HAVE_EPOLL)
+            if (lc->want_write)
+                load_epoll_update(epfd, t, c, EPOLL_CTL_MOD);
+#endif
+        }
+
+        if (now >= t->end && (now >= drain_end || !load_pending(t)))
+            break;
+
+        uint64_t wait = LOAD_MAX_WAIT_NS;
+        if (now < t->end) {
+            uint64_t when = t->t0 + (uint64_t)(next * t->period);
+            wait = when > now ? when - now : 0;
+            if (wait > LOAD_MAX_WAIT_NS)
+                wait = LOAD_MAX_WAIT_NS;
+        }
+
+#if defined(HAVE_EPOLL)
+        int n = load_epoll_wait(epfd, events, LOAD_MAX_EVENTS, wait);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "epoll_wait() failed. (%d)\n", GETSOCKETERRNO());
+            return -1;
+        }
+        int e;
+        for (e = 0; e < n; ++e) {
+            c = (int)events[e].data.u32;
+            struct load_conn *lc = &t->conns[c];
+            if (lc->closed)
+                continue;
+            if (events[e].events & EPOLLOUT) {
+                if (load_send(t, c, scratch) < 0) {
+                    load_close(t, c);
+                    continue;
+                }
+                if (!lc->want_write)
+                    load_epoll_update(epfd, t, c, EPOLL_CTL_MOD);
+            }
+            if (events[e].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                if (load_recv(t, c, chunk, expect) < 0)
+                    load_close(t, c);
+            }
+        }
+#else
+        fd_set reads, writes;
+        FD_ZERO(&reads);
+        FD_ZERO(&writes);
+        SOCKET max_socket = 0;
+        for (c = 0; c < t->nconns; ++c) {
+            struct load_conn *lc = &t->conns[c];
+            if (lc->closed)
+                continue;
+            FD_SET(lc->s, &reads);
+            if (lc->want_write)
+                FD_SET(lc->s, &writes);
+            if (lc->s > max_socket)
+                max_socket = lc->s;
+        }
+        struct timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = (long)(wait / 1000);
+        if (select(max_socket+1, &reads, &writes, 0, &timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "select() failed. (%d)\n", GETSOCKETERRNO());
+            return -1;
+        }
+        for (c = 0; c < t->nconns; ++c) {
+            struct load_conn *lc = &t->conns[c];
+            if (lc->closed)
+                continue;
+            if (FD_ISSET(lc->s, &writes) && load_send(t, c, scratch) < 0) {
+                load_close(t, c);
+                continue;
+            }
+            if (FD_ISSET(lc->s, &reads) && load_recv(t, c, chunk, expect) < 0)
+                load_close(t, c);
+        }
+#endif
+    }
+
+    for (c = 0; c < t->nconns; ++c) {
+        t->unsent += t->conns[c].due - t->conns[c].sent;
+        load_close(t, c);
+    }
+#if defined(HAVE_EPOLL)
+    close(epfd);
+#endif
+    free(scratch);
+    free(expect);
+    free(chunk);
+    return 0;
+}
+
+static int load_thread_main(struct load_thread *t) {
+#if defined(PR_SET_TIMERSLACK)
+    //a folga padrão de 50 us nos timers viraria atraso em todo envio
+    prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+#endif
+    if (load_connect(t)) {
+        t->result = 1;
+#if defined(HAVE_THREADS)
+        __atomic_add_fetch(&load_ready, 1, __ATOMIC_RELEASE);
+#endif
+        return 1;
+    }
+#if defined(HAVE_THREADS)
+    __atomic_add_fetch(&load_ready, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&load_t0, __ATOMIC_ACQUIRE)) {
+        struct timespec ts = {0, 100000};
+        nanosleep(&ts, 0);
+    }
+#else
+    load_t0 = mono_ns();
+#endif
+    t->t0 = load_t0;
+    t->end = t->t0 + (uint64_t)(t->opts->duration * 1e9);
+    t->result = load_run(t) ? 1 : 0;
+    return t->result;
+}
+
+#if defined(HAVE_THREADS)
+static void *load_thread_entry(void *arg) {
+    load_thread_main((struct load_thread*)arg);
+    return 0;
+}
+#endif
+
+static void load_report(struct load_thread *threads, int nthreads,
+        const struct load_options *opts) {
+    struct latency_hist *latency = (struct latency_hist*)malloc(sizeof(*latency));
+    struct latency_hist *lag = (struct latency_hist*)malloc(sizeof(*lag));
+    if (!latency || !lag) {
+        free(latency);
+        free(lag);
+        return;
+    }
+    hist_init(latency);
+    hist_init(lag);
+
+    long sent = 0, received = 0, unsent = 0, mismatched = 0, incomplete = 0;
+    double min_rate = -1, max_rate = 0;
+    int worst_thread = 0, worst_conn = 0;
+    uint64_t worst_max = 0;
+    int print_conns = opts->connections <= LOAD_PRINT_CONNS;
+    int k, c, id = 0;
+
+    if (print_conns)
+        printf("%6s %10s %10s %10s %10s %10s\n", "conn", "sent", "msgs/s",
+                "mean(us)", "max(us)", "mismatch");
+    for (k = 0; k < nthreads; ++k) {
+        struct load_thread *t = &threads[k];
+        hist_merge(latency, &t->latency);
+        hist_merge(lag, &t->lag);
+        unsent += t->unsent;
+        for (c = 0; c < t->nconns; ++c, ++id) {
+            struct load_conn *lc = &t->conns[c];
+            double rate = lc->received / opts->duration;
+            sent += lc->sent;
+            received += lc->received;
+            mismatched += lc->mismatched;
+            incomplete += lc->received < lc->sent;
+            if (min_rate < 0 || rate < min_rate)
+                min_rate = rate;
+            if (rate > max_rate)
+                max_rate = rate;
+            if (lc->lat_max >= worst_max) {
+                worst_max = lc->lat_max;
+                worst_thread = k;
+                worst_conn = id;
+            }
+            if (print_conns)
+                printf("%6d %10ld %10.0f %10.1f %10.1f %10ld\n", id, lc->sent,
+                        rate, lc->received ? lc->lat_sum / 1e3 / lc->received : 0.0,
+                        lc->lat_max / 1e3, lc->mismatched);
+        }
+    }
+
+    printf("\nTarget     : %.0f msgs/s over %d connections, %d threads, %.1f s\n",
+            opts->rate, opts->connections, nthreads, opts->duration);
+    printf("Sent       : %ld (%.0f msgs/s), %ld due but never written\n",
+            sent, sent / opts->duration, unsent);
+    printf("Received   : %ld (%.0f msgs/s, %.2f MB/s), %ld unanswered, %ld mismatched\n",
+            received, received / opts->duration,
+            (double)received * opts->size / opts->duration / 1e6,
+            sent - received, mismatched);
+    printf("Per conn   : %.0f .. %.0f msgs/s; worst max latency %.1f us "
+            "(conn %d, thread %d)\n", min_rate, max_rate, worst_max / 1e3,
+            worst_conn, worst_thread);
+    if (incomplete)
+        printf("Incomplete : %ld connections with unanswered messages\n", incomplete);
+    hist_print(latency, "Latency (corrected)");
+    hist_print(lag, "Send lag");
+    free(latency);
+    free(lag);
+}
+
+/*
+Conecta as C conexões, dispara as threads com um t0 comum, roda pelo tempo
+pedido (mais até 2 s esperando ecos atrasados) e imprime o resultado.
+*/
+static int run_loadgen(const struct addrinfo *peer, const struct load_options *opts) {
+    int nthreads = opts->threads;
+    if (nthreads > opts->connections)
+        nthreads = opts->connections;
+    struct load_thread *threads =
+        (struct load_thread*)calloc(nthreads, sizeof(*threads));
+    struct load_conn *conns =
+        (struct load_conn*)calloc(opts->connections, sizeof(*conns));
+    if (!threads || !conns) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+
+    int k, first = 0;
+    for (k = 0; k < nthreads; ++k) {
+        struct load_thread *t = &threads[k];
+        t->id = k;
+        t->opts = opts;
+        t->peer = peer;
+        t->nconns = opts->connections / nthreads +
+            (k < opts->connections % nthreads);
+        t->conns = conns + first;
+        first += t->nconns;
+        //cada conexão recebe R / C mensagens por segundo
+        t->period = 1e9 / (opts->rate * t->nconns / opts->connections);
+        hist_init(&t->latency);
+        hist_init(&t->lag);
+    }
+
+    printf("Connecting %d connections from %d thread%s...\n",
+            opts->connections, nthreads, nthreads > 1 ? "s" : "");
+    int result = 0;
+#if defined(HAVE_THREADS)
+    load_ready = 0;
+    load_t0 = 0;
+    for (k = 0; k < nthreads; ++k) {
+        if (pthread_create(&threads[k].thread, 0, load_thread_entry, &threads[k])) {
+            fprintf(stderr, "pthread_create() failed.\n");
+            return 1;
+        }
+    }
+    while (__atomic_load_n(&load_ready, __ATOMIC_ACQUIRE) < nthreads) {
+        struct timespec ts = {0, 1000000};
+        nanosleep(&ts, 0);
+    }
+    printf("Running for %.1f s...\n", opts->duration);
+    fflush(stdout);
+    __atomic_store_n(&load_t0, mono_ns(), __ATOMIC_RELEASE);
+    for (k = 0; k < nthreads; ++k) {
+        pthread_join(threads[k].thread, 0);
+        if (threads[k].result)
+            result = 1;
+    }
+#else
+    result = load_thread_main(&threads[0]);
+#endif
+
+    if (!result)
+        load_report(threads, nthreads, opts);
+    free(threads);
+    free(conns);
+    return result;
+}
+
+#endif
@@ -0,0 +1,173 @@
+/*
+ * Laço de eventos baseado em epoll (Linux). O custo de cada wait é
+ * proporcional ao número de sockets prontos, e não ao maior descritor,
+ * e não há limite fixo de conexões como o FD_SETSIZE do select().
+ */
+
+#ifndef TCP_LOOP_EPOLL_H
+#define TCP_LOOP_EPOLL_H
+
+#include "tcp_server.h"
+
+#if defined(HAVE_EPOLL)
+#include <sys/epoll.h>
+#if defined(EPIOCSPARAMS)
+#include <sys/ioctl.h>
+#endif
+
+#define MAX_EVENTS 256
+
+/*
+Ajusta EPOLLIN/EPOLLOUT ao estado da conexão. Sem interesse nenhum (leitura
+pausada e fila vazia não acontecem juntas) o descritor ficaria só com ERR/HUP.
+*/
+static int epoll_update(int epfd, struct connection *c, SOCKET i, int op) {
+    unsigned ev = conn_interest(c);
+    if (op == EPOLL_CTL_MOD && ev == c->events)
+        return 0;
+    struct epoll_event e;
+    memset(&e, 0, sizeof(e));
+    e.events = ((ev & CONN_READ) ? EPOLLIN : 0) |
+        ((ev & CONN_WRITE) ? EPOLLOUT : 0);
+    e.data.fd = i;
+    if (epoll_ctl(epfd, op, i, &e) < 0) {
+        fprintf(stderr, "epoll_ctl() failed. (%d)\n", GETSOCKETERRNO());
+        return -1;
+    }
+    c->events = ev;
+    return 0;
+}
+
+/*
+Fecha a conexão. Se ela ainda tem envios sem cópia pendentes, conn_close()
+mantém o descritor aberto até o kernel devolver os buffers; ele sai do epoll
+agora para não gerar mais eventos.
+*/
+static void epoll_close(struct worker *w, int epfd, SOCKET i) {
+    if (w->conns[(size_t)i].zc_count)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, i, 0);
+    conn_close(w, i);
+}
+
+static int serve_epoll(struct worker *w) {
+    SOCKET socket_listen = w->socket_listen;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        fprintf(stderr, "epoll_create1() failed. (%d)\n", GETSOCKETERRNO());
+        return 1;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = socket_listen;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, socket_listen, &ev) < 0) {
+        fprintf(stderr, "epoll_ctl() failed. (%d)\n", GETSOCKETERRNO());
+        close(epfd);
+        return 1;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t spin_ns = (uint64_t)w->opts->busy_poll * 1000;
+#if defined(EPIOCSPARAMS)
+    //epoll com busy-poll do kernel (Linux 6.9+)
+    if (spin_ns) {
+        struct epoll_params params;
+        memset(&params, 0, sizeof(params));
+        params.busy_poll_usecs = (uint32_t)w->opts->busy_poll;
+        params.busy_poll_budget = 8;
+        params.prefer_busy_poll = 1;
+        ioctl(epfd, EPIOCSPARAMS, &params);
+    }
+#endif
+
+    while(1) {
+        //com descritores órfãos o laço acorda de tempos em tempos para
+        //recolhê-los; com prazos, no próximo vencimento
+        int timeout = w->norphans ? 100 : -1;
+        int due = tw_timeout(&w->timers, w->now);
+        if (due >= 0 && (timeout < 0 || due < timeout))
+            timeout = due;
+
+        //com -B, consulta sem bloquear até o orçamento acabar e só então dorme
+        int n = 0;
+        if (spin_ns) {
+            uint64_t start = mono_ns();
+            unsigned long polls = 0;
+            do {
+                polls++;
+                n = epoll_wait(epfd, events, MAX_EVENTS, 0);
+            } while (n == 0 && mono_ns() - start < spin_ns);
+            counter_add(&w->stats.spin_polls, polls);
+        }
+        if (n == 0)
+            n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "epoll_wait() failed. (%d)\n", GETSOCKETERRNO());
+            conn_free_all(w);
+            close(epfd);
+            return 1;
+        }
+        uint64_t busy = mono_ns();
+        w->now = busy / 1000000;
+#if defined(HAVE_ZEROCOPY)
+        if (w->norphans)
+            zc_reap_orphans(w);
+#endif
+
+        int k;
+        for (k = 0; k < n; ++k) {
+            SOCKET i = events[k].data.fd;
+            unsigned e = events[k].events;
+
+            if (i == socket_listen) {
+                SOCKET socket_client;
+                while (ISVALIDSOCKET(socket_client = accept_client(w))) {
+                    struct connection *c = &w->conns[socket_client];
+                    if (conn_timer(w, socket_client, c) ||
+                            epoll_update(epfd, c, socket_client, EPOLL_CTL_ADD))
+                        conn_close(w, socket_client);
+                }
+                continue;
+            }
+
+            struct connection *c = &w->conns[(size_t)i];
+            int closed = 0;
+            if (e & EPOLLHUP)
+                closed = 1;
+#if defined(HAVE_ZEROCOPY)
+            //com SO_ZEROCOPY, EPOLLERR também sinaliza avisos na fila de erros;
+            //se não havia aviso nenhum, é um erro de verdade
+            else if ((e & EPOLLERR) && c->zc_on)
+                closed = zc_reap(w, i, c) <= 0;
+#endif
+            else if (e & EPOLLERR)
+                closed = 1;
+            if (!closed && (e & EPOLLOUT))
+                closed = on_writable(w, i) < 0;
+            if (!closed && (e & EPOLLIN) && !c->paused)
+                closed = on_readable(w, i) < 0;
+            if (!closed)
+                closed = conn_timer(w, i, c) < 0;
+
+            //close() já remove o descritor do conjunto do epoll
+            if (closed || epoll_update(epfd, c, i, EPOLL_CTL_MOD))
+                epoll_close(w, epfd, i);
+        } //for k to n
+
+        SOCKET expired;
+        while (ISVALIDSOCKET(expired = conn_next_expired(w)))
+            epoll_close(w, epfd, expired);
+        stats_loop(&w->stats, mono_ns() - busy);
+    } //while(1)
+
+    conn_free_all(w);
+    close(epfd);
+    return 0;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ * Laço de eventos baseado em select(). Portável (inclusive Windows),
+ * mas limitado a FD_SETSIZE sockets e O(max_socket) por iteração.
+ */
+
+#ifndef TCP_LOOP_SELECT_H
+#define TCP_LOOP_SELECT_H
+
+#include "tcp_server.h"
+
+static void select_update(struct connection *c, SOCKET i,
+        fd_set *master_reads, fd_set *master_writes) {
+    unsigned ev = conn_interest(c);
+    if (ev == c->events)
+        return;
+    if (ev & CONN_READ)
+        FD_SET(i, master_reads);
+    else
+        FD_CLR(i, master_reads);
+    if (ev & CONN_WRITE)
+        FD_SET(i, master_writes);
+    else
+        FD_CLR(i, master_writes);
+    c->events = ev;
+}
+
+static int serve_select(struct worker *w) {
+    SOCKET socket_listen = w->socket_listen;
+    fd_set master_reads, master_writes;
+    FD_ZERO(&master_reads);
+    FD_ZERO(&master_writes);
+    FD_SET(socket_listen, &master_reads);
+    SOCKET max_socket = socket_listen;
+    uint64_t spin_ns = (uint64_t)w->opts->busy_poll * 1000;
+
+    while(1) {
+        fd_set reads, writes;
+        int ready = 0;
+        //com prazos, dorme só até o próximo vencimento
+        struct timeval wait, *timeout = 0;
+        int due = tw_timeout(&w->timers, w->now);
+        if (due >= 0) {
+            wait.tv_sec = due / 1000;
+            wait.tv_usec = (due % 1000) * 1000;
+            timeout = &wait;
+        }
+        //com -B, select() com prazo zero até o orçamento acabar; depois dorme
+        if (spin_ns) {
+            uint64_t start = mono_ns();
+            unsigned long polls = 0;
+            do {
+                struct timeval zero;
+                zero.tv_sec = 0;
+                zero.tv_usec = 0;
+                reads = master_reads;
+                writes = master_writes;
+                polls++;
+                ready = select(max_socket+1, &reads, &writes, 0, &zero);
+            } while (ready == 0 && mono_ns() - start < spin_ns);
+            counter_add(&w->stats.spin_polls, polls);
+        }
+        if (ready == 0) {
+            reads = master_reads;
+            writes = master_writes;
+            ready = select(max_socket+1, &reads, &writes, 0, timeout);
+        }
+        if (ready < 0) {
+            fprintf(stderr, "select() failed. (%d)\n", GETSOCKETERRNO());
+            conn_free_all(w);
+            return 1;
+        }
+        uint64_t busy = mono_ns();
+        w->now = busy / 1000000;
+
+        SOCKET i;
+        for(i = 1; i <= max_socket; ++i) {
+            int readable = FD_ISSET(i, &reads);
+            int writable = FD_ISSET(i, &writes);
+            if (!readable && !writable)
+                continue;
+
+            if (i == socket_listen) {
+                SOCKET socket_client;
+                while (ISVALIDSOCKET(socket_client = accept_client(w))) {
+#if !defined(_WIN32)
+                    if (socket_client >= FD_SETSIZE) {
+                        fprintf(stderr, "select(): too many connections.\n");
+                        conn_close(w, socket_client);
+                        continue;
+                    }
+#endif
+                    if (conn_timer(w, socket_client, &w->conns[socket_client])) {
+                        conn_close(w, socket_client);
+                        continue;
+                    }
+                    select_update(&w->conns[socket_client], socket_client,
+                            &master_reads, &master_writes);
+                    if (socket_client > max_socket)
+                        max_socket = socket_client;
+                }
+                continue;
+            }
+
+            struct connection *c = &w->conns[(size_t)i];
+            int closed = 0;
+            if (writable)
+                closed = on_writable(w, i) < 0;
+            if (!closed && readable && !c->paused)
+                closed = on_readable(w, i) < 0;
+            if (!closed)
+                closed = conn_timer(w, i, c) < 0;
+
+            if (closed) {
+                FD_CLR(i, &master_reads);
+                FD_CLR(i, &master_writes);
+                conn_close(w, i);
+            } else {
+                select_update(c, i, &master_reads, &master_writes);
+            }
+        } //for i to max_socket
+
+        while (ISVALIDSOCKET(i = conn_next_expired(w))) {
+            FD_CLR(i, &master_reads);
+            FD_CLR(i, &master_writes);
+            conn_close(w, i);
+        }
+        stats_loop(&w->stats, mono_ns() - busy);
+    } //while(1)
+
+    conn_free_all(w);
+    return 0;
+}
+
+#endif
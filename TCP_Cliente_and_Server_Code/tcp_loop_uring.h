@@ -0,0 +1,628 @@
+/*
+ * Laço de eventos baseado em io_uring (Linux >= 6.0), usando diretamente as
+ * chamadas de sistema, sem liburing:
+ *
+ *  - um accept multishot no socket de escuta gera todas as conexões;
+ *  - um recv multishot por conexão recebe em buffers fornecidos ao kernel
+ *    por um buffer ring (IORING_REGISTER_PBUF_RING);
+ *  - as respostas de cada conexão são enviadas como uma cadeia de sends
+ *    ligados (IOSQE_IO_LINK), preservando a ordem dos bytes;
+ *  - se a fila de uma conexão passa de high_water, o seu recv é cancelado
+ *    e só volta a ser armado quando a fila cai para a metade.
+ *
+ * Assim cada io_uring_enter() submete e colhe lotes inteiros de operações,
+ * em vez de uma chamada de sistema por accept/recv/send. Se o kernel não
+ * suportar alguma dessas operações, serve_uring() devolve URING_UNSUPPORTED
+ * antes de aceitar qualquer conexão e o worker passa a usar o epoll.
+ */
+
+#ifndef TCP_LOOP_URING_H
+#define TCP_LOOP_URING_H
+
+#include "tcp_server.h"
+
+#if defined(HAVE_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define URING_UNSUPPORTED (-2)
+
+#define URING_ENTRIES   1024
+#define URING_BUF_COUNT 512     //potência de 2, no máximo 65536
+#define URING_BUF_SIZE  32768
+#define URING_BGID      0
+
+/*
+user_data de cada SQE: operação (4 bits), buffer (16 bits), geração da
+conexão (12 bits) e descritor (32 bits). A geração descarta completions que
+chegam depois que o descritor foi fechado e reutilizado.
+*/
+enum uring_op {
+    UOP_ACCEPT = 1,
+    UOP_RECV,
+    UOP_SEND,
+    UOP_CANCEL,
+};
+
+#define UD_PACK(op, bid, gen, fd) \
+    (((__u64)(op) << 60) | ((__u64)((bid) & 0xffff) << 44) | \
+     ((__u64)((gen) & 0xfff) << 32) | (__u64)(unsigned)(fd))
+#define UD_OP(ud)  ((int)((ud) >> 60))
+#define UD_BID(ud) ((int)(((ud) >> 44) & 0xffff))
+#define UD_GEN(ud) ((unsigned)(((ud) >> 32) & 0xfff))
+#define UD_FD(ud)  ((int)((ud) & 0xffffffffu))
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sqe_tail;      //próximo SQE livre (ainda não publicado)
+    unsigned long *submit_calls;    //conta os io_uring_enter() só de submissão
+    void *ring_ptr;
+    size_t ring_sz, sqes_sz;
+};
+
+struct uring_conn {
+    int open;
+    unsigned gen;
+    int inflight;           //sends submetidos e ainda sem completion
+    int pend_head, pend_tail; //fila de buffers esperando para serem enviados
+    int dirty;              //está na lista de conexões com envio pendente
+    int starved;            //recv parou por falta de buffers (ENOBUFS)
+    int closing;            //o cliente fechou; fecha depois de esvaziar a fila
+    int recv_armed;         //há um recv multishot ativo
+    int paused;             //recv cancelado porque a fila passou de high_water
+    size_t queued;          //bytes recebidos e ainda não enviados
+};
+
+struct uring_bufs {
+    struct io_uring_buf_ring *ring;
+    char *base;
+    unsigned short tail;    //cauda local, publicada em uring_bufs_publish()
+    int free;
+    int len[URING_BUF_COUNT];
+    int next[URING_BUF_COUNT];  //encadeia buffers na fila de envio
+};
+
+
+static int uring_setup(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+            !(p.features & IORING_FEAT_NODROP)) {
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->ring_sz = sq_sz > cq_sz ? sq_sz : cq_sz;
+    r->ring_ptr = mmap(0, r->ring_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->ring_ptr == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe*)mmap(0, r->sqes_sz,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        munmap(r->ring_ptr, r->ring_sz);
+        close(r->fd);
+        return -1;
+    }
+
+    char *ptr = (char*)r->ring_ptr;
+    r->sq_entries = p.sq_entries;
+    r->sq_head = (unsigned*)(ptr + p.sq_off.head);
+    r->sq_tail = (unsigned*)(ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(ptr + p.sq_off.array);
+    r->cq_head = (unsigned*)(ptr + p.cq_off.head);
+    r->cq_tail = (unsigned*)(ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(ptr + p.cq_off.cqes);
+    r->sqe_tail = *r->sq_tail;
+    return 0;
+}
+
+static void uring_teardown(struct uring *r) {
+    munmap(r->sqes, r->sqes_sz);
+    munmap(r->ring_ptr, r->ring_sz);
+    close(r->fd);
+}
+
+//Verifica se o kernel conhece IORING_OP_SEND_ZC, que chegou junto com o recv multishot (6.0)
+static int uring_probe(struct uring *r) {
+    size_t sz = sizeof(struct io_uring_probe) +
+        256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe*)calloc(1, sz);
+    if (!probe)
+        return 0;
+    int ok = 0;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE,
+                probe, 256) >= 0) {
+        ok = probe->last_op >= IORING_OP_SEND_ZC &&
+            (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+static unsigned uring_sq_space(struct uring *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    return r->sq_entries - (r->sqe_tail - head);
+}
+
+static int uring_enter(struct uring *r, unsigned min_complete) {
+    unsigned to_submit = r->sqe_tail - *r->sq_tail;
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+    do {
+        ret = (int)syscall(__NR_io_uring_enter, r->fd, to_submit,
+                min_complete, flags, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+//Garante n SQEs livres, submetendo o que já foi preparado se preciso
+static int uring_space_or_submit(struct uring *r, unsigned n) {
+    if (uring_sq_space(r) >= n)
+        return 1;
+    uring_enter(r, 0);
+    if (r->submit_calls)
+        counter_add(r->submit_calls, 1);
+    return uring_sq_space(r) >= n;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *r) {
+    if (!uring_space_or_submit(r, 1))
+        return 0;
+    unsigned idx = r->sqe_tail & *r->sq_mask;
+    r->sq_array[idx] = idx;
+    r->sqe_tail++;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+
+static int uring_bufs_init(struct uring *r, struct uring_bufs *b) {
+    memset(b, 0, sizeof(*b));
+    size_t ring_sz = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    b->ring = (struct io_uring_buf_ring*)mmap(0, ring_sz,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->ring == MAP_FAILED)
+        return -1;
+    b->base = (char*)malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (!b->base) {
+        munmap(b->ring, ring_sz);
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (__u64)(unsigned long)b->ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0) {
+        free(b->base);
+        munmap(b->ring, ring_sz);
+        return -1;
+    }
+    return 0;
+}
+
+static void uring_bufs_free(struct uring_bufs *b) {
+    free(b->base);
+    munmap(b->ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+}
+
+//Devolve um buffer ao kernel; só fica visível após uring_bufs_publish()
+static void uring_bufs_recycle(struct uring_bufs *b, int bid) {
+    struct io_uring_buf *buf = &b->ring->bufs[b->tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (__u64)(unsigned long)(b->base + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = (unsigned short)bid;
+    b->tail++;
+    b->free++;
+}
+
+static void uring_bufs_publish(struct uring_bufs *b) {
+    __atomic_store_n(&b->ring->tail, b->tail, __ATOMIC_RELEASE);
+}
+
+
+struct uring_server {
+    struct uring ring;
+    struct uring_bufs bufs;
+    struct uring_conn *conns;   //indexado pelo descritor
+    int nconns;
+    int *dirty;                 //conexões com buffers esperando envio
+    int ndirty, cap_dirty;
+    int *starved;               //conexões cujo recv precisa ser rearmado
+    int nstarved, cap_starved;
+    SOCKET socket_listen;
+    size_t high_water;
+    const struct xform_chain *xform;
+    struct server_stats *stats;
+    int accepted;
+};
+
+static int uring_push_fd(int **list, int *n, int *cap, int fd) {
+    if (*n == *cap) {
+        int new_cap = *cap ? *cap * 2 : 64;
+        int *p = (int*)realloc(*list, new_cap * sizeof(int));
+        if (!p)
+            return -1;
+        *list = p;
+        *cap = new_cap;
+    }
+    (*list)[(*n)++] = fd;
+    return 0;
+}
+
+static struct uring_conn *uring_conn_get(struct uring_server *s, int fd) {
+    if (fd >= s->nconns) {
+        int n = s->nconns ? s->nconns : 1024;
+        while (n <= fd)
+            n *= 2;
+        struct uring_conn *p = (struct uring_conn*)realloc(s->conns,
+                n * sizeof(*p));
+        if (!p)
+            return 0;
+        memset(p + s->nconns, 0, (n - s->nconns) * sizeof(*p));
+        s->conns = p;
+        s->nconns = n;
+    }
+    return &s->conns[fd];
+}
+
+static int uring_arm_accept(struct uring_server *s) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = s->socket_listen;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = UD_PACK(UOP_ACCEPT, 0, 0, s->socket_listen);
+    return 0;
+}
+
+static int uring_arm_recv(struct uring_server *s, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = UD_PACK(UOP_RECV, 0, s->conns[fd].gen, fd);
+    s->conns[fd].recv_armed = 1;
+    return 0;
+}
+
+static void uring_cancel_recv(struct uring_server *s, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = UD_PACK(UOP_RECV, 0, s->conns[fd].gen, fd);
+    sqe->user_data = UD_PACK(UOP_CANCEL, 0, 0, fd);
+}
+
+static void uring_close_conn(struct uring_server *s, int fd) {
+    struct uring_conn *c = &s->conns[fd];
+    if (!c->open)
+        return;
+    c->open = 0;
+    counter_add(&s->stats->closed, 1);
+    //buffers ainda não submetidos voltam já; os em voo voltam na completion
+    while (c->pend_head >= 0) {
+        int bid = c->pend_head;
+        c->pend_head = s->bufs.next[bid];
+        uring_bufs_recycle(&s->bufs, bid);
+    }
+    //shutdown() encerra o recv multishot, que segura uma referência ao socket
+    shutdown(fd, SHUT_RDWR);
+    CLOSESOCKET(fd);
+}
+
+/*
+Submete como uma cadeia de sends ligados tudo o que está na fila da conexão.
+Só há uma cadeia em voo por conexão, para que a ordem dos bytes se mantenha.
+*/
+static void uring_flush_conn(struct uring_server *s, int fd) {
+    struct uring_conn *c = &s->conns[fd];
+    c->dirty = 0;
+    if (!c->open || c->inflight || c->pend_head < 0)
+        return;
+
+    int n = 0, bid;
+    for (bid = c->pend_head; bid >= 0; bid = s->bufs.next[bid])
+        ++n;
+    if ((unsigned)n > s->ring.sq_entries)
+        n = s->ring.sq_entries;
+    uring_space_or_submit(&s->ring, n);
+
+    int k;
+    for (k = 0; k < n; ++k) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&s->ring);
+        if (!sqe)
+            break;
+        bid = c->pend_head;
+        c->pend_head = s->bufs.next[bid];
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = (__u64)(unsigned long)(s->bufs.base + (size_t)bid * URING_BUF_SIZE);
+        sqe->len = s->bufs.len[bid];
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        if (k + 1 < n && c->pend_head >= 0)
+            sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = UD_PACK(UOP_SEND, bid, c->gen, fd);
+        c->inflight++;
+    }
+    if (c->pend_head < 0)
+        c->pend_tail = -1;
+}
+
+static void uring_mark_dirty(struct uring_server *s, int fd) {
+    struct uring_conn *c = &s->conns[fd];
+    if (!c->dirty) {
+        c->dirty = 1;
+        uring_push_fd(&s->dirty, &s->ndirty, &s->cap_dirty, fd);
+    }
+}
+
+
+static int uring_on_accept(struct uring_server *s, struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        uring_arm_accept(s);
+
+    if (cqe->res < 0) {
+        if (!s->accepted && (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP))
+            return URING_UNSUPPORTED;
+        fprintf(stderr, "accept() failed. (%d)\n", -cqe->res);
+        return 0;
+    }
+
+    int fd = cqe->res;
+    set_nodelay(fd);
+    struct uring_conn *c = uring_conn_get(s, fd);
+    if (!c) {
+        fprintf(stderr, "Out of memory.\n");
+        CLOSESOCKET(fd);
+        return 0;
+    }
+    s->accepted++;
+    counter_add(&s->stats->accepted, 1);
+    c->open = 1;
+    c->gen++;
+    c->inflight = 0;
+    c->pend_head = c->pend_tail = -1;
+    c->dirty = 0;
+    c->starved = 0;
+    c->closing = 0;
+    c->recv_armed = 0;
+    c->paused = 0;
+    c->queued = 0;
+
+    struct sockaddr_storage client_address;
+    socklen_t client_len = sizeof(client_address);
+    char address_buffer[100];
+    if (log_level >= LOG_INFO &&
+            !getpeername(fd, (struct sockaddr*)&client_address, &client_len)) {
+        getnameinfo((struct sockaddr*)&client_address,
+                client_len,
+                address_buffer, sizeof(address_buffer), 0, 0,
+                NI_NUMERICHOST);
+        printf("New connection from %s\n", address_buffer);
+    }
+
+    uring_arm_recv(s, fd);
+    return 0;
+}
+
+static void uring_on_recv(struct uring_server *s, struct io_uring_cqe *cqe) {
+    int fd = UD_FD(cqe->user_data);
+    int bid = -1;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        s->bufs.free--;
+    }
+
+    struct uring_conn *c = fd < s->nconns ? &s->conns[fd] : 0;
+    if (!c || !c->open || c->gen != UD_GEN(cqe->user_data)) {
+        if (bid >= 0)
+            uring_bufs_recycle(&s->bufs, bid);
+        return;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+        c->recv_armed = 0;
+
+    if (cqe->res <= 0) {
+        if (bid >= 0)
+            uring_bufs_recycle(&s->bufs, bid);
+        if (cqe->res == -ENOBUFS) {
+            c->starved = 1;
+            uring_push_fd(&s->starved, &s->nstarved, &s->cap_starved, fd);
+        } else if (cqe->res == -ECANCELED) {
+            //cancelado por high_water; se a fila já esvaziou, volta a ler
+            if (!c->paused && !c->recv_armed)
+                uring_arm_recv(s, fd);
+        } else if (cqe->res == 0 && (c->inflight || c->pend_head >= 0)) {
+            c->closing = 1;
+        } else {
+            uring_close_conn(s, fd);
+        }
+        return;
+    }
+
+    counter_add(&s->stats->bytes_in, cqe->res);
+    counter_add(&s->stats->messages, 1);
+    xform_bytes(s->xform, s->bufs.base + (size_t)bid * URING_BUF_SIZE, cqe->res);
+
+    s->bufs.len[bid] = cqe->res;
+    s->bufs.next[bid] = -1;
+    if (c->pend_tail >= 0)
+        s->bufs.next[c->pend_tail] = bid;
+    else
+        c->pend_head = bid;
+    c->pend_tail = bid;
+    c->queued += cqe->res;
+    uring_mark_dirty(s, fd);
+
+    if (!c->paused && c->queued > s->high_water) {
+        c->paused = 1;
+        if (c->recv_armed)
+            uring_cancel_recv(s, fd);
+    }
+    if (!c->recv_armed && !c->paused)
+        uring_arm_recv(s, fd);
+}
+
+static void uring_on_send(struct uring_server *s, struct io_uring_cqe *cqe) {
+    int fd = UD_FD(cqe->user_data);
+    int bid = UD_BID(cqe->user_data);
+    int len = s->bufs.len[bid];
+    uring_bufs_recycle(&s->bufs, bid);
+
+    struct uring_conn *c = fd < s->nconns ? &s->conns[fd] : 0;
+    if (!c || !c->open || c->gen != UD_GEN(cqe->user_data))
+        return;
+
+    c->inflight--;
+    c->queued -= len;
+    //MSG_WAITALL: um envio curto só acontece em caso de erro
+    if (cqe->res < len) {
+        uring_close_conn(s, fd);
+        return;
+    }
+    counter_add(&s->stats->bytes_out, len);
+    if (c->paused && c->queued <= s->high_water / 2) {
+        c->paused = 0;
+        c->starved = 0;
+        if (!c->recv_armed && !c->closing)
+            uring_arm_recv(s, fd);
+    }
+    if (!c->inflight && c->pend_head >= 0)
+        uring_mark_dirty(s, fd);
+    else if (!c->inflight && c->closing)
+        uring_close_conn(s, fd);
+}
+
+
+static int serve_uring(struct worker *w) {
+    struct uring_server s;
+    memset(&s, 0, sizeof(s));
+    s.socket_listen = w->socket_listen;
+    s.high_water = w->opts->high_water;
+    s.xform = &w->opts->xform;
+    s.stats = &w->stats;
+
+    if (uring_setup(&s.ring, URING_ENTRIES) < 0) {
+        fprintf(stderr, "io_uring_setup() failed. (%d)\n", GETSOCKETERRNO());
+        return URING_UNSUPPORTED;
+    }
+    if (!uring_probe(&s.ring)) {
+        fprintf(stderr, "io_uring: kernel lacks multishot recv.\n");
+        uring_teardown(&s.ring);
+        return URING_UNSUPPORTED;
+    }
+    if (uring_bufs_init(&s.ring, &s.bufs) < 0) {
+        fprintf(stderr, "io_uring: buffer ring registration failed. (%d)\n",
+                GETSOCKETERRNO());
+        uring_teardown(&s.ring);
+        return URING_UNSUPPORTED;
+    }
+    //o io_uring_enter() do laço entra em wait_calls, pelo stats_loop(); os
+    //de fila cheia submetem sends e contam como send_calls
+    s.ring.submit_calls = &w->stats.send_calls;
+
+    int bid;
+    for (bid = 0; bid < URING_BUF_COUNT; ++bid)
+        uring_bufs_recycle(&s.bufs, bid);
+    uring_bufs_publish(&s.bufs);
+
+    uring_arm_accept(&s);
+
+    int result = 0;
+    while (!result) {
+        if (uring_enter(&s.ring, 1) < 0) {
+            fprintf(stderr, "io_uring_enter() failed. (%d)\n", GETSOCKETERRNO());
+            result = 1;
+            break;
+        }
+        uint64_t busy = mono_ns();
+
+        unsigned head = *s.ring.cq_head;
+        unsigned tail = __atomic_load_n(s.ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head) {
+            struct io_uring_cqe *cqe = &s.ring.cqes[head & *s.ring.cq_mask];
+            switch (UD_OP(cqe->user_data)) {
+            case UOP_ACCEPT:
+                result = uring_on_accept(&s, cqe);
+                break;
+            case UOP_RECV:
+                uring_on_recv(&s, cqe);
+                break;
+            case UOP_SEND:
+                uring_on_send(&s, cqe);
+                break;
+            }
+            if (result)
+                break;
+        }
+        __atomic_store_n(s.ring.cq_head, head, __ATOMIC_RELEASE);
+
+        int k;
+        for (k = 0; k < s.ndirty; ++k)
+            uring_flush_conn(&s, s.dirty[k]);
+        s.ndirty = 0;
+
+        uring_bufs_publish(&s.bufs);
+        if (s.nstarved && s.bufs.free > 0) {
+            for (k = 0; k < s.nstarved; ++k) {
+                int fd = s.starved[k];
+                if (s.conns[fd].open && s.conns[fd].starved &&
+                        !s.conns[fd].paused && !s.conns[fd].recv_armed) {
+                    s.conns[fd].starved = 0;
+                    uring_arm_recv(&s, fd);
+                }
+            }
+            s.nstarved = 0;
+        }
+        stats_loop(s.stats, mono_ns() - busy);
+    }
+
+    int fd;
+    for (fd = 0; fd < s.nconns; ++fd)
+        if (s.conns[fd].open)
+            CLOSESOCKET(fd);
+    uring_teardown(&s.ring);
+    uring_bufs_free(&s.bufs);
+    free(s.conns);
+    free(s.dirty);
+    free(s.starved);
+    return result;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * Modo pipeline do tcp_client: até W mensagens em trânsito ao mesmo tempo.
+ *
+ * O lado de envio e o de recepção são independentes; o envio só pára quando
+ * a janela está cheia ou o socket não aceita mais dados. Como o TCP entrega
+ * em ordem e o servidor responde cada byte com um byte, a k-ésima mensagem de
+ * TAM bytes recebida é o eco da k-ésima enviada. Cada mensagem leva no início
+ * o seu número de sequência em decimal (dígitos não mudam com toupper()), o
+ * que permite conferir que o eco corresponde ao pedido.
+ *
+ * A latência de cada mensagem vai do primeiro byte enviado ao último byte do
+ * eco; o instante de envio fica num anel de window posições, indexado pela
+ * sequência, alocado uma vez por passada.
+ *
+ * Com -F cada mensagem vai num quadro (tcp_frame.h); o cabeçalho volta
+ * intacto e faz parte do que é conferido.
+ */
+
+#ifndef TCP_PIPELINE_H
+#define TCP_PIPELINE_H
+
+#include "chap03.h"
+#include "../Common_Code/mono_clock.h"
+#include "../Common_Code/latency_hist.h"
+#include "tcp_frame.h"
+#include <stdlib.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#endif
+
+#if defined(MSG_NOSIGNAL)
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+#define PIPE_SEQ_DIGITS 8
+#define PIPE_RECV_CHUNK 65536
+
+struct pipeline_result {
+    long messages;
+    long mismatched;        //ecos que não batem com a mensagem enviada
+    uint64_t elapsed_ns;
+    int closed;             //servidor fechou antes do fim
+    struct latency_hist rtt;
+};
+
+/*
+TCP Fast Open no cliente (-o): com TCP_FASTOPEN_CONNECT o connect() volta na
+hora e o primeiro send() vai junto com o SYN, se houver cookie do servidor
+(a primeira conexão só obtém o cookie). Chamar antes do connect().
+*/
+static int pipe_fastopen(SOCKET s) {
+#if defined(TCP_FASTOPEN_CONNECT)
+    int yes = 1;
+    if (setsockopt(s, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (void*)&yes, sizeof(yes))) {
+        fprintf(stderr, "setsockopt(TCP_FASTOPEN_CONNECT) failed. (%d)\n",
+                GETSOCKETERRNO());
+        return -1;
+    }
+    return 0;
+#else
+    (void)s;
+    fprintf(stderr, "TCP Fast Open not available.\n");
+    return -1;
+#endif
+}
+
+//1 se o SYN levou dados (Fast Open com cookie), 0 se não, -1 se não se sabe
+static int pipe_syn_data(SOCKET s) {
+#if defined(TCP_INFO) && defined(TCPI_OPT_SYN_DATA)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(s, IPPROTO_TCP, TCP_INFO, (void*)&info, &len))
+        return -1;
+    return (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+#else
+    (void)s;
+    return -1;
+#endif
+}
+
+static int pipe_nonblocking(SOCKET s, int on) {
+#if defined(_WIN32)
+    u_long mode = on;
+    return ioctlsocket(s, FIONBIO, &mode);
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(s, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+#endif
+}
+
+//Mensagem seq: número com PIPE_SEQ_DIGITS dígitos seguido de 'a' até size
+static void pipe_fill(char *buf, int size, long seq, char fill) {
+    char digits[24];
+    memset(buf, fill, size);
+    snprintf(digits, sizeof(digits), "%0*lu", PIPE_SEQ_DIGITS,
+            (unsigned long)seq % 100000000ul);
+    memcpy(buf, digits, size < PIPE_SEQ_DIGITS ? size : PIPE_SEQ_DIGITS);
+}
+
+//Tamanho da mensagem no fio
+static inline int pipe_wire(int size, int framed) {
+    return framed ? size + FRAME_HEADER : size;
+}
+
+//Monta a mensagem seq como vai no fio; retorna o tamanho
+static int pipe_message(char *buf, int size, long seq, char fill, int framed) {
+    if (!framed) {
+        pipe_fill(buf, size, seq, fill);
+        return size;
+    }
+    frame_put_len((unsigned char*)buf, (uint32_t)size);
+    pipe_fill(buf + FRAME_HEADER, size, seq, fill);
+    return size + FRAME_HEADER;
+}
+
+/*
+Envia count mensagens de size bytes com no máximo window delas sem eco.
+out e expect precisam de pipe_wire(size, framed) bytes; o socket volta a ser
+bloqueante no fim. Retorna -1 em erro de socket.
+*/
+static int run_pipeline(SOCKET s, int window, long count, int size, int framed,
+        char *out, char *expect, struct pipeline_result *res) {
+    int wire = pipe_wire(size, framed);
+    char *chunk = (char*)malloc(PIPE_RECV_CHUNK);
+    uint64_t *sent_at = (uint64_t*)malloc(window * sizeof(uint64_t));
+    memset(res, 0, sizeof(*res));
+    hist_init(&res->rtt);
+    if (!chunk || !sent_at) {
+        fprintf(stderr, "Out of memory.\n");
+        free(chunk);
+        free(sent_at);
+        return -1;
+    }
+    pipe_nonblocking(s, 1);
+
+    long sent = 0, received = 0;
+    int out_off = wire;     //== wire: nenhuma mensagem pela metade
+    int in_off = 0;         //bytes já conferidos do eco atual
+    int match = 1;
+    int result = 0;
+    pipe_message(expect, size, 0, 'A', framed);
+
+    uint64_t start = mono_ns();
+    while (received < count) {
+        int want_write = out_off < wire || (sent < count && sent - received < window);
+
+        fd_set reads, writes;
+        FD_ZERO(&reads);
+        FD_ZERO(&writes);
+        FD_SET(s, &reads);
+        if (want_write)
+            FD_SET(s, &writes);
+        if (select(s+1, &reads, &writes, 0, 0) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "select() failed. (%d)\n", GETSOCKETERRNO());
+            result = -1;
+            break;
+        }
+
+        if (FD_ISSET(s, &writes)) {
+            while (1) {
+                if (out_off == wire) {
+                    if (sent >= count || sent - received >= window)
+                        break;
+                    pipe_message(out, size, sent, 'a', framed);
+                    out_off = 0;
+                    sent_at[sent % window] = mono_ns();
+                }
+                int r = send(s, out + out_off, wire - out_off, SEND_FLAGS);
+                if (r < 0) {
+                    if (SOCKETWOULDBLOCK())
+                        break;
+                    fprintf(stderr, "send() failed. (%d)\n", GETSOCKETERRNO());
+                    result = -1;
+                    goto done;
+                }
+                out_off += r;
+                if (out_off == wire)
+                    sent++;
+            }
+        }
+
+        if (FD_ISSET(s, &reads)) {
+            int r = recv(s, chunk, PIPE_RECV_CHUNK, 0);
+            if (r < 0) {
+                if (SOCKETWOULDBLOCK())
+                    continue;
+                fprintf(stderr, "recv() failed. (%d)\n", GETSOCKETERRNO());
+                result = -1;
+                break;
+            }
+            if (r == 0) {
+                res->closed = 1;
+                break;
+            }
+
+            //confere o eco contra a mensagem esperada, pedaço a pedaço
+            uint64_t now = mono_ns();
+            int off = 0;
+            while (off < r) {
+                int n = wire - in_off < r - off ? wire - in_off : r - off;
+                if (memcmp(chunk + off, expect + in_off, n))
+                    match = 0;
+                in_off += n;
+                off += n;
+                if (in_off == wire) {
+                    if (!match)
+                        res->mismatched++;
+                    hist_record(&res->rtt, now - sent_at[received % window]);
+                    received++;
+                    in_off = 0;
+                    match = 1;
+                    pipe_message(expect, size, received, 'A', framed);
+                }
+            }
+        }
+    }
+done:
+    res->elapsed_ns = mono_ns() - start;
+    res->messages = received;
+    pipe_nonblocking(s, 0);
+    free(chunk);
+    free(sent_at);
+    return result;
+}
+
+static void print_pipeline(int window, int size, const struct pipeline_result *res) {
+    double seconds = res->elapsed_ns / 1e9;
+    if (seconds <= 0)
+        seconds = 1e-9;
+    printf("Window %5d: %10.0f msgs/s %10.2f MB/s (%ld messages in %.1f ms",
+            window, res->messages / seconds,
+            (double)res->messages * size / seconds / 1e6,
+            res->messages, res->elapsed_ns / 1e6);
+    if (res->mismatched)
+        printf(", %ld mismatched", res->mismatched);
+    printf(")\n");
+    hist_print(&res->rtt, "  RTT");
+}
+
+#endif
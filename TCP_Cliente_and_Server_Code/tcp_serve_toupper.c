@@ -22,10 +22,359 @@
  * SOFTWARE.
  */
 
+//necessário para sched_setaffinity() e CPU_SET()
+#if !defined(_GNU_SOURCE) && !defined(_WIN32)
+#define _GNU_SOURCE
+#endif
+
 #include "chap03.h"
-#include <ctype.h>
+#include "tcp_server.h"
+#include "tcp_loop_select.h"
+#include "tcp_loop_epoll.h"
+#include "tcp_loop_uring.h"
+
+
+static void usage(void) {
+    fprintf(stderr, "usage: tcp_serve_toupper [-e select|epoll|uring] [-t threads] [-a] [-q bytes] [-H] [-f] [-z bytes] [-x chain]\n"
+            "                         [-B usec] [-I seconds] [-R seconds] [-l backlog] [-d seconds] [-o qlen]\n"
+            "                         [-S port] [-D seconds] [-v]\n");
+    fprintf(stderr, "  -t N   number of workers (0 = one per online CPU)\n");
+    fprintf(stderr, "  -a     pin worker k to CPU k\n");
+    fprintf(stderr, "  -q N   stop reading a connection with more than N bytes queued\n");
+    fprintf(stderr, "  -H     back the buffer pool with huge pages when available\n");
+    fprintf(stderr, "  -f     length-prefixed framing: echo only complete frames\n");
+    fprintf(stderr, "  -z N   send responses of N bytes or more with MSG_ZEROCOPY (0 = %d)\n",
+            ZC_THRESHOLD);
+    fprintf(stderr, "  -x S   payload transform chain, e.g. upper | rot13,xor:0x5a | lower,crc32c\n");
+    fprintf(stderr, "         stages: upper lower rot13 xor:N crc32c (default upper; crc32c needs -f)\n");
+    fprintf(stderr, "  -B N   busy-poll N microseconds before sleeping, implies -a (0 = %d)\n",
+            BUSY_POLL_US);
+    fprintf(stderr, "  -I N   close connections idle for N seconds\n");
+    fprintf(stderr, "  -R N   close connections that take over N seconds to complete a frame (needs -f)\n");
+    fprintf(stderr, "  -l N   listen() backlog (default %d)\n", LISTEN_BACKLOG);
+    fprintf(stderr, "  -d N   TCP_DEFER_ACCEPT: wake up only when data arrives, within N seconds\n");
+    fprintf(stderr, "  -o N   TCP_FASTOPEN with a queue of N pending SYNs with data\n");
+    fprintf(stderr, "  -S N   serve a metrics snapshot on 127.0.0.1:N\n");
+    fprintf(stderr, "  -D N   print the metrics snapshot every N seconds\n");
+    fprintf(stderr, "  -v     log every connection\n");
+}
+
+static int online_cpus(void) {
+#if defined(_WIN32)
+    return 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+static int parse_options(int argc, char *argv[], struct server_options *opts) {
+#if defined(HAVE_EPOLL)
+    opts->engine = ENGINE_EPOLL;
+#else
+    opts->engine = ENGINE_SELECT;
+#endif
+    opts->threads = 1;
+    opts->pin_cpus = 0;
+    opts->high_water = OUT_HIGH_WATER;
+    opts->hugepages = 0;
+    opts->framed = 0;
+    opts->zerocopy = 0;
+    opts->busy_poll = 0;
+    opts->idle_timeout = 0;
+    opts->read_timeout = 0;
+    opts->backlog = LISTEN_BACKLOG;
+    opts->defer_accept = 0;
+    opts->fastopen = 0;
+    opts->stats.port = 0;
+    opts->stats.interval = 0;
+    const char *chain = "upper";
+
+    int a;
+    for (a = 1; a < argc; ++a) {
+        if (!strcmp(argv[a], "-e") && a + 1 < argc) {
+            const char *name = argv[++a];
+            if (!strcmp(name, "select")) {
+                opts->engine = ENGINE_SELECT;
+            } else if (!strcmp(name, "epoll")) {
+#if defined(HAVE_EPOLL)
+                opts->engine = ENGINE_EPOLL;
+#else
+                fprintf(stderr, "epoll not available, using select.\n");
+                opts->engine = ENGINE_SELECT;
+#endif
+            } else if (!strcmp(name, "uring")) {
+#if defined(HAVE_IO_URING)
+                opts->engine = ENGINE_URING;
+#else
+                fprintf(stderr, "io_uring not available, using %s.\n",
+                        opts->engine == ENGINE_EPOLL ? "epoll" : "select");
+#endif
+            } else {
+                usage();
+                return -1;
+            }
+        } else if (!strcmp(argv[a], "-t") && a + 1 < argc) {
+            opts->threads = atoi(argv[++a]);
+            if (opts->threads < 0) {
+                usage();
+                return -1;
+            }
+            if (opts->threads == 0)
+                opts->threads = online_cpus();
+        } else if (!strcmp(argv[a], "-q") && a + 1 < argc) {
+            long n = atol(argv[++a]);
+            if (n <= 0) {
+                usage();
+                return -1;
+            }
+            opts->high_water = (size_t)n;
+        } else if (!strcmp(argv[a], "-H")) {
+            opts->hugepages = 1;
+        } else if (!strcmp(argv[a], "-f")) {
+            opts->framed = 1;
+        } else if (!strcmp(argv[a], "-z") && a + 1 < argc) {
+            long n = atol(argv[++a]);
+            if (n < 0) {
+                usage();
+                return -1;
+            }
+            opts->zerocopy = n ? (size_t)n : ZC_THRESHOLD;
+        } else if (!strcmp(argv[a], "-a")) {
+            opts->pin_cpus = 1;
+        } else if (!strcmp(argv[a], "-B") && a + 1 < argc) {
+            int n = atoi(argv[++a]);
+            if (n < 0) {
+                usage();
+                return -1;
+            }
+            opts->busy_poll = n ? n : BUSY_POLL_US;
+            //um worker girando não divide o núcleo com outro
+            opts->pin_cpus = 1;
+        } else if (!strcmp(argv[a], "-I") && a + 1 < argc) {
+            opts->idle_timeout = atoi(argv[++a]);
+            if (opts->idle_timeout <= 0) {
+                usage();
+                return -1;
+            }
+        } else if (!strcmp(argv[a], "-R") && a + 1 < argc) {
+            opts->read_timeout = atoi(argv[++a]);
+            if (opts->read_timeout <= 0) {
+                usage();
+                return -1;
+            }
+        } else if (!strcmp(argv[a], "-l") && a + 1 < argc) {
+            opts->backlog = atoi(argv[++a]);
+            if (opts->backlog <= 0) {
+                usage();
+                return -1;
+            }
+        } else if (!strcmp(argv[a], "-d") && a + 1 < argc) {
+            opts->defer_accept = atoi(argv[++a]);
+            if (opts->defer_accept <= 0) {
+                usage();
+                return -1;
+            }
+#if !defined(TCP_DEFER_ACCEPT)
+            fprintf(stderr, "TCP_DEFER_ACCEPT not available.\n");
+            opts->defer_accept = 0;
+#endif
+        } else if (!strcmp(argv[a], "-o") && a + 1 < argc) {
+            opts->fastopen = atoi(argv[++a]);
+            if (opts->fastopen <= 0) {
+                usage();
+                return -1;
+            }
+#if !defined(TCP_FASTOPEN)
+            fprintf(stderr, "TCP Fast Open not available.\n");
+            opts->fastopen = 0;
+#endif
+        } else if (!strcmp(argv[a], "-x") && a + 1 < argc) {
+            chain = argv[++a];
+        } else if (!strcmp(argv[a], "-S") && a + 1 < argc) {
+            opts->stats.port = atoi(argv[++a]);
+            if (opts->stats.port <= 0 || opts->stats.port > 65535) {
+                usage();
+                return -1;
+            }
+        } else if (!strcmp(argv[a], "-D") && a + 1 < argc) {
+            opts->stats.interval = atoi(argv[++a]);
+            if (opts->stats.interval <= 0) {
+                usage();
+                return -1;
+            }
+        } else if (!strcmp(argv[a], "-v")) {
+            log_level = LOG_INFO;
+        } else {
+            usage();
+            return -1;
+        }
+    }
+
+    if (xform_parse(chain, &opts->xform)) {
+        usage();
+        return -1;
+    }
+    xform_build(&opts->xform);
+    printf("Transform: %s (%s)\n", chain, opts->xform.kernel_name);
+    //sem quadros não há onde pôr o crc32c: o fluxo não tem fim de mensagem
+    if (opts->xform.trailer && !opts->framed) {
+        fprintf(stderr, "crc32c requires framing (-f).\n");
+        return -1;
+    }
+
+    //o laço io_uring não remonta quadros
+    if (opts->framed && opts->engine == ENGINE_URING) {
+        fprintf(stderr, "framing not supported with io_uring, using epoll.\n");
+        opts->engine = ENGINE_EPOLL;
+    }
+
+    //o giro só compensa se o cliente e as interrupções tiverem outro núcleo
+    if (opts->busy_poll && opts->threads >= online_cpus())
+        fprintf(stderr, "busy-poll with no spare CPU, expect higher latency.\n");
+
+#if defined(__linux__)
+    //o padrão do Linux (1) só liga o Fast Open do lado do cliente
+    if (opts->fastopen) {
+        FILE *f = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+        int mode = 0;
+        if (f && fscanf(f, "%d", &mode) == 1 && !(mode & 2))
+            fprintf(stderr, "TCP Fast Open disabled for servers"
+                    " (net.ipv4.tcp_fastopen=%d, needs 2 or 3).\n", mode);
+        if (f)
+            fclose(f);
+    }
+#endif
+
+    //sem quadros cada leitura é uma mensagem inteira: não há o que completar
+    if (opts->read_timeout && !opts->framed) {
+        fprintf(stderr, "read timeout requires framing (-f), ignoring -R.\n");
+        opts->read_timeout = 0;
+    }
+
+    //os prazos só são conferidos nos laços select e epoll
+    if ((opts->idle_timeout || opts->read_timeout) && opts->engine == ENGINE_URING) {
+        fprintf(stderr, "timeouts require select or epoll, using epoll.\n");
+        opts->engine = ENGINE_EPOLL;
+    }
+
+    //o io_uring já espera no kernel; o giro é só dos laços select e epoll
+    if (opts->busy_poll && opts->engine == ENGINE_URING) {
+        fprintf(stderr, "busy-poll requires select or epoll, using epoll.\n");
+        opts->engine = ENGINE_EPOLL;
+    }
+
+    //os avisos de MSG_ZEROCOPY só são tratados no laço epoll; no modo com
+    //quadros as respostas são montadas a partir do carry e vão copiadas
+    if (opts->zerocopy) {
+#if defined(HAVE_ZEROCOPY)
+        if (opts->engine != ENGINE_EPOLL) {
+            fprintf(stderr, "zerocopy requires epoll, using epoll.\n");
+            opts->engine = ENGINE_EPOLL;
+        }
+        if (opts->framed) {
+            fprintf(stderr, "zerocopy not supported with framing, ignoring -z.\n");
+            opts->zerocopy = 0;
+        }
+#else
+        fprintf(stderr, "zerocopy not available.\n");
+        opts->zerocopy = 0;
+#endif
+    }
+
+#if !defined(HAVE_THREADS)
+    if (opts->threads > 1) {
+        fprintf(stderr, "threads not available, using 1 worker.\n");
+        opts->threads = 1;
+    }
+#endif
+    return 0;
+}
+
+
+struct worker_set {
+    struct worker *workers;
+    int n;
+    unsigned long overflows, drops;     //contadores do kernel no início
+};
+
+//Retrato das métricas: uma linha por worker e a soma
+static void snapshot_workers(void *arg, struct stats_text *out) {
+    const struct worker_set *set = (const struct worker_set*)arg;
+    struct server_stats total, one;
+    memset(&total, 0, sizeof(total));
+    int k;
+    for (k = 0; k < set->n; ++k) {
+        char label[32];
+        stats_read(&set->workers[k].stats, &one);
+        snprintf(label, sizeof(label), "worker=%d", k);
+        stats_format(out, label, &one, 0);
+        stats_merge(&total, &one);
+    }
+    stats_format(out, "total", &total, 0);
+#if defined(HAVE_LISTEN_STATS)
+    unsigned long overflows, drops;
+    if (!listen_overflows(&overflows, &drops))
+        stats_printf(out, "listen overflows=%lu drops=%lu\n",
+                overflows - set->overflows, drops - set->drops);
+#endif
+}
+
+
+static int run_engine(struct worker *w) {
+#if defined(HAVE_IO_URING)
+    if (w->opts->engine == ENGINE_URING) {
+        int result = serve_uring(w);
+        if (result != URING_UNSUPPORTED)
+            return result;
+        fprintf(stderr, "io_uring unavailable, worker %d falling back to epoll.\n",
+                w->id);
+        return serve_epoll(w);
+    }
+#endif
+#if defined(HAVE_EPOLL)
+    if (w->opts->engine == ENGINE_EPOLL)
+        return serve_epoll(w);
+#endif
+    return serve_select(w);
+}
+
+static int run_worker(struct worker *w) {
+#if defined(HAVE_AFFINITY)
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set))
+            fprintf(stderr, "sched_setaffinity(%d) failed. (%d)\n",
+                    w->cpu, GETSOCKETERRNO());
+    }
+#endif
+
+    //o pool é criado na thread do worker, já na CPU (e nó NUMA) dela
+    pool_init(&w->pool, w->opts->hugepages);
+    w->now = mono_ns() / 1000000;
+    tw_init(&w->timers, w->now);
+    int result = run_engine(w);
+    tw_destroy(&w->timers);
+    pool_destroy(&w->pool);
+    return result;
+}
+
+#if defined(HAVE_THREADS)
+static void *worker_thread(void *arg) {
+    struct worker *w = (struct worker*)arg;
+    w->result = run_worker(w);
+    return 0;
+}
+#endif
+
+
+int main(int argc, char *argv[]) {
 
-int main() {
+    struct server_options opts;
+    if (parse_options(argc, argv, &opts))
+        return 1;
 
 #if defined(_WIN32)
     WSADATA d;
@@ -47,97 +396,80 @@ int main() {
     getaddrinfo(0, "8080", &hints, &bind_address);
 
 
-    printf("Creating socket...\n");
-    SOCKET socket_listen;
-    socket_listen = socket(bind_address->ai_family,
-            bind_address->ai_socktype, bind_address->ai_protocol);
-    if (!ISVALIDSOCKET(socket_listen)) {
-        fprintf(stderr, "socket() failed. (%d)\n", GETSOCKETERRNO());
+    /*
+    Um socket de escuta por worker, todos na mesma porta. Com um só worker
+    não é preciso SO_REUSEPORT e o comportamento é o mesmo de antes.
+    */
+    int nworkers = opts.threads;
+    int ncpus = online_cpus();
+    struct worker *workers;
+#if defined(HAVE_THREADS)
+    //alinhado à linha de cache: os contadores de um worker não dividem
+    //linha com os do vizinho
+    if (posix_memalign((void**)&workers, CACHE_LINE, nworkers * sizeof(*workers)))
+        workers = 0;
+#else
+    workers = (struct worker*)malloc(nworkers * sizeof(*workers));
+#endif
+    if (!workers) {
+        fprintf(stderr, "Out of memory.\n");
         return 1;
     }
+    memset(workers, 0, nworkers * sizeof(*workers));
 
-
-    printf("Binding socket to local address...\n");
-    if (bind(socket_listen,
-                bind_address->ai_addr, bind_address->ai_addrlen)) {
-        fprintf(stderr, "bind() failed. (%d)\n", GETSOCKETERRNO());
-        return 1;
+    printf("Creating socket...\n");
+    int k;
+    for (k = 0; k < nworkers; ++k) {
+        workers[k].id = k;
+        workers[k].cpu = opts.pin_cpus ? k % ncpus : -1;
+        workers[k].opts = &opts;
+        workers[k].socket_listen = create_listener(bind_address, nworkers > 1,
+                &opts);
+        if (!ISVALIDSOCKET(workers[k].socket_listen))
+            return 1;
     }
     freeaddrinfo(bind_address);
 
-
-    printf("Listening...\n");
-    if (listen(socket_listen, 10) < 0) {
-        fprintf(stderr, "listen() failed. (%d)\n", GETSOCKETERRNO());
+    struct worker_set set;
+    set.workers = workers;
+    set.n = nworkers;
+    set.overflows = set.drops = 0;
+#if defined(HAVE_LISTEN_STATS)
+    listen_overflows(&set.overflows, &set.drops);
+#endif
+    opts.stats.snapshot = snapshot_workers;
+    opts.stats.arg = &set;
+    if (stats_start(&opts.stats))
         return 1;
-    }
-
-    fd_set master;
-    FD_ZERO(&master);
-    FD_SET(socket_listen, &master);
-    SOCKET max_socket = socket_listen;
+    if (opts.stats.port)
+        printf("Metrics on 127.0.0.1:%d\n", opts.stats.port);
 
+    printf("Listening with %d worker%s...\n", nworkers, nworkers > 1 ? "s" : "");
     printf("Waiting for connections...\n");
 
-
-    while(1) {
-        fd_set reads;
-        reads = master;
-        if (select(max_socket+1, &reads, 0, 0, 0) < 0) {
-            fprintf(stderr, "select() failed. (%d)\n", GETSOCKETERRNO());
-            return 1;
+    int result = 0;
+#if defined(HAVE_THREADS)
+    if (nworkers > 1) {
+        for (k = 0; k < nworkers; ++k) {
+            if (pthread_create(&workers[k].thread, 0, worker_thread, &workers[k])) {
+                fprintf(stderr, "pthread_create() failed.\n");
+                return 1;
+            }
         }
-
-        SOCKET i;
-        for(i = 1; i <= max_socket; ++i) {
-            if (FD_ISSET(i, &reads)) {
-
-                if (i == socket_listen) {
-                    struct sockaddr_storage client_address;
-                    socklen_t client_len = sizeof(client_address);
-                    SOCKET socket_client = accept(socket_listen,
-                            (struct sockaddr*) &client_address,
-                            &client_len);
-                    if (!ISVALIDSOCKET(socket_client)) {
-                        fprintf(stderr, "accept() failed. (%d)\n",
-                                GETSOCKETERRNO());
-                        return 1;
-                    }
-
-                    FD_SET(socket_client, &master);
-                    if (socket_client > max_socket)
-                        max_socket = socket_client;
-
-                    char address_buffer[100];
-                    getnameinfo((struct sockaddr*)&client_address,
-                            client_len,
-                            address_buffer, sizeof(address_buffer), 0, 0,
-                            NI_NUMERICHOST);
-                    printf("New connection from %s\n", address_buffer);
-
-                } else {
-                    char read[512000];
-                    int bytes_received = recv(i, read, 512000, 0);
-                    if (bytes_received < 1) {
-                        FD_CLR(i, &master);
-                        CLOSESOCKET(i);
-                        continue;
-                    }
-
-                    int j;
-                    for (j = 0; j < bytes_received; ++j)
-                        read[j] = toupper(read[j]);
-                    send(i, read, bytes_received, 0);
-                }
-
-            } //if FD_ISSET
-        } //for i to max_socket
-    } //while(1)
-
+        for (k = 0; k < nworkers; ++k) {
+            pthread_join(workers[k].thread, 0);
+            if (workers[k].result)
+                result = workers[k].result;
+        }
+    } else
+#endif
+        result = run_worker(&workers[0]);
 
 
     printf("Closing listening socket...\n");
-    CLOSESOCKET(socket_listen);
+    for (k = 0; k < nworkers; ++k)
+        CLOSESOCKET(workers[k].socket_listen);
+    free(workers);
 
 #if defined(_WIN32)
     WSACleanup();
@@ -146,5 +478,5 @@ int main() {
 
     printf("Finished.\n");
 
-    return 0;
+    return result;
 }
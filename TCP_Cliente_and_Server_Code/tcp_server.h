@@ -0,0 +1,955 @@
+/*
+ * Estruturas e rotinas comuns aos laços de eventos do servidor TCP
+ * (select, epoll, io_uring). Cada laço só decide *quando* um socket está pronto;
+ * o que fazer com ele fica aqui.
+ */
+
+#ifndef TCP_SERVER_H
+#define TCP_SERVER_H
+
+#include "chap03.h"
+#include "../Common_Code/transform.h"
+#include "../Common_Code/buffer_pool.h"
+#include "../Common_Code/mono_clock.h"
+#include "../Common_Code/server_stats.h"
+#include "../Common_Code/busy_poll.h"
+#include "../Common_Code/timer_wheel.h"
+#include "tcp_frame.h"
+#include <stdlib.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#define HAVE_THREADS
+#define INVALID_SOCKET (-1)
+#endif
+
+#if defined(__linux__)
+#include <sched.h>
+#define HAVE_EPOLL
+#define HAVE_AFFINITY
+#define HAVE_ACCEPT4
+#define HAVE_LISTEN_STATS
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#include <linux/errqueue.h>
+#define HAVE_ZEROCOPY
+#endif
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#define LISTEN_BACKLOG 1024      //o kernel limita a net.core.somaxconn
+#define TAM_READ 512000
+#define READ_MIN 4096
+#define OUT_HIGH_WATER (1024 * 1024)
+#define ZC_THRESHOLD (16 * 1024)    //abaixo disso copiar é mais barato que fixar páginas
+#define ZC_MAX_PENDING 64           //envios sem cópia aguardando aviso, por conexão
+
+#if defined(MSG_NOSIGNAL)
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+enum io_engine {
+    ENGINE_SELECT,
+    ENGINE_EPOLL,
+    ENGINE_URING,
+};
+
+struct server_options {
+    enum io_engine engine;
+    int threads;    //número de workers, cada um com seu próprio listener
+    int pin_cpus;   //fixa o worker k na CPU k
+    size_t high_water; //bytes na fila de saída a partir dos quais a leitura pára
+    int hugepages;  //pool de buffers em huge pages, se houver
+    int framed;     //protocolo com quadros (tcp_frame.h)
+    size_t zerocopy; //respostas a partir deste tamanho vão com MSG_ZEROCOPY (0 = nunca)
+    struct xform_chain xform;   //transformação do conteúdo (-x)
+    struct stats_reporter stats; //porta local e intervalo das métricas
+    int busy_poll;  //microssegundos de giro antes de dormir (0 = nunca)
+    int idle_timeout;   //segundos sem tráfego até fechar a conexão (0 = nunca)
+    int read_timeout;   //segundos para completar um quadro começado (0 = nunca)
+    int backlog;        //fila de conexões completas do listen()
+    int defer_accept;   //TCP_DEFER_ACCEPT: segundos esperando o 1º dado (0 = não)
+    int fastopen;       //TCP_FASTOPEN: fila de SYNs com dados (0 = não)
+};
+
+enum {
+    CONN_READ = 1,
+    CONN_WRITE = 2,
+};
+
+/*
+Estado de cada conexão. O que o kernel não aceitou no send() fica na fila de
+saída (out) e só então o laço pede para ser avisado quando o socket puder ser
+escrito. Se a fila passa de high_water, a conexão deixa de ser lida até a fila
+cair para a metade disso: o cliente lento é freado pelo controle de fluxo do
+TCP em vez de fazer o servidor acumular memória.
+*/
+struct connection {
+    int open;
+    int closing;            //o cliente fechou; fecha depois de esvaziar a fila
+    int paused;             //leitura suspensa pela fila de saída
+    unsigned events;        //interesse registrado no laço (CONN_READ|CONN_WRITE)
+    char *out;              //vem do pool e volta para ele quando esvazia
+    size_t out_off, out_len, out_cap;
+    size_t read_hint;       //tamanho do próximo buffer de leitura
+    //modo com quadros: o quadro incompleto, já convertido, espera aqui
+    char *carry;
+    size_t carry_len, carry_cap;
+    unsigned char frame_hdr[FRAME_HEADER];
+    int frame_hdr_len;      //bytes do cabeçalho do quadro atual já lidos
+    size_t frame_left;      //bytes do conteúdo do quadro atual que faltam
+    uint32_t frame_crc;     //crc32c parcial do quadro atual (cadeia com trailer)
+    uint64_t frame_since;   //ms em que o quadro atual começou a chegar
+    //MSG_ZEROCOPY: buffers de leitura já enviados, presos até o aviso do kernel
+    int zc_on;              //SO_ZEROCOPY ligado no socket
+    struct zc_slot *zc;     //anel de ZC_MAX_PENDING posições, alocado no primeiro envio
+    unsigned zc_head, zc_count;
+    uint32_t zc_next;       //id que o kernel dará ao próximo envio sem cópia
+    unsigned long zc_sends, zc_copied;
+};
+
+struct zc_slot {
+    char *buf;
+    size_t cap;
+    int done;
+};
+
+/*
+Cada worker tem o seu socket de escuta (SO_REUSEPORT), o seu laço de eventos
+e o seu conjunto de conexões. Nada é compartilhado entre workers depois da
+inicialização; o kernel distribui as conexões novas entre os listeners. Os
+contadores (server_stats.h) vêm primeiro, numa linha de cache só deles.
+*/
+struct worker {
+    struct server_stats stats;
+    int id;
+    int cpu;                //-1 quando não há afinidade
+    SOCKET socket_listen;
+    const struct server_options *opts;
+    struct connection *conns;   //indexado pelo descritor
+    size_t nconns;
+    struct buffer_pool pool;
+    //conexões fechadas com envios sem cópia pendentes: o descritor só é
+    //fechado quando o kernel devolve os últimos buffers
+    SOCKET *orphans;
+    size_t norphans, orphans_cap;
+    //prazos das conexões (-I, -R), indexados pelo descritor
+    struct timer_wheel timers;
+    uint64_t now;           //ms, lido uma vez por iteração do laço
+#if defined(HAVE_THREADS)
+    pthread_t thread;
+#endif
+    int result;
+};
+
+
+static int set_nonblocking(SOCKET s) {
+#if defined(_WIN32)
+    u_long mode = 1;
+    return ioctlsocket(s, FIONBIO, &mode);
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(s, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+/*
+Desliga o Nagle num socket aceito, em todos os laços. Cada send() já leva uma
+resposta inteira; o Nagle só atrasaria a última parte de um eco que sai em
+mais de um segmento até o ACK atrasado do cliente (cerca de 40 ms).
+*/
+static void set_nodelay(SOCKET s) {
+    int yes = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (void*)&yes, sizeof(yes));
+}
+
+
+/*
+Cria, liga e coloca em escuta um socket não-bloqueante. Com reuseport, vários
+sockets podem ser ligados à mesma porta (um por worker).
+
+A fila do listen() precisa absorver uma rajada de conexões entre duas voltas
+do laço: quando ela enche, o kernel descarta o ACK final do handshake e o
+cliente só reenvia depois de um segundo. TCP_DEFER_ACCEPT só entrega a
+conexão quando chega o primeiro dado (o laço não acorda para um accept()
+seguido de EAGAIN no recv()); TCP_FASTOPEN aceita dados já no SYN de quem
+tem cookie, economizando uma viagem de ida e volta.
+*/
+static SOCKET create_listener(struct addrinfo *bind_address, int reuseport,
+        const struct server_options *opts) {
+    SOCKET socket_listen;
+    socket_listen = socket(bind_address->ai_family,
+            bind_address->ai_socktype, bind_address->ai_protocol);
+    if (!ISVALIDSOCKET(socket_listen)) {
+        fprintf(stderr, "socket() failed. (%d)\n", GETSOCKETERRNO());
+        return INVALID_SOCKET;
+    }
+
+#if !defined(_WIN32)
+    //com -I/-R quem fecha é o servidor e a porta fica em TIME_WAIT; sem
+    //isto, reiniciar o servidor falharia no bind() por um minuto
+    int on = 1;
+    setsockopt(socket_listen, SOL_SOCKET, SO_REUSEADDR, (void*)&on, sizeof(on));
+#endif
+
+    if (reuseport) {
+#if defined(SO_REUSEPORT)
+        int yes = 1;
+        if (setsockopt(socket_listen, SOL_SOCKET, SO_REUSEPORT,
+                    (void*)&yes, sizeof(yes))) {
+            fprintf(stderr, "setsockopt(SO_REUSEPORT) failed. (%d)\n",
+                    GETSOCKETERRNO());
+            CLOSESOCKET(socket_listen);
+            return INVALID_SOCKET;
+        }
+#else
+        fprintf(stderr, "SO_REUSEPORT not supported.\n");
+        CLOSESOCKET(socket_listen);
+        return INVALID_SOCKET;
+#endif
+    }
+
+    if (bind(socket_listen,
+                bind_address->ai_addr, bind_address->ai_addrlen)) {
+        fprintf(stderr, "bind() failed. (%d)\n", GETSOCKETERRNO());
+        CLOSESOCKET(socket_listen);
+        return INVALID_SOCKET;
+    }
+
+#if defined(TCP_FASTOPEN)
+    if (opts->fastopen && setsockopt(socket_listen, IPPROTO_TCP, TCP_FASTOPEN,
+                (void*)&opts->fastopen, sizeof(opts->fastopen)))
+        fprintf(stderr, "setsockopt(TCP_FASTOPEN) failed. (%d)\n",
+                GETSOCKETERRNO());
+#endif
+#if defined(TCP_DEFER_ACCEPT)
+    if (opts->defer_accept && setsockopt(socket_listen, IPPROTO_TCP,
+                TCP_DEFER_ACCEPT, (void*)&opts->defer_accept,
+                sizeof(opts->defer_accept)))
+        fprintf(stderr, "setsockopt(TCP_DEFER_ACCEPT) failed. (%d)\n",
+                GETSOCKETERRNO());
+#endif
+
+    if (listen(socket_listen, opts->backlog) < 0) {
+        fprintf(stderr, "listen() failed. (%d)\n", GETSOCKETERRNO());
+        CLOSESOCKET(socket_listen);
+        return INVALID_SOCKET;
+    }
+    set_nonblocking(socket_listen);
+
+    return socket_listen;
+}
+
+
+#if defined(HAVE_LISTEN_STATS)
+/*
+Conexões perdidas porque a fila do listen() estava cheia (ListenOverflows) e
+todas as descartadas antes do accept() (ListenDrops, que inclui as
+primeiras), de /proc/net/netstat. O kernel só conta por namespace de rede,
+não por socket: o retrato mostra a diferença desde o início do servidor.
+*/
+static int listen_overflows(unsigned long *overflows, unsigned long *drops) {
+    FILE *f = fopen("/proc/net/netstat", "r");
+    if (!f)
+        return -1;
+    char names[4096], values[4096];
+    int found = 0;
+    while (!found && fgets(names, sizeof(names), f)) {
+        if (strncmp(names, "TcpExt:", 7) || !fgets(values, sizeof(values), f))
+            continue;
+        char *np, *vp;
+        char *name = strtok_r(names, " \n", &np);
+        char *value = strtok_r(values, " \n", &vp);
+        while (name && value) {
+            if (!strcmp(name, "ListenOverflows")) {
+                *overflows = strtoul(value, 0, 10);
+                found |= 1;
+            } else if (!strcmp(name, "ListenDrops")) {
+                *drops = strtoul(value, 0, 10);
+                found |= 2;
+            }
+            name = strtok_r(0, " \n", &np);
+            value = strtok_r(0, " \n", &vp);
+        }
+        found = found == 3;
+    }
+    fclose(f);
+    return found ? 0 : -1;
+}
+#endif
+
+
+static struct connection *conn_get(struct worker *w, SOCKET s) {
+    size_t fd = (size_t)s;
+    if (fd >= w->nconns) {
+        size_t n = w->nconns ? w->nconns : 1024;
+        while (n <= fd)
+            n *= 2;
+        struct connection *p = (struct connection*)realloc(w->conns,
+                n * sizeof(*p));
+        if (!p)
+            return 0;
+        memset(p + w->nconns, 0, (n - w->nconns) * sizeof(*p));
+        w->conns = p;
+        w->nconns = n;
+    }
+    return &w->conns[fd];
+}
+
+static struct connection *conn_open(struct worker *w, SOCKET s) {
+    struct connection *c = conn_get(w, s);
+    if (!c)
+        return 0;
+    c->open = 1;
+    c->closing = 0;
+    c->paused = 0;
+    c->events = 0;
+    c->out_off = c->out_len = 0;
+    c->read_hint = READ_MIN;
+    c->carry_len = 0;
+    c->frame_hdr_len = 0;
+    c->frame_left = 0;
+    c->zc_on = 0;
+    c->zc_head = c->zc_count = 0;
+    c->zc_next = 0;
+    c->zc_sends = c->zc_copied = 0;
+    return c;
+}
+
+
+#if defined(HAVE_ZEROCOPY)
+/*
+Lê os avisos de conclusão da fila de erros do socket. Cada aviso cobre um
+intervalo de ids [ee_info, ee_data] (um id por envio com MSG_ZEROCOPY, em
+ordem); os buffers correspondentes são marcados e os do início do anel voltam
+ao pool. SO_EE_CODE_ZEROCOPY_COPIED indica que o kernel acabou copiando (é o
+que acontece no loopback). Retorna o número de avisos lidos ou -1 em erro.
+*/
+static int zc_reap(struct worker *w, SOCKET s, struct connection *c) {
+    int notices = 0;
+    while (c->zc_count) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(s, &msg, MSG_ERRQUEUE) < 0) {
+            if (SOCKETWOULDBLOCK())
+                break;
+            return -1;
+        }
+        struct cmsghdr *cm;
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                    (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cm), sizeof(err));
+            if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            notices++;
+            uint32_t first = c->zc_next - c->zc_count;
+            uint32_t id;
+            for (id = err.ee_info; id - err.ee_info <= err.ee_data - err.ee_info; ++id) {
+                uint32_t k = id - first;
+                if (k < c->zc_count)
+                    c->zc[(c->zc_head + k) % ZC_MAX_PENDING].done = 1;
+            }
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                c->zc_copied += err.ee_data - err.ee_info + 1;
+        }
+        while (c->zc_count && c->zc[c->zc_head].done) {
+            struct zc_slot *z = &c->zc[c->zc_head];
+            pool_free(&w->pool, z->buf, z->cap);
+            z->buf = 0;
+            z->done = 0;
+            c->zc_head = (c->zc_head + 1) % ZC_MAX_PENDING;
+            c->zc_count--;
+        }
+    }
+    return notices;
+}
+
+static void zc_release(struct connection *c) {
+    free(c->zc);
+    c->zc = 0;
+    c->zc_head = c->zc_count = 0;
+}
+
+//Fecha os descritores órfãos cujos buffers o kernel já devolveu
+static void zc_reap_orphans(struct worker *w) {
+    size_t k = 0;
+    while (k < w->norphans) {
+        SOCKET s = w->orphans[k];
+        struct connection *c = &w->conns[(size_t)s];
+        if (zc_reap(w, s, c) >= 0 && c->zc_count) {
+            ++k;
+            continue;
+        }
+        //em erro os buffers não voltam ao pool: o kernel ainda pode lê-los
+        zc_release(c);
+        CLOSESOCKET(s);
+        w->orphans[k] = w->orphans[--w->norphans];
+    }
+}
+#endif
+
+static void conn_close(struct worker *w, SOCKET s) {
+    struct connection *c = &w->conns[(size_t)s];
+    c->open = 0;
+    tw_cancel(&w->timers, (int)s);
+    pool_free(&w->pool, c->out, c->out_cap);
+    c->out = 0;
+    c->out_cap = c->out_off = c->out_len = 0;
+    pool_free(&w->pool, c->carry, c->carry_cap);
+    c->carry = 0;
+    c->carry_cap = c->carry_len = 0;
+    counter_add(&w->stats.closed, 1);
+#if defined(HAVE_ZEROCOPY)
+    if (c->zc_sends)
+        log_info("Connection closed: %lu zerocopy sends, %lu copied by the kernel\n",
+                c->zc_sends, c->zc_copied);
+    if (c->zc_count && zc_reap(w, s, c) >= 0 && c->zc_count) {
+        //o kernel ainda usa buffers desta conexão: fechar agora deixaria o
+        //descritor ser reaproveitado e os avisos, perdidos
+        if (w->norphans == w->orphans_cap) {
+            size_t n = w->orphans_cap ? w->orphans_cap * 2 : 16;
+            SOCKET *p = (SOCKET*)realloc(w->orphans, n * sizeof(*p));
+            if (p) {
+                w->orphans = p;
+                w->orphans_cap = n;
+            }
+        }
+        if (w->norphans < w->orphans_cap) {
+            shutdown(s, SHUT_RD);
+            w->orphans[w->norphans++] = s;
+            return;
+        }
+    }
+    zc_release(c);
+#endif
+    CLOSESOCKET(s);
+}
+
+static void conn_free_all(struct worker *w) {
+    size_t fd;
+    for (fd = 0; fd < w->nconns; ++fd)
+        if (w->conns[fd].open)
+            conn_close(w, (SOCKET)fd);
+#if defined(HAVE_ZEROCOPY)
+    //no encerramento não há por que esperar o kernel
+    while (w->norphans) {
+        SOCKET s = w->orphans[--w->norphans];
+        zc_release(&w->conns[(size_t)s]);
+        CLOSESOCKET(s);
+    }
+    free(w->orphans);
+    w->orphans = 0;
+    w->orphans_cap = 0;
+#endif
+    free(w->conns);
+    w->conns = 0;
+    w->nconns = 0;
+}
+
+//Interesse que o laço deve ter registrado para a conexão
+static unsigned conn_interest(const struct connection *c) {
+    unsigned ev = 0;
+    if (!c->paused && !c->closing)
+        ev |= CONN_READ;
+    if (c->out_len)
+        ev |= CONN_WRITE;
+    return ev;
+}
+
+static int conn_queue(struct worker *w, struct connection *c,
+        const char *data, size_t len) {
+    if (c->out_off + c->out_len + len > c->out_cap) {
+        if (c->out_len + len > c->out_cap) {
+            size_t cap = c->out_cap ? c->out_cap * 2 : 0;
+            if (cap < c->out_len + len)
+                cap = c->out_len + len;
+            char *p = (char*)pool_alloc(&w->pool, cap, &cap);
+            if (!p)
+                return -1;
+            //memcpy() de um ponteiro nulo, mesmo com tamanho 0, deixaria o
+            //compilador supor c->out != 0 e eliminar o teste de pool_free()
+            if (c->out_len)
+                memcpy(p, c->out + c->out_off, c->out_len);
+            pool_free(&w->pool, c->out, c->out_cap);
+            c->out = p;
+            c->out_cap = cap;
+        } else {
+            memmove(c->out, c->out + c->out_off, c->out_len);
+        }
+        c->out_off = 0;
+    }
+    memcpy(c->out + c->out_off + c->out_len, data, len);
+    c->out_len += len;
+    return 0;
+}
+
+//Envia o máximo possível da fila de saída. Retorna -1 em erro de socket.
+static int conn_flush(struct worker *w, SOCKET s, struct connection *c) {
+    while (c->out_len) {
+        int sent = send(s, c->out + c->out_off, (int)c->out_len, SEND_FLAGS);
+        counter_add(&w->stats.send_calls, 1);
+        if (sent < 0) {
+            if (SOCKETWOULDBLOCK())
+                break;
+            return -1;
+        }
+        counter_add(&w->stats.bytes_out, sent);
+        c->out_off += sent;
+        c->out_len -= sent;
+    }
+    if (!c->out_len) {
+        pool_free(&w->pool, c->out, c->out_cap);
+        c->out = 0;
+        c->out_cap = c->out_off = 0;
+    }
+    return 0;
+}
+
+/*
+Envia data; o que não couber no socket vai para a fila de saída. Se a fila já
+tem dados, tudo é enfileirado para não inverter a ordem dos bytes.
+*/
+static int conn_send(struct worker *w, SOCKET s, struct connection *c,
+        const char *data, size_t len) {
+    if (!c->out_len) {
+        while (len) {
+            int sent = send(s, data, (int)len, SEND_FLAGS);
+            counter_add(&w->stats.send_calls, 1);
+            if (sent < 0) {
+                if (SOCKETWOULDBLOCK())
+                    break;
+                return -1;
+            }
+            counter_add(&w->stats.bytes_out, sent);
+            data += sent;
+            len -= sent;
+        }
+        if (len)
+            counter_add(&w->stats.partial_sends, 1);
+    }
+    if (len && conn_queue(w, c, data, len))
+        return -1;
+    if (c->out_len > w->opts->high_water)
+        c->paused = 1;
+    return 0;
+}
+
+/*
+Como conn_send(), para dois pedaços seguidos: um sendmsg() com dois iovecs
+(writev() não aceita MSG_NOSIGNAL) em vez de duas chamadas.
+*/
+static int conn_send2(struct worker *w, SOCKET s, struct connection *c,
+        const char *a, size_t alen, const char *b, size_t blen) {
+#if defined(_WIN32)
+    if (conn_send(w, s, c, a, alen))
+        return -1;
+    return conn_send(w, s, c, b, blen);
+#else
+    if (!c->out_len) {
+        while (alen + blen) {
+            struct iovec iov[2];
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            iov[0].iov_base = (void*)a;
+            iov[0].iov_len = alen;
+            iov[1].iov_base = (void*)b;
+            iov[1].iov_len = blen;
+            msg.msg_iov = alen ? iov : iov + 1;
+            msg.msg_iovlen = alen ? 2 : 1;
+            ssize_t sent = sendmsg(s, &msg, SEND_FLAGS);
+            counter_add(&w->stats.send_calls, 1);
+            if (sent < 0) {
+                if (SOCKETWOULDBLOCK())
+                    break;
+                return -1;
+            }
+            counter_add(&w->stats.bytes_out, sent);
+            size_t from_a = (size_t)sent < alen ? (size_t)sent : alen;
+            a += from_a;
+            alen -= from_a;
+            b += sent - from_a;
+            blen -= sent - from_a;
+        }
+        if (alen + blen)
+            counter_add(&w->stats.partial_sends, 1);
+    }
+    if (alen && conn_queue(w, c, a, alen))
+        return -1;
+    if (blen && conn_queue(w, c, b, blen))
+        return -1;
+    if (c->out_len > w->opts->high_water)
+        c->paused = 1;
+    return 0;
+#endif
+}
+
+#if defined(HAVE_ZEROCOPY)
+/*
+Envia buf (len bytes, vindo do pool com capacidade cap) com MSG_ZEROCOPY. Em
+caso de sucesso o buffer passa a pertencer à conexão até o kernel avisar que
+terminou de usá-lo (zc_reap()); o que o socket não aceitou vai para a fila de
+saída, por cópia. Retorna 1 se ficou com o buffer, -1 se ficou com ele mas
+a conexão deve ser fechada, ou 0 se não enviou nada (anel cheio, socket
+cheio, sem memória de opções, erro) e o chamador segue com conn_send().
+*/
+static int zc_send(struct worker *w, SOCKET s, struct connection *c,
+        char *buf, size_t cap, size_t len) {
+    if (!c->zc) {
+        c->zc = (struct zc_slot*)calloc(ZC_MAX_PENDING, sizeof(*c->zc));
+        if (!c->zc)
+            return 0;
+    }
+    if (c->zc_count == ZC_MAX_PENDING)
+        zc_reap(w, s, c);
+    if (c->zc_count == ZC_MAX_PENDING)
+        return 0;
+
+    ssize_t sent = send(s, buf, len, SEND_FLAGS | MSG_ZEROCOPY);
+    counter_add(&w->stats.send_calls, 1);
+    if (sent < 0)
+        return 0;
+    counter_add(&w->stats.bytes_out, sent);
+    struct zc_slot *z = &c->zc[(c->zc_head + c->zc_count) % ZC_MAX_PENDING];
+    z->buf = buf;
+    z->cap = cap;
+    z->done = 0;
+    c->zc_count++;
+    c->zc_next++;
+    c->zc_sends++;
+    if ((size_t)sent < len) {
+        counter_add(&w->stats.partial_sends, 1);
+        return conn_send(w, s, c, buf + sent, len - sent) < 0 ? -1 : 1;
+    }
+    return 1;
+}
+#endif
+
+static int carry_append(struct worker *w, struct connection *c,
+        const char *data, size_t len) {
+    if (c->carry_len + len > c->carry_cap) {
+        size_t cap = c->carry_cap ? c->carry_cap * 2 : 0;
+        if (cap < c->carry_len + len)
+            cap = c->carry_len + len;
+        char *p = (char*)pool_alloc(&w->pool, cap, &cap);
+        if (!p)
+            return -1;
+        if (c->carry_len)
+            memcpy(p, c->carry, c->carry_len);
+        pool_free(&w->pool, c->carry, c->carry_cap);
+        c->carry = p;
+        c->carry_cap = cap;
+    }
+    memcpy(c->carry + c->carry_len, data, len);
+    c->carry_len += len;
+    return 0;
+}
+
+/*
+Modo com quadros. Os bytes lidos são percorridos uma vez: cabeçalhos passam
+intactos, conteúdo é convertido no lugar. Tudo até o fim do último quadro
+completo é respondido de uma vez, junto com o começo desse quadro que tinha
+ficado de leituras anteriores (carry), num único sendmsg(). O que sobra, um
+quadro ainda incompleto, é copiado para o carry e espera a próxima leitura.
+Um quadro pode assim atravessar várias leituras e uma leitura pode trazer
+vários quadros.
+*/
+static int frame_echo(struct worker *w, SOCKET s, struct connection *c,
+        char *data, size_t len) {
+    size_t off = 0, complete = 0;
+    while (off < len) {
+        if (c->frame_hdr_len < FRAME_HEADER) {
+            if (!c->frame_hdr_len)
+                c->frame_since = w->now;
+            c->frame_hdr[c->frame_hdr_len++] = (unsigned char)data[off++];
+            if (c->frame_hdr_len == FRAME_HEADER) {
+                c->frame_left = frame_get_len(c->frame_hdr);
+                if (c->frame_left > FRAME_MAX) {
+                    fprintf(stderr, "Frame too large (%lu bytes).\n",
+                            (unsigned long)c->frame_left);
+                    return -1;
+                }
+                if (!c->frame_left) {
+                    c->frame_hdr_len = 0;
+                    complete = off;
+                    counter_add(&w->stats.messages, 1);
+                }
+            }
+            continue;
+        }
+        size_t n = len - off < c->frame_left ? len - off : c->frame_left;
+        xform_bytes(&w->opts->xform, data + off, n);
+        off += n;
+        c->frame_left -= n;
+        if (!c->frame_left) {
+            c->frame_hdr_len = 0;
+            complete = off;
+            counter_add(&w->stats.messages, 1);
+        }
+    }
+
+    if (complete) {
+        if (conn_send2(w, s, c, c->carry, c->carry_len, data, complete))
+            return -1;
+        c->carry_len = 0;
+        if (complete == len) {
+            pool_free(&w->pool, c->carry, c->carry_cap);
+            c->carry = 0;
+            c->carry_cap = 0;
+        }
+    }
+    if (complete < len)
+        return carry_append(w, c, data + complete, len - complete);
+    return 0;
+}
+
+/*
+Modo com quadros e uma cadeia que acrescenta bytes (crc32c): cada quadro volta
+com o tamanho do cabeçalho corrigido e o CRC depois do conteúdo, então a
+resposta não pode sair do buffer de leitura como em frame_echo(). Ela é
+montada no carry, que aqui guarda a saída: quadros completos são enviados
+no fim de cada leitura e o quadro incompleto continua lá, com o CRC parcial
+em frame_crc.
+*/
+static int frame_echo_trailer(struct worker *w, SOCKET s, struct connection *c,
+        char *data, size_t len) {
+    const struct xform_chain *ch = &w->opts->xform;
+    size_t off = 0, complete = 0;
+    unsigned char hdr[FRAME_HEADER];
+    while (off < len) {
+        if (c->frame_hdr_len < FRAME_HEADER) {
+            if (!c->frame_hdr_len)
+                c->frame_since = w->now;
+            c->frame_hdr[c->frame_hdr_len++] = (unsigned char)data[off++];
+            if (c->frame_hdr_len < FRAME_HEADER)
+                continue;
+            c->frame_left = frame_get_len(c->frame_hdr);
+            if (c->frame_left > FRAME_MAX) {
+                fprintf(stderr, "Frame too large (%lu bytes).\n",
+                        (unsigned long)c->frame_left);
+                return -1;
+            }
+            frame_put_len(hdr, (uint32_t)(c->frame_left + ch->trailer));
+            if (carry_append(w, c, (const char*)hdr, FRAME_HEADER))
+                return -1;
+            c->frame_crc = xform_crc_start();
+        } else {
+            size_t n = len - off < c->frame_left ? len - off : c->frame_left;
+            c->frame_crc = xform_update(ch, data + off, n, c->frame_crc);
+            if (carry_append(w, c, data + off, n))
+                return -1;
+            off += n;
+            c->frame_left -= n;
+        }
+        if (!c->frame_left) {
+            xform_crc_put(hdr, c->frame_crc);
+            if (carry_append(w, c, (const char*)hdr, XFORM_TRAILER))
+                return -1;
+            c->frame_hdr_len = 0;
+            complete = c->carry_len;
+            counter_add(&w->stats.messages, 1);
+        }
+    }
+
+    if (complete) {
+        if (conn_send(w, s, c, c->carry, complete))
+            return -1;
+        c->carry_len -= complete;
+        memmove(c->carry, c->carry + complete, c->carry_len);
+    }
+    return 0;
+}
+
+
+/*
+Aceita uma conexão pendente no socket de escuta e cria o seu estado. Retorna
+o novo socket (já não-bloqueante) ou um socket inválido se não havia nada
+para aceitar. Os laços chamam até esvaziar a fila: numa rajada, uma conexão
+por volta do laço deixaria a fila do listen() transbordar.
+*/
+static SOCKET accept_client(struct worker *w) {
+    struct sockaddr_storage client_address;
+    socklen_t client_len = sizeof(client_address);
+#if defined(HAVE_ACCEPT4)
+    //já não-bloqueante, sem as duas chamadas de fcntl()
+    SOCKET socket_client = accept4(w->socket_listen,
+            (struct sockaddr*) &client_address,
+            &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    SOCKET socket_client = accept(w->socket_listen,
+            (struct sockaddr*) &client_address,
+            &client_len);
+#endif
+    if (!ISVALIDSOCKET(socket_client)) {
+        if (!SOCKETWOULDBLOCK())
+            fprintf(stderr, "accept() failed. (%d)\n", GETSOCKETERRNO());
+        return socket_client;
+    }
+#if !defined(HAVE_ACCEPT4)
+    set_nonblocking(socket_client);
+#endif
+    set_nodelay(socket_client);
+#if defined(HAVE_BUSY_POLL)
+    if (w->opts->busy_poll)
+        busy_poll_socket(socket_client, w->opts->busy_poll);
+#endif
+    counter_add(&w->stats.accepted, 1);
+    struct connection *c = conn_open(w, socket_client);
+    if (!c) {
+        fprintf(stderr, "Out of memory.\n");
+        CLOSESOCKET(socket_client);
+        return INVALID_SOCKET;
+    }
+#if defined(HAVE_ZEROCOPY)
+    if (w->opts->zerocopy) {
+        int yes = 1;
+        if (setsockopt(socket_client, SOL_SOCKET, SO_ZEROCOPY,
+                    (void*)&yes, sizeof(yes)))
+            fprintf(stderr, "setsockopt(SO_ZEROCOPY) failed. (%d)\n",
+                    GETSOCKETERRNO());
+        else
+            c->zc_on = 1;
+    }
+#endif
+
+    //getnameinfo() e printf() por conexão custam caro: só com -v
+    if (log_level >= LOG_INFO) {
+        char address_buffer[100];
+        getnameinfo((struct sockaddr*)&client_address,
+                client_len,
+                address_buffer, sizeof(address_buffer), 0, 0,
+                NI_NUMERICHOST);
+        printf("New connection from %s\n", address_buffer);
+    }
+
+    return socket_client;
+}
+
+
+/*
+Lê o que estiver disponível no socket do cliente, aplica a cadeia de
+transformação (maiúsculas, por padrão) e devolve (no modo com quadros, via
+frame_echo() ou frame_echo_trailer()). Retorna -1 quando a conexão deve ser
+fechada.
+
+O buffer de leitura sai do pool do worker e volta logo depois do envio.
+O tamanho acompanha o tráfego da conexão: dobra quando uma leitura enche o
+buffer e cai pela metade quando ela usa menos de um quarto, entre READ_MIN e
+TAM_READ.
+
+Com zerocopy, respostas de pelo menos opts->zerocopy bytes saem direto do
+buffer de leitura com MSG_ZEROCOPY, que então só volta ao pool quando o
+kernel avisa; respostas menores são copiadas, o que para poucos bytes custa
+menos que fixar as páginas e tratar o aviso.
+*/
+static int on_readable(struct worker *w, SOCKET i) {
+    struct connection *c = &w->conns[(size_t)i];
+    size_t cap;
+    char *read = (char*)pool_alloc(&w->pool, c->read_hint, &cap);
+    if (!read)
+        return -1;
+    if (cap > TAM_READ)
+        cap = TAM_READ;
+    int bytes_received = recv(i, read, (int)cap, 0);
+    counter_add(&w->stats.recv_calls, 1);
+    if (bytes_received < 1) {
+        pool_free(&w->pool, read, cap);
+        if (bytes_received < 0 && SOCKETWOULDBLOCK())
+            return 0;
+        if (bytes_received < 0 || !c->out_len)
+            return -1;
+        c->closing = 1;
+        return 0;
+    }
+
+    counter_add(&w->stats.bytes_in, bytes_received);
+    if ((size_t)bytes_received == cap && cap < TAM_READ)
+        c->read_hint = cap * 2;
+    else if ((size_t)bytes_received < cap / 4 && cap > READ_MIN)
+        c->read_hint = cap / 2;
+
+    int result;
+    if (w->opts->framed && w->opts->xform.trailer) {
+        result = frame_echo_trailer(w, i, c, read, bytes_received);
+    } else if (w->opts->framed) {
+        result = frame_echo(w, i, c, read, bytes_received);
+    } else {
+        counter_add(&w->stats.messages, 1);
+        xform_bytes(&w->opts->xform, read, bytes_received);
+#if defined(HAVE_ZEROCOPY)
+        if (c->zc_on && !c->out_len &&
+                (size_t)bytes_received >= w->opts->zerocopy) {
+            result = zc_send(w, i, c, read, cap, bytes_received);
+            if (result)
+                return result < 0 ? -1 : 0;
+        }
+#endif
+        result = conn_send(w, i, c, read, bytes_received);
+    }
+    pool_free(&w->pool, read, cap);
+    return result;
+}
+
+/*
+Rearma o prazo da conexão depois de algum tráfego: idle_timeout segundos a
+partir de agora e, se um quadro está pela metade, no máximo read_timeout
+segundos depois do começo dele (um cliente que manda um byte de cada vez
+não renova esse prazo). Retorna -1 sem memória para o temporizador.
+*/
+static int conn_timer(struct worker *w, SOCKET s, struct connection *c) {
+    const struct server_options *opts = w->opts;
+    if (!opts->idle_timeout && !opts->read_timeout)
+        return 0;
+    uint64_t deadline = UINT64_MAX;
+    if (opts->idle_timeout)
+        deadline = w->now + (uint64_t)opts->idle_timeout * 1000;
+    if (opts->read_timeout && c->frame_hdr_len) {
+        uint64_t frame = c->frame_since + (uint64_t)opts->read_timeout * 1000;
+        if (frame < deadline)
+            deadline = frame;
+    }
+    if (deadline == UINT64_MAX) {
+        tw_cancel(&w->timers, (int)s);
+        return 0;
+    }
+    return tw_arm(&w->timers, (int)s, deadline);
+}
+
+//Próxima conexão com prazo vencido (socket inválido se não há); o laço a fecha
+static SOCKET conn_next_expired(struct worker *w) {
+    int fd = tw_expired(&w->timers, w->now);
+    if (fd == TW_NONE)
+        return INVALID_SOCKET;
+    counter_add(&w->stats.timeouts, 1);
+    log_info("Connection timed out.\n");
+    return (SOCKET)fd;
+}
+
+//Esvazia a fila de saída e retoma a leitura quando ela cai abaixo de high_water/2
+static int on_writable(struct worker *w, SOCKET i) {
+    struct connection *c = &w->conns[(size_t)i];
+    if (conn_flush(w, i, c) < 0)
+        return -1;
+    if (c->paused && c->out_len <= w->opts->high_water / 2)
+        c->paused = 0;
+    if (c->closing && !c->out_len)
+        return -1;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Mede onde MSG_ZEROCOPY passa a compensar: para cada tamanho de mensagem,
+# roda o tcp_client em modo pipeline contra o servidor copiando (sem -z) e
+# com todo envio sem cópia (-z 1), e imprime as duas vazões lado a lado.
+# O menor tamanho em que a coluna zerocopy ganha é o valor a usar em -z.
+#
+# No loopback o kernel sempre acaba copiando (o servidor informa isso ao
+# fechar cada conexão) e a coluna zerocopy mostra só o custo de fixar as
+# páginas e tratar os avisos. O ganho de verdade aparece entre duas máquinas:
+# lá, rode o servidor com e sem -z e aqui o tcp_client com os mesmos -w e -s.
+#
+# uso: ./zerocopy_sweep.sh [servidor] [cliente]
+
+SERVER=${1:-./tcp_serve_toupper}
+CLIENT=${2:-./tcp_client}
+SIZES=${SIZES:-"1024 4096 8192 16384 32768 65536 131072 262144 524288"}
+WINDOW=${WINDOW:-8}
+COUNT=${COUNT:-2000}
+
+# vazão em MB/s da linha "Window ..." do tcp_client
+measure() {
+    "$CLIENT" 127.0.0.1 8080 -w "$WINDOW" -n "$COUNT" -s "$1" |
+        awk '/^Window/ { for (i = 1; i < NF; ++i) if ($(i+1) == "MB/s") print $i }'
+}
+
+run_mode() {
+    "$SERVER" "$@" >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    for size in $SIZES; do
+        echo "$size $(measure "$size")"
+    done
+    kill "$pid"
+    wait "$pid" 2>/dev/null
+    sleep 0.5
+}
+
+copy=$(mktemp)
+zc=$(mktemp)
+run_mode > "$copy"
+run_mode -z 1 > "$zc"
+
+printf "%10s %12s %12s %8s\n" bytes "copy MB/s" "zc MB/s" ratio
+paste "$copy" "$zc" | awk '{ printf "%10d %12.2f %12.2f %8.2f\n", $1, $2, $4, ($2 > 0 ? $4 / $2 : 0) }'
+rm -f "$copy" "$zc"
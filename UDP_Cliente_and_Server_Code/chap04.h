@@ -22,6 +22,9 @@
  * SOFTWARE.
  */
 
+#ifndef CHAP04_H
+#define CHAP04_H
+
 #if defined(_WIN32)
 #ifndef _WIN32_WINNT
 #define _WIN32_WINNT 0x0600
@@ -46,14 +49,18 @@
 #define ISVALIDSOCKET(s) ((s) != INVALID_SOCKET)
 #define CLOSESOCKET(s) closesocket(s)
 #define GETSOCKETERRNO() (WSAGetLastError())
+#define SOCKETWOULDBLOCK() (WSAGetLastError() == WSAEWOULDBLOCK)
 
 #else
 #define ISVALIDSOCKET(s) ((s) >= 0)
 #define CLOSESOCKET(s) close(s)
 #define SOCKET int
 #define GETSOCKETERRNO() (errno)
+#define SOCKETWOULDBLOCK() (errno == EAGAIN || errno == EWOULDBLOCK)
 #endif
 
 
 #include <stdio.h>
 #include <string.h>
+
+#endif
@@ -0,0 +1,87 @@
+#!/bin/sh
+#
+# Compara o goodput da transferência confiável sobre UDP (udp_client -T) com
+# o caminho TCP (tcp_client em pipeline) à medida que a perda cresce. Para
+# cada perda em LOSSES, roda o UDP com cada controle de CCS e o TCP, e
+# imprime uma linha com os MB/s de cada um.
+#
+# Sem netem a perda e o atraso (DELAY, em ms) são injetados pelo próprio
+# udp_client (-L, -J) e só a linha sem degradação tem a coluna TCP. Com
+# NETEM=1 (root e o módulo sch_netem) a degradação vai para a interface
+# lo com tc, vale igual para os dois protocolos, e o udp_client não injeta
+# nada. O tcp_client mede eco: cada byte vai e volta, enquanto o UDP só leva
+# os dados e traz os ACKs.
+#
+# uso: ./reliable_sweep.sh [diretório dos binários]
+#   LOSSES (%), DELAY (ms), BYTES, SIZE, CCS e NETEM mudam a varredura
+
+BIN=${1:-.}
+LOSSES=${LOSSES:-"0 0.1 0.5 1 2 5"}
+DELAY=${DELAY:-0}
+BYTES=${BYTES:-200m}
+SIZE=${SIZE:-1400}
+CCS=${CCS:-"reno cubic"}
+NETEM=${NETEM:-}
+TCP_SIZE=65536
+TCP_WINDOW=16
+
+# mensagens do tcp_client para mover BYTES
+tcp_count=$(echo "$BYTES" | awk -v size="$TCP_SIZE" '{
+    n = $0 + 0
+    if ($0 ~ /[kK]$/) n *= 1024
+    if ($0 ~ /[mM]$/) n *= 1048576
+    if ($0 ~ /[gG]$/) n *= 1073741824
+    printf "%d\n", (n + size - 1) / size }')
+
+udp_pid=
+tcp_pid=
+cleanup() {
+    [ -n "$udp_pid" ] && kill "$udp_pid" 2>/dev/null
+    [ -n "$tcp_pid" ] && kill "$tcp_pid" 2>/dev/null
+    [ -n "$NETEM" ] && tc qdisc del dev lo root 2>/dev/null
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+"$BIN/udp_serve_toupper" >/dev/null 2>&1 &
+udp_pid=$!
+"$BIN/tcp_serve_toupper" -e epoll >/dev/null 2>&1 &
+tcp_pid=$!
+sleep 0.5
+
+udp_goodput() {
+    "$BIN/udp_client" 127.0.0.1 8080 -T "$BYTES" -s "$SIZE" "$@" 2>/dev/null |
+        awk '/^Goodput/ { print $3 }'
+}
+
+tcp_goodput() {
+    "$BIN/tcp_client" 127.0.0.1 8080 -w "$TCP_WINDOW" -s "$TCP_SIZE" -n "$tcp_count" 2>/dev/null |
+        awk '/^Window/ { for (i = 1; i < NF; ++i) if ($(i+1) == "MB/s") print $i }'
+}
+
+printf "%8s %8s" "loss%" "delay_ms"
+for cc in $CCS; do
+    printf " %12s" "udp_$cc"
+done
+printf " %12s\n" "tcp"
+
+for loss in $LOSSES; do
+    impair=
+    if [ -n "$NETEM" ]; then
+        if ! tc qdisc replace dev lo root netem loss "$loss%" delay "${DELAY}ms"; then
+            echo "netem not available" >&2
+            exit 1
+        fi
+    else
+        impair="-L $loss -J $DELAY"
+    fi
+    printf "%8s %8s" "$loss" "$DELAY"
+    for cc in $CCS; do
+        printf " %12s" "$(udp_goodput -C "$cc" $impair)"
+    done
+    if [ -n "$NETEM" ] || { [ "$loss" = 0 ] && [ "$DELAY" = 0 ]; }; then
+        printf " %12s\n" "$(tcp_goodput)"
+    else
+        printf " %12s\n" "-"
+    fi
+done
@@ -0,0 +1,473 @@
+/*
+ * Modo rajada do udp_client (-r): envia datagramas a uma taxa alvo, sem
+ * esperar os ecos, e mede quanto o servidor sustenta nessa carga.
+ *
+ * Ritmo: balde de fichas. A ficha k fica disponível em t0 + k / R; o envio
+ * dorme até a próxima ficha (girando só nos últimos BLAST_SPIN_NS: um giro
+ * mais longo tira a CPU da thread de recepção e do servidor quando dividem
+ * núcleos) e manda de uma vez, num sendmmsg(), todas as que já venceram. O
+ * atraso de acordar vira uma rajada curta em vez de um envio a menos. O
+ * balde guarda no máximo -b fichas: se o envio atrasar mais que isso, o
+ * excesso é descartado e aparece como "skipped", e a taxa enviada fica
+ * abaixo da oferecida em vez de compensar com uma rajada maior.
+ *
+ * Os ecos são recebidos por outra thread, independente do envio. Cada
+ * datagrama leva no cabeçalho de udp_seq.h o horário previsto da sua ficha,
+ * então o RTT é medido a partir dele e um envio atrasado não esconde a
+ * espera (a mesma correção de omissão coordenada do tcp_loadgen.h).
+ *
+ * Com uma lista de taxas (-r 10000,20000,50000) ou uma faixa (-r 10000:1000000,
+ * dobrando a cada passo) o cliente roda um passo por taxa e aponta o joelho:
+ * o primeiro passo em que a perda passa de BLAST_KNEE_LOSS %, o p99 passa de
+ * BLAST_KNEE_P99 vezes o do primeiro passo ou o próprio cliente não consegue
+ * oferecer a taxa. Na faixa, a varredura pára no joelho.
+ */
+
+#ifndef UDP_BLAST_H
+#define UDP_BLAST_H
+
+#include "chap04.h"
+#include "udp_seq.h"
+#include "../Common_Code/mono_clock.h"
+#include "../Common_Code/latency_hist.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#define HAVE_THREADS
+#endif
+
+#if defined(__linux__)
+#include <sys/prctl.h>
+#define HAVE_MMSG
+#if defined(SO_RXQ_OVFL)
+#define HAVE_RXQ_OVFL
+#endif
+#endif
+
+#define BLAST_DURATION 5.0              //segundos por passo
+#define BLAST_BURST 16                  //fichas no balde
+#define BLAST_BATCH 64                  //datagramas por sendmmsg/recvmmsg
+#define BLAST_MAX_STEPS 32
+#define BLAST_SPIN_NS 5000u             //abaixo disso gira em vez de dormir
+#define BLAST_GRACE_NS 500000000u       //espera pelos ecos depois de cada passo
+#define BLAST_SOCKBUF (4 * 1024 * 1024) //o cliente não deve ser o gargalo
+#define BLAST_KNEE_LOSS 1.0             //perda (%) que marca o joelho
+#define BLAST_KNEE_P99 10.0             //p99 em múltiplos do primeiro passo
+
+struct blast_options {
+    double rates[BLAST_MAX_STEPS];  //datagramas/s, ou Mbit/s com mbit
+    int nrates;
+    int mbit;                       //rates em Mbit/s de carga útil (-m)
+    int until_knee;                 //faixa: pára no primeiro joelho
+    double duration;
+    int burst;
+    int size;
+};
+
+struct blast_step {
+    double offered;             //datagramas/s
+    long sent;
+    long skipped;               //fichas descartadas com o balde cheio
+    long send_errors;           //ENOBUFS e afins: o datagrama não saiu
+    long received;              //ecos distintos
+    unsigned long client_drops; //descartes na fila de recepção do cliente
+    uint64_t t0;                //início do passo
+    long stale;                 //ecos atrasados de um passo anterior
+    struct seq_tracker seqs;
+    struct latency_hist rtt;    //a partir do horário previsto
+    struct latency_hist lag;    //envio real menos horário previsto
+};
+
+struct blast_rx {
+    SOCKET s;
+    int size;
+    int stop;
+    struct blast_step *step;
+    uint32_t drops;             //contador do SO_RXQ_OVFL, acumulado no socket
+    uint32_t drops_base;        //o valor dele no começo do passo
+#if defined(HAVE_THREADS)
+    pthread_t thread;
+#endif
+};
+
+/*
+Lê "R", "R1,R2,..." ou "A:B" (de A dobrando até B). Retorna -1 se o texto
+não for válido.
+*/
+static int blast_parse_rates(const char *arg, struct blast_options *opts) {
+    char *p;
+    double first = strtod(arg, &p);
+    opts->nrates = 0;
+    opts->until_knee = 0;
+    if (first <= 0)
+        return -1;
+    if (*p == ':') {
+        double last = strtod(p + 1, &p);
+        if (*p || last < first)
+            return -1;
+        double r;
+        for (r = first; r < last && opts->nrates < BLAST_MAX_STEPS - 1; r *= 2)
+            opts->rates[opts->nrates++] = r;
+        opts->rates[opts->nrates++] = last;
+        opts->until_knee = 1;
+        return 0;
+    }
+    opts->rates[opts->nrates++] = first;
+    while (*p == ',' && opts->nrates < BLAST_MAX_STEPS) {
+        double r = strtod(p + 1, &p);
+        if (r <= 0)
+            return -1;
+        opts->rates[opts->nrates++] = r;
+    }
+    return *p ? -1 : 0;
+}
+
+static void blast_sleep_until(uint64_t when) {
+    uint64_t now = mono_ns();
+    if (when > now + BLAST_SPIN_NS) {
+        uint64_t ns = when - now - BLAST_SPIN_NS;
+        struct timespec ts;
+        ts.tv_sec = (time_t)(ns / 1000000000u);
+        ts.tv_nsec = (long)(ns % 1000000000u);
+        nanosleep(&ts, 0);
+    }
+    while (mono_ns() < when)
+        ;
+}
+
+//Contabiliza um eco; buf traz um datagrama inteiro
+static void blast_track(struct blast_rx *rx, const char *buf, int len, uint64_t now) {
+    struct blast_step *st = rx->step;
+    struct seq_header h;
+    /*
+    Todo passo recomeça a numeração no mesmo socket: um eco que passou do
+    BLAST_GRACE_NS do seu passo marcaria o número no passo seguinte, com um
+    RTT medido do envio antigo.
+    */
+    if (!seq_read(buf, len, &h) && h.sent_ns < st->t0) {
+        st->stale++;
+        return;
+    }
+    if (seq_track(&st->seqs, buf, len, 'A', &h) != SEQ_NEW)
+        return;
+    //o envio acompanha received para encerrar a espera mais cedo
+    __atomic_store_n(&st->received, st->received + 1, __ATOMIC_RELAXED);
+    hist_record(&st->rtt, now > h.sent_ns ? now - h.sent_ns : 0);
+}
+
+#if defined(HAVE_RXQ_OVFL)
+static void blast_note_drops(struct blast_rx *rx, struct msghdr *msg) {
+    struct cmsghdr *cm;
+    for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(cm), sizeof(drops));
+            rx->drops = drops;
+            rx->step->client_drops = drops - rx->drops_base;
+        }
+    }
+}
+#endif
+
+/*
+Thread de recepção: espera com select() (acordando a cada 10 ms para ver se
+o passo acabou) e drena a fila com recvmmsg(), ou um recv() por datagrama.
+*/
+static void *blast_rx_thread(void *arg) {
+    struct blast_rx *rx = (struct blast_rx*)arg;
+    int batch = 1;
+#if defined(HAVE_MMSG)
+    batch = BLAST_BATCH;
+    struct mmsghdr msgs[BLAST_BATCH];
+    struct iovec iovs[BLAST_BATCH];
+#if defined(HAVE_RXQ_OVFL)
+    char ctrl[BLAST_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+#endif
+#endif
+    char *bufs = (char*)malloc((size_t)batch * rx->size);
+    if (!bufs) {
+        fprintf(stderr, "Out of memory.\n");
+        return 0;
+    }
+
+    while (!__atomic_load_n(&rx->stop, __ATOMIC_ACQUIRE)) {
+        fd_set reads;
+        FD_ZERO(&reads);
+        FD_SET(rx->s, &reads);
+        struct timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 10000;
+        if (select(rx->s+1, &reads, 0, 0, &timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "select() failed. (%d)\n", GETSOCKETERRNO());
+            break;
+        }
+        if (!FD_ISSET(rx->s, &reads))
+            continue;
+
+#if defined(HAVE_MMSG)
+        int n, k;
+        do {
+            for (k = 0; k < batch; ++k) {
+                iovs[k].iov_base = bufs + (size_t)k * rx->size;
+                iovs[k].iov_len = rx->size;
+                memset(&msgs[k].msg_hdr, 0, sizeof(msgs[k].msg_hdr));
+                msgs[k].msg_hdr.msg_iov = &iovs[k];
+                msgs[k].msg_hdr.msg_iovlen = 1;
+#if defined(HAVE_RXQ_OVFL)
+                msgs[k].msg_hdr.msg_control = ctrl[k];
+                msgs[k].msg_hdr.msg_controllen = sizeof(ctrl[k]);
+#endif
+            }
+            n = recvmmsg(rx->s, msgs, batch, MSG_DONTWAIT, 0);
+            uint64_t now = mono_ns();
+            for (k = 0; k < n; ++k) {
+#if defined(HAVE_RXQ_OVFL)
+                blast_note_drops(rx, &msgs[k].msg_hdr);
+#endif
+                blast_track(rx, (const char*)iovs[k].iov_base,
+                        (int)msgs[k].msg_len, now);
+            }
+        } while (n == batch);
+#else
+        int bytes_received = recv(rx->s, bufs, rx->size, 0);
+        if (bytes_received > 0)
+            blast_track(rx, bufs, bytes_received, mono_ns());
+#endif
+    }
+    free(bufs);
+    return 0;
+}
+
+/*
+Envia um passo: rate * duration fichas, a partir de t0. bufs tem BLAST_BATCH
+mensagens de size bytes já preenchidas; só o cabeçalho muda.
+*/
+static void blast_send(SOCKET s, const struct blast_options *opts,
+        struct blast_step *st, char *bufs) {
+    long total = (long)(st->offered * opts->duration);
+    double period = 1e9 / st->offered;
+    int size = opts->size;
+    long next = 0;
+#if defined(HAVE_MMSG)
+    struct mmsghdr msgs[BLAST_BATCH];
+    struct iovec iovs[BLAST_BATCH];
+    int k;
+    memset(msgs, 0, sizeof(msgs));
+    for (k = 0; k < BLAST_BATCH; ++k) {
+        iovs[k].iov_base = bufs + (size_t)k * size;
+        iovs[k].iov_len = size;
+        msgs[k].msg_hdr.msg_iov = &iovs[k];
+        msgs[k].msg_hdr.msg_iovlen = 1;
+    }
+#endif
+
+    uint64_t t0 = mono_ns();
+    while (next < total) {
+        uint64_t now = mono_ns();
+        long due = (long)((now - t0) / period) + 1;
+        if (due > total)
+            due = total;
+        //balde cheio: as fichas acima de burst se perdem
+        if (due - next > opts->burst) {
+            st->skipped += due - next - opts->burst;
+            next = due - opts->burst;
+        }
+
+        while (next < due) {
+            int n = due - next < BLAST_BATCH ? (int)(due - next) : BLAST_BATCH;
+#if !defined(HAVE_MMSG)
+            n = 1;
+#endif
+            int j;
+            for (j = 0; j < n; ++j)
+                seq_write(bufs + (size_t)j * size, (uint32_t)(next + j),
+                        t0 + (uint64_t)((next + j) * period));
+#if defined(HAVE_MMSG)
+            int r = sendmmsg(s, msgs, n, 0);
+#else
+            int r = send(s, bufs, size, 0) < 0 ? -1 : 1;
+#endif
+            if (r <= 0) {
+                if (errno == EINTR)
+                    continue;
+                //a fila de envio ou da interface encheu: o primeiro se perde
+                st->send_errors++;
+                r = 1;
+            } else {
+                //atraso só dos que saíram; o resto volta no próximo envio
+                for (j = 0; j < r; ++j) {
+                    uint64_t intended = t0 + (uint64_t)((next + j) * period);
+                    hist_record(&st->lag, now > intended ? now - intended : 0);
+                }
+                st->sent += r;
+            }
+            next += r;
+        }
+
+        if (next < total)
+            blast_sleep_until(t0 + (uint64_t)(next * period));
+    }
+}
+
+static double blast_loss(const struct blast_step *st) {
+    return st->sent ? 100.0 * (st->sent - st->received) / st->sent : 0.0;
+}
+
+/*
+Motivo do joelho neste passo, ou 0 se ele ainda está bom. O p99 do primeiro
+passo serve de referência; abaixo de 1 ms ele não conta como explosão.
+*/
+static const char *blast_knee(const struct blast_step *st, uint64_t base_p99) {
+    long tokens = st->sent + st->send_errors + st->skipped;
+    if (st->skipped > tokens / 20)
+        return "sender";
+    if (st->send_errors > st->sent / 100)
+        return "send errors";
+    if (blast_loss(st) > BLAST_KNEE_LOSS)
+        return "loss";
+    uint64_t p99 = hist_percentile(&st->rtt, 99.0);
+    if (p99 > 1000000 && p99 > BLAST_KNEE_P99 * base_p99)
+        return "latency";
+    return 0;
+}
+
+//Roda todos os passos pedidos no socket já conectado
+static int run_blast(SOCKET s, struct blast_options *opts) {
+#if !defined(HAVE_THREADS)
+    (void)s;
+    (void)opts;
+    fprintf(stderr, "blast mode requires threads.\n");
+    return 1;
+#else
+#if defined(PR_SET_TIMERSLACK)
+    //a folga padrão de 50 us nos timers viraria atraso em todo envio
+    prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+#endif
+    int buf = BLAST_SOCKBUF;
+    setsockopt(s, SOL_SOCKET, SO_SNDBUF, (void*)&buf, sizeof(buf));
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, (void*)&buf, sizeof(buf));
+#if defined(HAVE_RXQ_OVFL)
+    int one = 1;
+    setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, (void*)&one, sizeof(one));
+#endif
+
+    struct blast_step *steps =
+        (struct blast_step*)calloc(opts->nrates, sizeof(*steps));
+    char *bufs = (char*)malloc((size_t)BLAST_BATCH * opts->size);
+    if (!steps || !bufs) {
+        fprintf(stderr, "Out of memory.\n");
+        free(steps);
+        free(bufs);
+        return 1;
+    }
+    memset(bufs, 'a', (size_t)BLAST_BATCH * opts->size);
+
+    printf("Blasting %d-byte datagrams, %.1f s per step, burst %d\n",
+            opts->size, opts->duration, opts->burst);
+    printf("%12s %12s %12s %9s %9s %8s %9s %9s %9s  %s\n", "offered/s",
+            "sent/s", "achieved/s", "Mbit/s", "skipped", "loss%", "p50(us)",
+            "p99(us)", "lag99(us)", "");
+    fflush(stdout);
+
+    int k, nsteps = 0, knee = -1;
+    const char *why = 0;
+    uint64_t base_p99 = 0;
+    uint32_t drops = 0;
+    for (k = 0; k < opts->nrates; ++k) {
+        struct blast_step *st = &steps[k];
+        st->offered = opts->mbit ?
+            opts->rates[k] * 1e6 / 8 / opts->size : opts->rates[k];
+        long total = (long)(st->offered * opts->duration);
+        if (total < 1 || total > (long)UINT32_MAX) {
+            fprintf(stderr, "rate out of range: %.0f datagrams/s.\n", st->offered);
+            break;
+        }
+        hist_init(&st->rtt);
+        hist_init(&st->lag);
+        if (seq_init(&st->seqs, (uint32_t)total)) {
+            fprintf(stderr, "Out of memory.\n");
+            break;
+        }
+
+        struct blast_rx rx;
+        memset(&rx, 0, sizeof(rx));
+        rx.s = s;
+        rx.size = opts->size;
+        rx.step = st;
+        rx.drops = rx.drops_base = drops;
+        st->t0 = mono_ns();
+        if (pthread_create(&rx.thread, 0, blast_rx_thread, &rx)) {
+            fprintf(stderr, "pthread_create() failed.\n");
+            seq_free(&st->seqs);
+            break;
+        }
+        blast_send(s, opts, st, bufs);
+        uint64_t grace = mono_ns() + BLAST_GRACE_NS;
+        while (mono_ns() < grace &&
+                __atomic_load_n(&st->received, __ATOMIC_RELAXED) < st->sent) {
+            struct timespec ts = {0, 1000000};
+            nanosleep(&ts, 0);
+        }
+        __atomic_store_n(&rx.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(rx.thread, 0);
+        drops = rx.drops;
+        nsteps++;
+
+        uint64_t p99 = hist_percentile(&st->rtt, 99.0);
+        if (k == 0)
+            base_p99 = p99;
+        const char *reason = blast_knee(st, base_p99);
+        printf("%12.0f %12.0f %12.0f %9.1f %9ld %8.3f %9.1f %9.1f %9.1f  %s\n",
+                st->offered, st->sent / opts->duration,
+                st->received / opts->duration,
+                st->received * 8.0 * opts->size / opts->duration / 1e6,
+                st->skipped, blast_loss(st),
+                hist_percentile(&st->rtt, 50.0) / 1e3, p99 / 1e3,
+                hist_percentile(&st->lag, 99.0) / 1e3, reason ? reason : "");
+        fflush(stdout);
+        if (reason && knee < 0) {
+            knee = k;
+            why = reason;
+            if (opts->until_knee)
+                break;
+        }
+    }
+
+    if (nsteps == 1) {
+        struct blast_step *st = &steps[0];
+        printf("\n");
+        hist_print(&st->rtt, "RTT (corrected)");
+        hist_print(&st->lag, "Send lag");
+        seq_print(&st->seqs, st->sent);
+    }
+    for (k = 0; k < nsteps; ++k) {
+        if (steps[k].send_errors || steps[k].client_drops || steps[k].stale)
+            printf("Step %.0f/s: %ld send errors, %lu drops in our receive queue, "
+                    "%ld late echoes of earlier steps ignored\n", steps[k].offered,
+                    steps[k].send_errors, steps[k].client_drops, steps[k].stale);
+    }
+    if (nsteps > 1) {
+        if (knee == 0)
+            printf("\nKnee: at or below %.0f datagrams/s (%s)\n",
+                    steps[0].offered, why);
+        else if (knee > 0)
+            printf("\nKnee: between %.0f and %.0f datagrams/s (%s)\n",
+                    steps[knee - 1].offered, steps[knee].offered, why);
+        else
+            printf("\nNo knee up to %.0f datagrams/s\n", steps[nsteps - 1].offered);
+    }
+
+    for (k = 0; k < nsteps; ++k)
+        seq_free(&steps[k].seqs);
+    free(steps);
+    free(bufs);
+    return nsteps ? 0 : 1;
+#endif
+}
+
+#endif
@@ -0,0 +1,638 @@
+/*
+ * Transferência confiável do udp_client (-T): o lado que envia. O formato e
+ * o lado que recebe estão em udp_reliable.h.
+ *
+ * Janela: no máximo cwnd pacotes em trânsito (nem confirmados nem dados como
+ * perdidos) e nunca mais de -W acima do ack cumulativo. Cada pacote da
+ * janela tem um estado no placar:
+ *
+ *   INFLIGHT   enviado, sem notícia
+ *   SACKED     o servidor já tem (faixa SACK de algum ACK)
+ *   LOST       dado como perdido, espera retransmissão
+ *
+ * Retransmissão rápida: um pacote ainda na primeira transmissão é dado como
+ * perdido quando há RDT_DUPTHRESH pacotes acima dele já recebidos; não é
+ * preciso esperar três ACKs duplicados, o SACK diz exatamente o que falta.
+ * Com até RDT_DUPTHRESH pacotes pendentes o limite cai para o que há acima
+ * dele (como no early retransmit, RFC 5827), senão uma janela pequena só
+ * se recuperaria pelo RTO.
+ * Uma retransmissão perdida só é recuperada pelo RTO.
+ *
+ * RTO: calculado como no RFC 6298 a partir do RTT de cada ACK (o ACK devolve
+ * o instante de envio da transmissão que o gerou, então retransmissões
+ * também dão amostras válidas), com piso RDT_MIN_RTO_NS e dobrando a cada
+ * expiração seguida. Quando o pacote mais antigo passa do RTO, tudo o que
+ * está em trânsito é dado como perdido.
+ *
+ * Controle de congestionamento: struct rdt_cc, com os eventos de ACK, perda
+ * (uma vez por janela: o episódio de recuperação vai até o que já tinha sido
+ * enviado quando a perda foi vista) e RTO. Há reno, cubic (RFC 8312) e fixed
+ * (janela constante -W, sem controle); um novo é uma struct e uma linha em
+ * rdt_ccs[].
+ *
+ * Degradação injetada (-L, -J, -O): antes de sair, cada DATA pode ser
+ * descartado, atrasado ou atrasado mais RDT_REORDER_NS para ser
+ * ultrapassado pelos seguintes; a perda vale também para os ACKs que chegam.
+ * Assim dá para comparar com o TCP num loopback sem netem.
+ */
+
+#ifndef UDP_BULK_H
+#define UDP_BULK_H
+
+#include "chap04.h"
+#include "udp_reliable.h"
+#include "../Common_Code/mono_clock.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define RDT_PAYLOAD 1400                //carga útil padrão: cabe num MTU de 1500
+#define RDT_INIT_CWND 10
+#define RDT_DUPTHRESH 3
+#define RDT_INIT_RTO_NS 200000000ull
+#define RDT_MIN_RTO_NS 20000000ull      //o Linux usa 200 ms; no loopback é demais
+#define RDT_MAX_RTO_NS 2000000000ull
+#define RDT_MAX_WAIT_NS 100000000ull
+#define RDT_REORDER_NS 1000000ull       //atraso extra de um pacote reordenado
+#define RDT_GIVE_UP 10                  //RTOs seguidos antes de desistir
+#define RDT_SOCKBUF (4 * 1024 * 1024)
+
+enum {RDT_NONE, RDT_INFLIGHT, RDT_SACKED, RDT_LOST};
+enum {RDT_BY_FAST, RDT_BY_RTO};      //por que um pacote LOST foi marcado
+
+struct rdt_sender;
+
+struct rdt_cc {
+    const char *name;
+    void (*init)(struct rdt_sender *s);
+    void (*on_ack)(struct rdt_sender *s, long acked, uint64_t now);
+    void (*on_loss)(struct rdt_sender *s, uint64_t now);
+    void (*on_timeout)(struct rdt_sender *s);
+};
+
+struct bulk_options {
+    long long bytes;
+    int payload;
+    int window;             //pacotes acima do ack cumulativo (-W)
+    const struct rdt_cc *cc;
+    double loss;            //fração de DATA e ACKs descartados
+    double reorder;         //fração de DATA atrasados para fora de ordem
+    uint64_t delay_ns;      //atraso de todo DATA
+};
+
+//Um DATA retido pela degradação injetada, numa fila de prioridade por horário
+struct rdt_delayed {
+    uint64_t at;
+    uint64_t order;         //desempate: mesmo horário sai na ordem de entrada
+    int len;
+    char *data;
+};
+
+struct rdt_sender {
+    const struct bulk_options *opts;
+    SOCKET s;
+    uint32_t session;
+    uint32_t total;
+    uint32_t una;           //primeiro sem ack cumulativo
+    uint32_t next;          //próximo pacote novo
+    uint32_t highest_sacked;    //maior pacote recebido pelo servidor + 1
+    uint32_t loss_scan;     //abaixo disso a retransmissão rápida já olhou
+    uint32_t lost_from;     //nenhum LOST abaixo disso
+    uint32_t recovery;      //fim do episódio de recuperação
+    int in_recovery;
+    long inflight;
+    long lost;
+    unsigned char state[RDT_WINDOW];
+    unsigned char retx[RDT_WINDOW];
+    unsigned char cause[RDT_WINDOW];    //RDT_BY_*, vale enquanto LOST
+    uint64_t xmit[RDT_WINDOW];
+
+    double cwnd, ssthresh;
+    double w_max, cubic_k;  //cubic
+    uint64_t epoch;
+
+    uint64_t srtt, rttvar, rto, min_rtt;
+    int backoff;            //expoente do RTO, limitado por RDT_MAX_RTO_NS
+    int expired;            //RTOs seguidos sem nenhum ACK no meio
+
+    char *packet;
+    struct rdt_delayed *held;
+    int nheld, held_cap;
+    uint64_t held_order;
+    uint64_t rng;
+
+    unsigned long sent, retransmits, acks;
+    unsigned long fast, after_rto;  //retransmissões de fato, por causa
+    unsigned long timeouts;         //RTOs vencidos
+    unsigned long dropped_data, dropped_acks, delayed, reordered;
+};
+
+//Reno: crescimento exponencial até ssthresh, depois um pacote por RTT
+static void reno_init(struct rdt_sender *s) {
+    s->cwnd = RDT_INIT_CWND;
+    s->ssthresh = s->opts->window;
+}
+
+static void reno_on_ack(struct rdt_sender *s, long acked, uint64_t now) {
+    (void)now;
+    if (s->cwnd < s->ssthresh)
+        s->cwnd += acked;
+    else
+        s->cwnd += (double)acked / s->cwnd;
+}
+
+static void reno_on_loss(struct rdt_sender *s, uint64_t now) {
+    (void)now;
+    s->ssthresh = s->cwnd / 2 > 2 ? s->cwnd / 2 : 2;
+    s->cwnd = s->ssthresh;
+}
+
+static void reno_on_timeout(struct rdt_sender *s) {
+    s->ssthresh = s->cwnd / 2 > 2 ? s->cwnd / 2 : 2;
+    s->cwnd = 1;
+}
+
+//Cubic: a janela volta a w_max por uma cúbica do tempo desde a última perda
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+static void cubic_on_ack(struct rdt_sender *s, long acked, uint64_t now) {
+    if (s->cwnd < s->ssthresh) {
+        s->cwnd += acked;
+        return;
+    }
+    if (!s->epoch) {
+        s->epoch = now;
+        if (s->w_max < s->cwnd) {
+            s->w_max = s->cwnd;
+            s->cubic_k = 0;
+        } else {
+            s->cubic_k = cbrt(s->w_max * (1 - CUBIC_BETA) / CUBIC_C);
+        }
+    }
+    double rtt = s->srtt ? s->srtt / 1e9 : 0.001;
+    double t = (now - s->epoch) / 1e9 + rtt;
+    double target = CUBIC_C * pow(t - s->cubic_k, 3) + s->w_max;
+    //região amigável ao TCP: nunca abaixo do que o reno teria
+    double reno = s->w_max * CUBIC_BETA +
+        3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * (t / rtt);
+    if (reno > target)
+        target = reno;
+    if (target > s->cwnd)
+        s->cwnd += (target - s->cwnd) / s->cwnd * acked;
+    else
+        s->cwnd += 0.01 * acked / s->cwnd;
+}
+
+static void cubic_on_loss(struct rdt_sender *s, uint64_t now) {
+    (void)now;
+    s->w_max = s->cwnd;
+    s->cwnd = s->cwnd * CUBIC_BETA > 2 ? s->cwnd * CUBIC_BETA : 2;
+    s->ssthresh = s->cwnd;
+    s->epoch = 0;
+}
+
+static void cubic_on_timeout(struct rdt_sender *s) {
+    cubic_on_loss(s, 0);
+    s->cwnd = 1;
+}
+
+//Fixed: janela constante, para medir o protocolo sem controle
+static void fixed_init(struct rdt_sender *s) {
+    s->cwnd = s->opts->window;
+    s->ssthresh = s->opts->window;
+}
+
+static void fixed_ignore(struct rdt_sender *s) {
+    (void)s;
+}
+
+static void fixed_on_ack(struct rdt_sender *s, long acked, uint64_t now) {
+    (void)s;
+    (void)acked;
+    (void)now;
+}
+
+static void fixed_on_loss(struct rdt_sender *s, uint64_t now) {
+    (void)s;
+    (void)now;
+}
+
+static const struct rdt_cc rdt_reno = {
+    "reno", reno_init, reno_on_ack, reno_on_loss, reno_on_timeout};
+static const struct rdt_cc rdt_cubic = {
+    "cubic", reno_init, cubic_on_ack, cubic_on_loss, cubic_on_timeout};
+static const struct rdt_cc rdt_fixed = {
+    "fixed", fixed_init, fixed_on_ack, fixed_on_loss, fixed_ignore};
+
+static const struct rdt_cc *const rdt_ccs[] = {&rdt_reno, &rdt_cubic, &rdt_fixed};
+
+static const struct rdt_cc *rdt_find_cc(const char *name) {
+    size_t k;
+    for (k = 0; k < sizeof(rdt_ccs) / sizeof(rdt_ccs[0]); ++k)
+        if (!strcmp(rdt_ccs[k]->name, name))
+            return rdt_ccs[k];
+    return 0;
+}
+
+//xorshift64*: barato e o bastante para sortear perdas
+static double rdt_random(struct rdt_sender *s) {
+    s->rng ^= s->rng >> 12;
+    s->rng ^= s->rng << 25;
+    s->rng ^= s->rng >> 27;
+    return (double)((s->rng * 2685821657736338717ull) >> 11) / 9007199254740992.0;
+}
+
+static int rdt_held_before(const struct rdt_delayed *a, const struct rdt_delayed *b) {
+    return a->at < b->at || (a->at == b->at && a->order < b->order);
+}
+
+static void rdt_held_swap(struct rdt_sender *s, int a, int b) {
+    struct rdt_delayed t = s->held[a];
+    s->held[a] = s->held[b];
+    s->held[b] = t;
+}
+
+static int rdt_hold(struct rdt_sender *s, const char *data, int len, uint64_t at) {
+    if (s->nheld == s->held_cap) {
+        int cap = s->held_cap ? s->held_cap * 2 : 256;
+        struct rdt_delayed *p = (struct rdt_delayed*)realloc(s->held,
+                cap * sizeof(*p));
+        if (!p)
+            return -1;
+        memset(p + s->held_cap, 0, (cap - s->held_cap) * sizeof(*p));
+        s->held = p;
+        s->held_cap = cap;
+    }
+    struct rdt_delayed *d = &s->held[s->nheld];
+    //os buffers ficam com as entradas e são reaproveitados
+    if (!d->data) {
+        d->data = (char*)malloc(RDT_HEADER_SIZE + s->opts->payload);
+        if (!d->data)
+            return -1;
+    }
+    memcpy(d->data, data, len);
+    d->len = len;
+    d->at = at;
+    d->order = s->held_order++;
+    int k = s->nheld++;
+    while (k > 0 && rdt_held_before(&s->held[k], &s->held[(k - 1) / 2])) {
+        rdt_held_swap(s, k, (k - 1) / 2);
+        k = (k - 1) / 2;
+    }
+    return 0;
+}
+
+//Envia os DATA retidos cujo horário chegou
+static void rdt_release(struct rdt_sender *s, uint64_t now) {
+    while (s->nheld && s->held[0].at <= now) {
+        send(s->s, s->held[0].data, s->held[0].len, 0);
+        rdt_held_swap(s, 0, --s->nheld);
+        int k = 0;
+        while (1) {
+            int c = 2 * k + 1;
+            if (c >= s->nheld)
+                break;
+            if (c + 1 < s->nheld && rdt_held_before(&s->held[c + 1], &s->held[c]))
+                c++;
+            if (!rdt_held_before(&s->held[c], &s->held[k]))
+                break;
+            rdt_held_swap(s, k, c);
+            k = c;
+        }
+    }
+}
+
+static void rdt_transmit(struct rdt_sender *s, uint32_t seq, uint64_t now) {
+    uint32_t b = seq % RDT_WINDOW;
+    int payload = s->opts->payload;
+    if (seq == s->total - 1 && s->opts->bytes % payload)
+        payload = (int)(s->opts->bytes % payload);
+    int len = RDT_HEADER_SIZE + payload;
+    rdt_write(s->packet, RDT_DATA, s->session, seq, s->total, now);
+    memset(s->packet + RDT_HEADER_SIZE, rdt_fill(seq), payload);
+    s->state[b] = RDT_INFLIGHT;
+    s->xmit[b] = now;
+    s->inflight++;
+    s->sent++;
+
+    const struct bulk_options *o = s->opts;
+    if (o->loss > 0 && rdt_random(s) < o->loss) {
+        s->dropped_data++;
+        return;
+    }
+    uint64_t delay = o->delay_ns;
+    if (o->reorder > 0 && rdt_random(s) < o->reorder) {
+        delay += RDT_REORDER_NS;
+        s->reordered++;
+    }
+    if (delay) {
+        s->delayed++;
+        if (!rdt_hold(s, s->packet, len, now + delay))
+            return;
+    }
+    //ENOBUFS e afins: para o protocolo é uma perda como outra qualquer
+    send(s->s, s->packet, len, 0);
+}
+
+//Próximo pacote LOST a partir de lost_from
+static long rdt_next_lost(struct rdt_sender *s) {
+    uint32_t seq = s->lost_from > s->una ? s->lost_from : s->una;
+    for (; seq < s->next; ++seq) {
+        if (s->state[seq % RDT_WINDOW] == RDT_LOST) {
+            s->lost_from = seq + 1;
+            return seq;
+        }
+    }
+    s->lost_from = seq;
+    return -1;
+}
+
+//Envia enquanto a janela deixar: retransmissões primeiro, depois pacotes novos
+static void rdt_fill_window(struct rdt_sender *s, uint64_t now) {
+    double limit = s->cwnd < s->opts->window ? s->cwnd : s->opts->window;
+    while (s->inflight < limit) {
+        if (s->lost) {
+            long seq = rdt_next_lost(s);
+            if (seq >= 0) {
+                s->lost--;
+                s->retx[seq % RDT_WINDOW] = 1;
+                s->retransmits++;
+                if (s->cause[seq % RDT_WINDOW] == RDT_BY_FAST)
+                    s->fast++;
+                else
+                    s->after_rto++;
+                rdt_transmit(s, (uint32_t)seq, now);
+                continue;
+            }
+            s->lost = 0;
+        }
+        if (s->next >= s->total || s->next - s->una >= (uint32_t)s->opts->window)
+            break;
+        s->retx[s->next % RDT_WINDOW] = 0;
+        rdt_transmit(s, s->next++, now);
+    }
+}
+
+static void rdt_mark_lost(struct rdt_sender *s, uint32_t seq, int cause) {
+    s->state[seq % RDT_WINDOW] = RDT_LOST;
+    s->cause[seq % RDT_WINDOW] = (unsigned char)cause;
+    s->inflight--;
+    s->lost++;
+    if (seq < s->lost_from)
+        s->lost_from = seq;
+}
+
+//RFC 6298: SRTT e RTTVAR a partir de uma amostra
+static void rdt_rtt_sample(struct rdt_sender *s, uint64_t rtt) {
+    if (!s->min_rtt || rtt < s->min_rtt)
+        s->min_rtt = rtt;
+    if (!s->srtt) {
+        s->srtt = rtt;
+        s->rttvar = rtt / 2;
+    } else {
+        uint64_t diff = rtt > s->srtt ? rtt - s->srtt : s->srtt - rtt;
+        s->rttvar = (3 * s->rttvar + diff) / 4;
+        s->srtt = (7 * s->srtt + rtt) / 8;
+    }
+    s->rto = s->srtt + 4 * s->rttvar;
+    if (s->rto < RDT_MIN_RTO_NS)
+        s->rto = RDT_MIN_RTO_NS;
+    if (s->rto > RDT_MAX_RTO_NS)
+        s->rto = RDT_MAX_RTO_NS;
+    s->backoff = 0;
+}
+
+static void rdt_on_ack(struct rdt_sender *s, const char *buf, int len, uint64_t now) {
+    struct rdt_header h;
+    if (rdt_read(buf, len, &h) || h.type != RDT_ACK || h.session != s->session)
+        return;
+    s->acks++;
+    s->expired = 0;
+    if (h.stamp && now > h.stamp)
+        rdt_rtt_sample(s, now - h.stamp);
+
+    long delivered = 0;
+    uint32_t cum = h.seq < s->next ? h.seq : s->next;
+    for (; s->una < cum; s->una++) {
+        unsigned char *st = &s->state[s->una % RDT_WINDOW];
+        if (*st == RDT_INFLIGHT)
+            s->inflight--;
+        else if (*st == RDT_LOST)
+            s->lost--;
+        if (*st != RDT_SACKED)
+            delivered++;
+        *st = RDT_NONE;
+    }
+    if (s->highest_sacked < s->una)
+        s->highest_sacked = s->una;
+
+    int nsack = (unsigned char)buf[5];
+    int k;
+    for (k = 0; k < nsack && RDT_HEADER_SIZE + (k + 1) * 8 <= len; ++k) {
+        uint32_t range[2];
+        memcpy(range, buf + RDT_HEADER_SIZE + k * 8, 8);
+        uint32_t start = ntohl(range[0]), end = ntohl(range[1]);
+        if (start < s->una)
+            start = s->una;
+        if (end > s->next)
+            end = s->next;
+        uint32_t seq;
+        for (seq = start; seq < end; ++seq) {
+            unsigned char *st = &s->state[seq % RDT_WINDOW];
+            if (*st == RDT_INFLIGHT)
+                s->inflight--;
+            else if (*st == RDT_LOST)
+                s->lost--;
+            else
+                continue;
+            *st = RDT_SACKED;
+            delivered++;
+        }
+        if (end > s->highest_sacked)
+            s->highest_sacked = end;
+    }
+
+    //retransmissão rápida: RDT_DUPTHRESH pacotes acima já chegaram
+    int loss = 0;
+    uint32_t thresh = RDT_DUPTHRESH;
+    if (s->next - s->una <= RDT_DUPTHRESH)
+        thresh = s->next - s->una > 1 ? s->next - s->una - 1 : 1;
+    if (s->loss_scan < s->una)
+        s->loss_scan = s->una;
+    for (; s->loss_scan + thresh < s->highest_sacked; s->loss_scan++) {
+        uint32_t b = s->loss_scan % RDT_WINDOW;
+        if (s->state[b] == RDT_INFLIGHT && !s->retx[b]) {
+            rdt_mark_lost(s, s->loss_scan, RDT_BY_FAST);
+            loss = 1;
+        }
+    }
+
+    if (s->in_recovery && s->una >= s->recovery)
+        s->in_recovery = 0;
+    if (loss && !s->in_recovery) {
+        s->opts->cc->on_loss(s, now);
+        s->in_recovery = 1;
+        s->recovery = s->next;
+    } else if (delivered && !s->in_recovery) {
+        s->opts->cc->on_ack(s, delivered, now);
+    }
+    if (s->cwnd > s->opts->window)
+        s->cwnd = s->opts->window;
+}
+
+//Prazo do RTO: a transmissão mais antiga ainda em trânsito
+static uint64_t rdt_rto_deadline(const struct rdt_sender *s) {
+    uint32_t seq;
+    for (seq = s->una; seq < s->next; ++seq)
+        if (s->state[seq % RDT_WINDOW] == RDT_INFLIGHT)
+            return s->xmit[seq % RDT_WINDOW] + (s->rto << s->backoff);
+    return 0;
+}
+
+static void rdt_on_timeout(struct rdt_sender *s) {
+    uint32_t seq;
+    for (seq = s->una; seq < s->next; ++seq)
+        if (s->state[seq % RDT_WINDOW] == RDT_INFLIGHT)
+            rdt_mark_lost(s, seq, RDT_BY_RTO);
+    s->timeouts++;
+    s->expired++;
+    if ((s->rto << (s->backoff + 1)) <= RDT_MAX_RTO_NS)
+        s->backoff++;
+    s->in_recovery = 0;
+    s->opts->cc->on_timeout(s);
+}
+
+//Lê os ACKs pendentes; retorna -1 se o servidor recusou os pacotes
+static int rdt_drain_acks(struct rdt_sender *s, char *buf) {
+    while (1) {
+        int r = recv(s->s, buf, RDT_ACK_SIZE, MSG_DONTWAIT);
+        if (r < 0) {
+            if (errno == ECONNREFUSED) {
+                fprintf(stderr, "recv() failed. (%d)\n", GETSOCKETERRNO());
+                return -1;
+            }
+            return 0;
+        }
+        if (s->opts->loss > 0 && rdt_random(s) < s->opts->loss) {
+            s->dropped_acks++;
+            continue;
+        }
+        rdt_on_ack(s, buf, r, mono_ns());
+    }
+}
+
+static void rdt_report(const struct rdt_sender *s, double seconds) {
+    const struct bulk_options *o = s->opts;
+    printf("\nReliable transfer: %lld bytes in %.3f s, %u packets of %d bytes, %s\n",
+            o->bytes, seconds, s->total, o->payload, o->cc->name);
+    printf("Goodput : %.2f MB/s (%.1f Mbit/s)\n", o->bytes / seconds / 1e6,
+            o->bytes * 8.0 / seconds / 1e6);
+    printf("Packets : %lu sent, %lu retransmitted (%lu fast, %lu after %lu timeouts), "
+            "efficiency %.3f\n", s->sent, s->retransmits, s->fast, s->after_rto,
+            s->timeouts, s->sent ? (double)s->total / s->sent : 0.0);
+    printf("RTT (us) : srtt %.1f, min %.1f, rto %.1f; cwnd %.1f, ssthresh %.1f, "
+            "%lu acks\n", s->srtt / 1e3, s->min_rtt / 1e3, s->rto / 1e3,
+            s->cwnd, s->ssthresh, s->acks);
+    if (o->loss > 0 || o->delay_ns || o->reorder > 0)
+        printf("Injected : %lu data and %lu acks dropped, %lu delayed, %lu reordered\n",
+                s->dropped_data, s->dropped_acks, s->delayed, s->reordered);
+}
+
+//Envia opts->bytes de forma confiável pelo socket já conectado
+static int run_bulk(SOCKET socket_peer, const struct bulk_options *opts) {
+#if defined(_WIN32)
+    (void)socket_peer;
+    (void)opts;
+    fprintf(stderr, "reliable mode not available.\n");
+    return 1;
+#else
+    int result = 1;
+    char *ack = (char*)malloc(RDT_ACK_SIZE);
+    struct rdt_sender *s = (struct rdt_sender*)calloc(1, sizeof(*s));
+    if (s)
+        s->packet = (char*)malloc(RDT_HEADER_SIZE + opts->payload);
+    if (!s || !ack || !s->packet) {
+        fprintf(stderr, "Out of memory.\n");
+        goto done;
+    }
+    long long packets = (opts->bytes + opts->payload - 1) / opts->payload;
+    if (packets > (long long)UINT32_MAX - 1) {
+        fprintf(stderr, "transfer too large.\n");
+        goto done;
+    }
+    s->opts = opts;
+    s->s = socket_peer;
+    s->total = (uint32_t)packets;
+    s->rto = RDT_INIT_RTO_NS;
+    uint64_t start = mono_ns();
+    s->rng = start | 1;
+    s->session = (uint32_t)(start ^ (start >> 32) ^ (uint64_t)(uintptr_t)s);
+    opts->cc->init(s);
+
+    int buf = RDT_SOCKBUF;
+    setsockopt(socket_peer, SOL_SOCKET, SO_SNDBUF, (void*)&buf, sizeof(buf));
+    setsockopt(socket_peer, SOL_SOCKET, SO_RCVBUF, (void*)&buf, sizeof(buf));
+
+    printf("Sending %lld bytes reliably (%s, window %d packets)...\n",
+            opts->bytes, opts->cc->name, opts->window);
+    fflush(stdout);
+    result = 0;
+    while (s->una < s->total) {
+        uint64_t now = mono_ns();
+        uint64_t deadline = rdt_rto_deadline(s);
+        if (deadline && now >= deadline) {
+            if (s->expired >= RDT_GIVE_UP) {
+                fprintf(stderr, "no acknowledgement after %d timeouts, giving up.\n",
+                        RDT_GIVE_UP);
+                result = 1;
+                break;
+            }
+            rdt_on_timeout(s);
+        }
+        rdt_fill_window(s, now);
+        rdt_release(s, now);
+
+        uint64_t wait = RDT_MAX_WAIT_NS;
+        deadline = rdt_rto_deadline(s);
+        if (deadline)
+            wait = deadline > now ? deadline - now : 0;
+        if (s->nheld && s->held[0].at - now < wait)
+            wait = s->held[0].at - now;
+
+        fd_set reads;
+        FD_ZERO(&reads);
+        FD_SET(socket_peer, &reads);
+        struct timeval timeout;
+        timeout.tv_sec = (long)(wait / 1000000000u);
+        timeout.tv_usec = (long)(wait % 1000000000u / 1000);
+        if (select(socket_peer+1, &reads, 0, 0, &timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "select() failed. (%d)\n", GETSOCKETERRNO());
+            result = 1;
+            break;
+        }
+        if (FD_ISSET(socket_peer, &reads) && rdt_drain_acks(s, ack) < 0) {
+            result = 1;
+            break;
+        }
+    }
+    if (!result)
+        rdt_report(s, (mono_ns() - start) / 1e9);
+
+done:
+    if (s) {
+        int k;
+        for (k = 0; k < s->held_cap; ++k)
+            free(s->held[k].data);
+        free(s->held);
+        free(s->packet);
+    }
+    free(s);
+    free(ack);
+    return result;
+#endif
+}
+
+#endif
@@ -22,22 +22,156 @@
  * SOFTWARE.
  */
 
-#include "chap04.h"
-
-#if defined(_WIN32)
-#include <conio.h>
+//necessário para recvmmsg() e sendmmsg()
+#if !defined(_GNU_SOURCE) && !defined(_WIN32)
+#define _GNU_SOURCE
 #endif
 
+#include "chap04.h"
+#include "udp_gso.h"
+#include "../Common_Code/mono_clock.h"
+#include "../Common_Code/latency_hist.h"
+#include "udp_seq.h"
+#include "udp_blast.h"
+#include "udp_bulk.h"
 
 #include <stdlib.h>
-#include <time.h>
 
 #define TAM_MESSAGE 10000
 #define NUM_MESSAGE 512
+#define MAX_DATAGRAM 65507  //maior carga útil de um datagrama UDP sobre IPv4
 
 #define LOCAL_MACHINE // TEMPO DE EXECUÇÃO EM CASO DE CLIENTE/SERVIDOR RODAREM NA MESMA MAQUINA 
 
 
+#define LATE_GRACE_NS 200000000u    //espera final por ecos atrasados
+
+struct client_rx {
+    SOCKET s;
+    int gro;                //respostas chegam emendadas pelo UDP_GRO
+    char *buf;
+    int cap;
+    long bytes;
+    long datagrams;
+    int closed;
+    struct seq_tracker seqs;
+    struct latency_hist rtt;
+};
+
+//Contabiliza um buffer recebido; retorna quantos datagramas novos estão em [first, end)
+static long track_reply(struct client_rx *rx, int len, int segment,
+        uint32_t first, uint32_t end) {
+    uint64_t now = mono_ns();
+    long in_range = 0;
+    if (segment <= 0 || segment > len)
+        segment = len;
+    int off;
+    for (off = 0; off < len; off += segment) {
+        int n = len - off < segment ? len - off : segment;
+        struct seq_header h;
+        rx->datagrams++;
+        if (seq_track(&rx->seqs, rx->buf + off, n, 'A', &h) != SEQ_NEW)
+            continue;
+        hist_record(&rx->rtt, now - h.sent_ns);
+        if (h.seq >= first && h.seq < end)
+            in_range++;
+    }
+    rx->bytes += len;
+    return in_range;
+}
+
+/*
+Recebe até o prazo ou até chegarem want datagramas novos com sequência em
+[first, end). Tudo o que chegar nesse meio tempo é contabilizado.
+*/
+static long receive_replies(struct client_rx *rx, uint64_t deadline,
+        uint32_t first, uint32_t end, long want) {
+    long got = 0;
+    while (!want || got < want) {
+        uint64_t now = mono_ns();
+        if (now >= deadline)
+            break;
+
+        fd_set reads;
+        FD_ZERO(&reads);
+        FD_SET(rx->s, &reads);
+
+        struct timeval timeout;
+        timeout.tv_sec = (long)((deadline - now) / 1000000000u);
+        timeout.tv_usec = (long)((deadline - now) % 1000000000u / 1000);
+
+        if (select(rx->s+1, &reads, 0, 0, &timeout) < 0) {
+            fprintf(stderr, "select() failed. (%d)\n", GETSOCKETERRNO());
+            rx->closed = 1;
+            break;
+        }
+        if (!FD_ISSET(rx->s, &reads))
+            continue;
+
+#if defined(HAVE_UDP_GSO)
+        //drena tudo o que já chegou; cada recvmsg() pode trazer vários datagramas
+        if (rx->gro) {
+            while (1) {
+                struct iovec iov;
+                iov.iov_base = rx->buf;
+                iov.iov_len = rx->cap;
+                struct msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                char ctrl[GRO_CMSG_SPACE];
+                msg.msg_control = ctrl;
+                msg.msg_controllen = sizeof(ctrl);
+                int bytes_received = recvmsg(rx->s, &msg, MSG_DONTWAIT);
+                if (bytes_received < 1)
+                    break;
+                printf("Received (%d bytes)\n",bytes_received );
+                got += track_reply(rx, bytes_received, udp_gro_segment(&msg),
+                        first, end);
+            }
+            continue;
+        }
+#endif
+        int bytes_received = recv(rx->s, rx->buf, rx->cap, 0);
+        if (bytes_received < 1) {
+            printf("Connection closed by peer.\n");
+            rx->closed = 1;
+            break;
+        }
+        /*printf("\nReceived (%d bytes): %.*s\n",
+                bytes_received, bytes_received, rx->buf);*/
+        printf("Received (%d bytes)\n",bytes_received );
+        got += track_reply(rx, bytes_received, 0, first, end);
+    }
+    return got;
+}
+
+
+static void usage(void) {
+    fprintf(stderr, "usage: udp_client hostname port [-g segment] [-n messages] [-s size]\n");
+    fprintf(stderr, "       udp_client hostname port -r rate|-m mbit [-d seconds] [-b burst] [-s size]\n");
+    fprintf(stderr, "       udp_client hostname port -T bytes [-C cc] [-W window] [-L loss%%] [-J ms] [-O reorder%%] [-s size]\n");
+    fprintf(stderr, "  -g N   send each message as N-byte datagrams with UDP_SEGMENT\n");
+    fprintf(stderr, "  -n N   messages to send (default %d)\n", NUM_MESSAGE);
+    fprintf(stderr, "  -s N   message size in bytes, %d to %d (default %d)\n",
+            SEQ_HEADER_SIZE, MAX_DATAGRAM, TAM_MESSAGE);
+    fprintf(stderr, "  -r R   paced blast at R datagrams/s, echoes received independently;\n"
+            "         R1,R2,... runs one step per rate, A:B doubles from A to B until the knee\n");
+    fprintf(stderr, "  -m M   like -r, in Mbit/s of payload\n");
+    fprintf(stderr, "  -d S   seconds per blast step (default %.0f)\n", BLAST_DURATION);
+    fprintf(stderr, "  -b N   token bucket depth: at most N datagrams back to back (default %d)\n",
+            BLAST_BURST);
+    fprintf(stderr, "  -T N   reliable transfer of N bytes (suffix k, m or g) with SACK and\n"
+            "         congestion control; -s is the payload per packet (default %d)\n", RDT_PAYLOAD);
+    fprintf(stderr, "  -C S   congestion control for -T: reno, cubic or fixed (default reno)\n");
+    fprintf(stderr, "  -W N   at most N packets beyond the cumulative ack, 1 to %d (default);\n"
+            "         the window of -C fixed\n", RDT_WINDOW);
+    fprintf(stderr, "  -L P   drop P%% of the data packets and of the acks\n");
+    fprintf(stderr, "  -J N   delay every data packet by N milliseconds\n");
+    fprintf(stderr, "  -O P   hold back P%% of the data packets so later ones overtake them\n");
+}
+
+
 /*
 Inicia o main() e inicializa o Winsock.
 */
@@ -54,9 +188,154 @@ int main(int argc, char *argv[]) {
 
 
     if (argc < 3) {
-        fprintf(stderr, "usage: udp_client hostname port\n");
+        usage();
+        return 1;
+    }
+
+    /*
+    Com -g cada mensagem de message_size bytes sai num único sendmsg() com
+    UDP_SEGMENT e o kernel a divide em datagramas de N bytes; as respostas
+    são recebidas com UDP_GRO, várias por recvmsg().
+    */
+    int gso_segment = 0;
+    int message_size = TAM_MESSAGE;
+    long num_messages = NUM_MESSAGE;
+    struct blast_options blast;
+    memset(&blast, 0, sizeof(blast));
+    blast.duration = BLAST_DURATION;
+    blast.burst = BLAST_BURST;
+    struct bulk_options bulk;
+    memset(&bulk, 0, sizeof(bulk));
+    bulk.window = RDT_WINDOW;
+    bulk.cc = &rdt_reno;
+    int size_given = 0;
+    int a;
+    for (a = 3; a < argc; ++a) {
+        if ((!strcmp(argv[a], "-r") || !strcmp(argv[a], "-m")) && a + 1 < argc) {
+            blast.mbit = argv[a][1] == 'm';
+            if (blast_parse_rates(argv[++a], &blast)) {
+                usage();
+                return 1;
+            }
+        } else if (!strcmp(argv[a], "-d") && a + 1 < argc) {
+            blast.duration = atof(argv[++a]);
+            if (blast.duration <= 0) {
+                usage();
+                return 1;
+            }
+        } else if (!strcmp(argv[a], "-b") && a + 1 < argc) {
+            blast.burst = atoi(argv[++a]);
+            if (blast.burst < 1) {
+                usage();
+                return 1;
+            }
+        } else if (!strcmp(argv[a], "-T") && a + 1 < argc) {
+            char *p;
+            int shift = 0;
+            bulk.bytes = strtoll(argv[++a], &p, 10);
+            switch (*p) {
+            case 'k': case 'K': shift = 10; break;
+            case 'm': case 'M': shift = 20; break;
+            case 'g': case 'G': shift = 30; break;
+            }
+            if (shift) {
+                bulk.bytes <<= shift;
+                ++p;
+            }
+            if (bulk.bytes < 1 || *p) {
+                usage();
+                return 1;
+            }
+        } else if (!strcmp(argv[a], "-C") && a + 1 < argc) {
+            bulk.cc = rdt_find_cc(argv[++a]);
+            if (!bulk.cc) {
+                usage();
+                return 1;
+            }
+        } else if (!strcmp(argv[a], "-W") && a + 1 < argc) {
+            bulk.window = atoi(argv[++a]);
+            if (bulk.window < 1 || bulk.window > RDT_WINDOW) {
+                usage();
+                return 1;
+            }
+        } else if (!strcmp(argv[a], "-L") && a + 1 < argc) {
+            bulk.loss = atof(argv[++a]) / 100;
+            if (bulk.loss < 0 || bulk.loss >= 1) {
+                usage();
+                return 1;
+            }
+        } else if (!strcmp(argv[a], "-J") && a + 1 < argc) {
+            double ms = atof(argv[++a]);
+            if (ms < 0) {
+                usage();
+                return 1;
+            }
+            bulk.delay_ns = (uint64_t)(ms * 1e6);
+        } else if (!strcmp(argv[a], "-O") && a + 1 < argc) {
+            bulk.reorder = atof(argv[++a]) / 100;
+            if (bulk.reorder < 0 || bulk.reorder > 1) {
+                usage();
+                return 1;
+            }
+        } else if (!strcmp(argv[a], "-g") && a + 1 < argc) {
+            gso_segment = atoi(argv[++a]);
+            if (gso_segment < 1 || gso_segment > 65507) {
+                fprintf(stderr, "invalid segment size.\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[a], "-n") && a + 1 < argc) {
+            num_messages = atol(argv[++a]);
+            if (num_messages < 1) {
+                usage();
+                return 1;
+            }
+        } else if (!strcmp(argv[a], "-s") && a + 1 < argc) {
+            message_size = atoi(argv[++a]);
+            size_given = 1;
+            if (message_size < SEQ_HEADER_SIZE || message_size > MAX_DATAGRAM) {
+                usage();
+                return 1;
+            }
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (bulk.bytes) {
+        //o pacote leva o cabeçalho de udp_reliable.h e precisa caber num datagrama
+        bulk.payload = size_given ? message_size : RDT_PAYLOAD;
+        if (bulk.payload > MAX_DATAGRAM - RDT_HEADER_SIZE) {
+            usage();
+            return 1;
+        }
+        if (blast.nrates || gso_segment) {
+            fprintf(stderr, "-T sends on its own, ignoring -r, -m and -g.\n");
+            blast.nrates = 0;
+            gso_segment = 0;
+        }
+    }
+    if (blast.nrates && gso_segment) {
+        fprintf(stderr, "-g is not used by the blast mode, ignoring it.\n");
+        gso_segment = 0;
+    }
+    //cada segmento, inclusive o último, precisa caber o cabeçalho de sequência
+    if (gso_segment && (gso_segment < SEQ_HEADER_SIZE ||
+                (message_size % gso_segment && message_size % gso_segment < SEQ_HEADER_SIZE))) {
+        fprintf(stderr, "invalid segment size.\n");
+        return 1;
+    }
+#if defined(HAVE_UDP_GSO)
+    if (gso_segment && udp_segments(message_size, gso_segment) > GSO_MAX_SEGMENTS) {
+        fprintf(stderr, "segment too small: at most %d segments per message.\n",
+                GSO_MAX_SEGMENTS);
         return 1;
     }
+#else
+    if (gso_segment) {
+        fprintf(stderr, "UDP GSO/GRO not available.\n");
+        gso_segment = 0;
+    }
+#endif
 
     /*
     Em seguida, configuramos o endereço remoto usando getaddrinfo().
@@ -120,89 +399,150 @@ int main(int argc, char *argv[]) {
     freeaddrinfo(peer_address);
 
     printf("Connected.\n");
+
+    if (bulk.bytes) {
+        int result = run_bulk(socket_peer, &bulk);
+        CLOSESOCKET(socket_peer);
+#if defined(_WIN32)
+        WSACleanup();
+#endif
+        printf("Finished.\n");
+        return result;
+    }
+
+    if (blast.nrates) {
+        blast.size = message_size;
+        int result = run_blast(socket_peer, &blast);
+        CLOSESOCKET(socket_peer);
+#if defined(_WIN32)
+        WSACleanup();
+#endif
+        printf("Finished.\n");
+        return result;
+    }
     printf("To send data, enter text followed by enter.\n");
 
+#if defined(HAVE_UDP_GSO)
+    if (gso_segment && (udp_gso_probe(socket_peer) || udp_enable_gro(socket_peer))) {
+        fprintf(stderr, "UDP GSO/GRO not supported, sending whole messages. (%d)\n",
+                GETSOCKETERRNO());
+        gso_segment = 0;
+    }
+#endif
+
    /*
     Para o envio da rajada de 512 mensagens conseecutivas
     */
 
+    /*
+    Cada datagrama começa com o cabeçalho de udp_seq.h (com -g, cada segmento
+    tem o seu). A sequência conta datagramas: a mensagem i ocupa as sequências
+    i*expected até (i+1)*expected - 1. O RTT de cada datagrama sai do instante
+    de envio gravado no próprio cabeçalho, então um eco atrasado é medido e
+    creditado ao datagrama certo.
+    */
     int i = 0;//iterador do loop
-    char* send_messages = (char*)malloc(sizeof(char)*TAM_MESSAGE);//vetor para o envio de mensagens 
-    char* received_messages = (char*)malloc(sizeof(char)*TAM_MESSAGE);//vetor para recebimento das mensagens
-    long int total_receveid = 0;
+    int segment = gso_segment ? gso_segment : message_size;
+    long expected = (message_size + segment - 1) / segment;
+    char* send_messages = (char*)malloc(sizeof(char)*message_size);//vetor para o envio de mensagens 
+
+    struct client_rx rx;
+    memset(&rx, 0, sizeof(rx));
+    rx.s = socket_peer;
+    rx.gro = gso_segment != 0;
+    //com GRO um recv pode trazer até 64 KB de datagramas emendados
+    rx.cap = gso_segment ? 65536 : message_size;
+    rx.buf = (char*)malloc(sizeof(char)*rx.cap);//vetor para recebimento das mensagens
+    hist_init(&rx.rtt);
+    if (!send_messages || !rx.buf ||
+            seq_init(&rx.seqs, (uint32_t)(num_messages * expected))) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    long int datagrams_sent = 0;
+    long answered = 0;
 
-    
-    //Medição do tempo de round/trip
-    clock_t t; //variável para armazenar o tempo
-    t = clock();
+    for (int k = 0; k < message_size; ++k)
+    {
+        send_messages[k] = 'a';
+    }
+
+    uint64_t wall_start = mono_ns();
 
-    while(i<NUM_MESSAGE) {//512 iterações
+    while(i<num_messages && !rx.closed) {//512 iterações por padrão
 
         //-------------------------
         
-        for (int i = 0; i < TAM_MESSAGE; ++i)
-        {
-            send_messages[i] = 'a';
-        }
         //if (!fgets(read, 4096, stdin)) break;//caso de compartilhar uma msg por vez
         //printf("\nSending: %s\n", read);
-        int bytes_sent = send(socket_peer, send_messages, strlen(send_messages), 0);
+        uint32_t first = (uint32_t)(i * expected);
+        uint64_t sent_at = mono_ns();
+        for (long k = 0; k < expected; ++k)
+            seq_write(send_messages + k * segment, first + (uint32_t)k, sent_at);
+
+        int bytes_sent;
+#if defined(HAVE_UDP_GSO)
+        if (gso_segment) {
+            struct iovec iov;
+            iov.iov_base = send_messages;
+            iov.iov_len = message_size;
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            char ctrl[GSO_CMSG_SPACE];
+            udp_set_segment(&msg, ctrl, (uint16_t)gso_segment);
+            bytes_sent = sendmsg(socket_peer, &msg, 0);
+            if (bytes_sent > 0)
+                datagrams_sent += udp_segments(bytes_sent, gso_segment);
+        } else
+#endif
+        {
+            bytes_sent = send(socket_peer, send_messages, message_size, 0);
+            if (bytes_sent > 0)
+                datagrams_sent++;
+        }
         printf("Sent %d bytes.\n", bytes_sent);
 
         //-------------------------
 
-        fd_set reads;
-        FD_ZERO(&reads);
-        FD_SET(socket_peer, &reads);
-#if !defined(_WIN32)
-        FD_SET(0, &reads);
-#endif
-
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 100000;
-
-        if (select(socket_peer+1, &reads, 0, 0, &timeout) < 0) {
-            fprintf(stderr, "select() failed. (%d)\n", GETSOCKETERRNO());
-            return 1;
-        }  
-
-        if (FD_ISSET(socket_peer, &reads)) {
-            int bytes_received = recv(socket_peer, received_messages, TAM_MESSAGE, 0);
-            if (bytes_received < 1) {
-                printf("Connection closed by peer.\n");
-                break;
-            }
-            /*printf("\nReceived (%d bytes): %.*s\n",
-                    bytes_received, bytes_received, received_messages);*/
-            printf("Received (%d bytes)\n",bytes_received );
-            total_receveid += bytes_received;//conta todos os bytes recebidos para calcular o Loss
-        }       
+        //espera, por no máximo 100 ms, os datagramas desta mensagem
+        rx.seqs.late_before = first;
+        long got = receive_replies(&rx, sent_at + 100000000u,
+                first, first + (uint32_t)expected, expected);
+        if (got >= expected)
+            answered++;
     i++;  
     } //end while(1)
 
+    //tempo de parede; clock() media só o tempo de CPU do processo
+    double wall = (double)(mono_ns() - wall_start) / 1e9;
+
+    //ecos que ainda estão a caminho contam como atrasados, não como perdidos
+    rx.seqs.late_before = (uint32_t)(i * expected);
+    if (!rx.closed)
+        receive_replies(&rx, mono_ns() + LATE_GRACE_NS, 0, 0, 0);
+
 #if defined(LOCAL_MACHINE)
-    //calculo do tempo para o caso de cliente/servidor ocuparem a mesma maquina
-    t = clock() - t;
-    double time = ((double)t)/((CLOCKS_PER_SEC/1000));//tempo em milisegundos
-    printf("\nTime in round/trip : %lf ms \n",time );
+    printf("\nWall time : %.3lf ms \n", wall * 1e3);
 #endif
-
-    //calculo de perda de dados
-    double loss = 0.0;
-    if(total_receveid == 0)
-        loss = 100.0;
-    else
-    loss = ((NUM_MESSAGE - (total_receveid/TAM_MESSAGE))/NUM_MESSAGE)/100.0;
+    printf("Throughput : %.0f msgs/s, %.2f MB/s\n",
+            answered / wall, (double)rx.bytes / wall / 1e6);
+    printf("Datagrams sent : %ld (%.0f/s)\n", datagrams_sent, datagrams_sent / wall);
+    printf("Datagrams received : %ld (%.0f/s)\n",
+            rx.datagrams, rx.datagrams / wall);
+    hist_print(&rx.rtt, "RTT");
 
     printf("\nNum of mesages sent : %d\n",i );
-    printf("Size in bytes : %d\n",TAM_MESSAGE );
-    printf("Loss : %.3lf %% \n",loss );
+    printf("Size in bytes : %d\n",message_size );
+    //perda exata: sequências enviadas que nunca voltaram
+    seq_print(&rx.seqs, datagrams_sent);
 
 
     //Desaloca memoria dinamica
     free(send_messages);//libera o vetor send_messages
-    free(received_messages);//libera o vetor received_messages
+    free(rx.buf);//libera o vetor de recebimento
+    seq_free(&rx.seqs);
 
 
     /*
@@ -0,0 +1,77 @@
+/*
+ * UDP GSO/GRO (Linux >= 5.0), usados pelo cliente e pelo servidor UDP.
+ *
+ * GSO (UDP_SEGMENT): um único sendmsg() com um buffer grande e um tamanho de
+ * segmento; o kernel corta o buffer em datagramas desse tamanho.
+ * GRO (UDP_GRO): o kernel junta datagramas consecutivos do mesmo fluxo num
+ * único buffer e informa o tamanho do segmento num cmsg; o último segmento
+ * pode ser menor.
+ *
+ * Em ambos os casos os datagramas na rede são os mesmos de antes; muda só o
+ * número de chamadas de sistema e de passagens pela pilha de rede.
+ */
+
+#ifndef UDP_GSO_H
+#define UDP_GSO_H
+
+#include "chap04.h"
+
+#if defined(__linux__)
+#include <netinet/udp.h>
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define HAVE_UDP_GSO
+#endif
+#endif
+
+#if defined(HAVE_UDP_GSO)
+#include <stdint.h>
+
+#define GSO_MAX_SEGMENTS 64     //limite do kernel (UDP_MAX_SEGMENTS)
+#define GSO_CMSG_SPACE CMSG_SPACE(sizeof(uint16_t))
+#define GRO_CMSG_SPACE CMSG_SPACE(sizeof(int))
+
+//Retorna 0 se o kernel aceita UDP_SEGMENT neste socket
+static int udp_gso_probe(SOCKET s) {
+    int zero = 0;
+    return setsockopt(s, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero));
+}
+
+static int udp_enable_gro(SOCKET s) {
+    int one = 1;
+    return setsockopt(s, SOL_UDP, UDP_GRO, &one, sizeof(one));
+}
+
+//Anexa a msg um cmsg UDP_SEGMENT; ctrl precisa de GSO_CMSG_SPACE bytes
+static void udp_set_segment(struct msghdr *msg, char *ctrl, uint16_t segment) {
+    memset(ctrl, 0, GSO_CMSG_SPACE);
+    msg->msg_control = ctrl;
+    msg->msg_controllen = GSO_CMSG_SPACE;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(msg);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+}
+
+//Tamanho de segmento informado pelo GRO, ou 0 se o buffer é um datagrama só
+static int udp_gro_segment(struct msghdr *msg) {
+    struct cmsghdr *cm;
+    for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            int segment;
+            memcpy(&segment, CMSG_DATA(cm), sizeof(segment));
+            return segment;
+        }
+    }
+    return 0;
+}
+
+//Número de datagramas contidos num buffer de len bytes
+static long udp_segments(size_t len, int segment) {
+    if (segment <= 0 || len == 0)
+        return 1;
+    return (long)((len + segment - 1) / segment);
+}
+#endif
+
+#endif
@@ -0,0 +1,243 @@
+/*
+ * Transferência confiável sobre UDP: formato dos pacotes e o lado que recebe
+ * (o servidor). O lado que envia fica em udp_bulk.h.
+ *
+ * O cliente divide a transferência em pacotes numerados de 0 a total - 1 e
+ * manda cada um num datagrama DATA. O servidor responde cada DATA com um ACK
+ * no lugar do eco: o próximo número esperado (ack cumulativo), até
+ * RDT_MAX_SACK faixas [início, fim) já recebidas acima dele (SACK) e o
+ * instante de envio do DATA que o gerou, de onde o cliente tira o RTT daquela
+ * transmissão exata, inclusive de retransmissões.
+ *
+ * O servidor guarda uma sessão por transferência (id escolhido pelo cliente
+ * e endereço de origem), com um bit por pacote da janela de RDT_WINDOW
+ * pacotes acima do ack cumulativo. Pacotes além da janela são descartados e
+ * voltam a ser pedidos pelo próprio ack. As sessões ficam numa tabela pequena
+ * por worker; a mais antiga dá lugar a uma nova. O SO_REUSEPORT leva um fluxo
+ * sempre ao mesmo worker, então não há nada compartilhado entre threads.
+ *
+ * Todos os bytes do número mágico são >= 0x80, como o de udp_seq.h, e ele é
+ * diferente daquele: o servidor separa os dois modos olhando os 4 primeiros
+ * bytes.
+ */
+
+#ifndef UDP_RELIABLE_H
+#define UDP_RELIABLE_H
+
+#include "chap04.h"
+#include "../Common_Code/mono_clock.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RDT_MAGIC 0xF1E2D3C5u
+#define RDT_HEADER_SIZE 32
+#define RDT_DATA 1
+#define RDT_ACK 2
+#define RDT_WINDOW 8192         //pacotes acima do ack cumulativo (potência de 2)
+#define RDT_MAX_SACK 16
+#define RDT_ACK_SIZE (RDT_HEADER_SIZE + RDT_MAX_SACK * 8)
+#define RDT_SESSIONS 64         //transferências simultâneas por worker
+
+struct rdt_header {
+    uint32_t magic;         //ordem de rede, como os demais campos, menos stamp
+    uint8_t type;
+    uint8_t nsack;          //ACK: faixas SACK logo após o cabeçalho
+    uint16_t reserved;
+    uint32_t session;
+    uint32_t seq;           //DATA: número do pacote; ACK: próximo esperado
+    uint32_t total;         //pacotes da transferência
+    uint32_t reserved2;
+    uint64_t stamp;         //DATA: mono_ns() do envio; ACK: o do DATA
+};
+
+static inline void rdt_write(char *p, int type, uint32_t session, uint32_t seq,
+        uint32_t total, uint64_t stamp) {
+    struct rdt_header h;
+    memset(&h, 0, sizeof(h));
+    h.magic = htonl(RDT_MAGIC);
+    h.type = (uint8_t)type;
+    h.session = htonl(session);
+    h.seq = htonl(seq);
+    h.total = htonl(total);
+    h.stamp = stamp;
+    memcpy(p, &h, RDT_HEADER_SIZE);
+}
+
+static inline int rdt_read(const char *p, size_t len, struct rdt_header *h) {
+    if (len < RDT_HEADER_SIZE)
+        return -1;
+    memcpy(h, p, RDT_HEADER_SIZE);
+    if (ntohl(h->magic) != RDT_MAGIC)
+        return -1;
+    h->session = ntohl(h->session);
+    h->seq = ntohl(h->seq);
+    h->total = ntohl(h->total);
+    return 0;
+}
+
+static inline int rdt_is_packet(const char *p, size_t len) {
+    uint32_t magic;
+    if (len < RDT_HEADER_SIZE)
+        return 0;
+    memcpy(&magic, p, sizeof(magic));
+    return ntohl(magic) == RDT_MAGIC;
+}
+
+//Conteúdo do pacote seq: uma letra por pacote, para o servidor conferir
+static inline char rdt_fill(uint32_t seq) {
+    return (char)('a' + seq % 26);
+}
+
+struct rdt_session {
+    uint32_t id;
+    int used;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    uint32_t total;
+    uint32_t next;          //ack cumulativo
+    uint32_t highest;       //maior número recebido + 1
+    uint64_t bits[RDT_WINDOW / 64];     //recebidos acima de next, por seq % RDT_WINDOW
+    unsigned long bytes, duplicates, corrupt;
+    uint64_t started, last;
+    int done;
+};
+
+struct rdt_table {
+    struct rdt_session sessions[RDT_SESSIONS];
+};
+
+static inline int rdt_bit(const struct rdt_session *s, uint32_t seq) {
+    uint32_t b = seq % RDT_WINDOW;
+    return (int)((s->bits[b / 64] >> (b % 64)) & 1);
+}
+
+static inline struct rdt_session *rdt_session(struct rdt_table *t, uint32_t id,
+        uint32_t total, const struct sockaddr *addr, socklen_t addr_len,
+        uint64_t now) {
+    struct rdt_session *victim = &t->sessions[0];
+    int k;
+    for (k = 0; k < RDT_SESSIONS; ++k) {
+        struct rdt_session *s = &t->sessions[k];
+        if (s->used && s->id == id && s->addr_len == addr_len &&
+                !memcmp(&s->addr, addr, addr_len))
+            return s;
+        if (!s->used || (victim->used && s->last < victim->last))
+            victim = s;
+    }
+    memset(victim, 0, sizeof(*victim));
+    victim->used = 1;
+    victim->id = id;
+    memcpy(&victim->addr, addr, addr_len);
+    victim->addr_len = addr_len;
+    victim->total = total;
+    victim->started = now;
+    return victim;
+}
+
+//Monta o ACK da sessão em out (RDT_ACK_SIZE bytes); retorna o tamanho
+static inline int rdt_ack(const struct rdt_session *s, uint64_t stamp, char *out) {
+    int nsack = 0;
+    uint32_t seq = s->next;
+    while (seq < s->highest && nsack < RDT_MAX_SACK) {
+        while (seq < s->highest && !rdt_bit(s, seq))
+            ++seq;
+        if (seq >= s->highest)
+            break;
+        uint32_t start = seq;
+        while (seq < s->highest && rdt_bit(s, seq))
+            ++seq;
+        uint32_t range[2];
+        range[0] = htonl(start);
+        range[1] = htonl(seq);
+        memcpy(out + RDT_HEADER_SIZE + nsack * 8, range, 8);
+        nsack++;
+    }
+    rdt_write(out, RDT_ACK, s->id, s->next, s->total, stamp);
+    out[5] = (char)nsack;
+    return RDT_HEADER_SIZE + nsack * 8;
+}
+
+/*
+Registra um DATA de len bytes vindo de addr. Retorna a sessão (para o ACK)
+ou 0 se o pacote não é válido e não merece resposta.
+*/
+static inline struct rdt_session *rdt_receive(struct rdt_table *t, const char *buf,
+        size_t len, const struct sockaddr *addr, socklen_t addr_len,
+        uint64_t *stamp) {
+    struct rdt_header h;
+    if (rdt_read(buf, len, &h) || h.type != RDT_DATA || !h.total || h.seq >= h.total)
+        return 0;
+    uint64_t now = mono_ns();
+    struct rdt_session *s = rdt_session(t, h.session, h.total, addr, addr_len, now);
+    s->last = now;
+    *stamp = h.stamp;
+    if (h.seq < s->next || h.seq - s->next >= RDT_WINDOW)
+        s->duplicates += h.seq < s->next;
+    else if (rdt_bit(s, h.seq))
+        s->duplicates++;
+    else {
+        size_t k;
+        char fill = rdt_fill(h.seq);
+        for (k = RDT_HEADER_SIZE; k < len && buf[k] == fill; ++k)
+            ;
+        if (k < len) {
+            //conteúdo errado: conta e deixa o cliente retransmitir
+            s->corrupt++;
+            return s;
+        }
+        uint32_t b = h.seq % RDT_WINDOW;
+        s->bits[b / 64] |= (uint64_t)1 << (b % 64);
+        s->bytes += len - RDT_HEADER_SIZE;
+        if (h.seq + 1 > s->highest)
+            s->highest = h.seq + 1;
+        while (s->next < s->highest && rdt_bit(s, s->next)) {
+            b = s->next % RDT_WINDOW;
+            s->bits[b / 64] &= ~((uint64_t)1 << (b % 64));
+            s->next++;
+        }
+    }
+
+    if (!s->done && s->next == s->total) {
+        s->done = 1;
+        double seconds = (now - s->started) / 1e9;
+        printf("Reliable transfer %08x: %lu bytes in %.3f s (%.2f MB/s), "
+                "%lu duplicates, %lu corrupt\n", s->id, s->bytes, seconds,
+                seconds > 0 ? s->bytes / seconds / 1e6 : 0.0,
+                s->duplicates, s->corrupt);
+        fflush(stdout);
+    }
+    return s;
+}
+
+/*
+Atende um buffer recebido que começa com RDT_MAGIC: registra cada segmento
+de segment bytes (o buffer inteiro se 0, ou vários quando o GRO os emendou)
+e escreve no próprio buffer o ACK do último. cap precisa ter ao menos
+RDT_ACK_SIZE. Retorna o tamanho do ACK, 0 se não há o que responder, ou -1
+sem memória para a tabela.
+*/
+static inline int rdt_serve(struct rdt_table **table, char *buf, size_t len,
+        size_t segment, const struct sockaddr *addr, socklen_t addr_len) {
+    if (!*table) {
+        *table = (struct rdt_table*)calloc(1, sizeof(**table));
+        if (!*table)
+            return -1;
+    }
+    if (!segment || segment > len)
+        segment = len;
+    struct rdt_session *s = 0;
+    uint64_t stamp = 0;
+    size_t off;
+    for (off = 0; off < len; off += segment) {
+        size_t n = len - off < segment ? len - off : segment;
+        struct rdt_session *got = rdt_receive(*table, buf + off, n, addr,
+                addr_len, &stamp);
+        if (got)
+            s = got;
+    }
+    return s ? rdt_ack(s, stamp, buf) : 0;
+}
+
+#endif
@@ -0,0 +1,169 @@
+/*
+ * Cabeçalho de sequência dos datagramas do udp_client.
+ *
+ * Cada datagrama começa com 16 bytes: um número mágico, o número de
+ * sequência e o instante de envio (mono_ns() do cliente). O servidor
+ * reconhece o número mágico e transforma só o que vem depois do cabeçalho,
+ * segmento por segmento quando o buffer veio emendado pelo GRO; o cliente
+ * recebe o cabeçalho intacto e sabe exatamente qual datagrama voltou e
+ * quando ele saiu.
+ *
+ * Todos os bytes do número mágico são >= 0x80, que nenhuma conversão de
+ * maiúsculas toca. O instante de envio só é lido pelo próprio cliente e vai
+ * na ordem de bytes da máquina.
+ */
+
+#ifndef UDP_SEQ_H
+#define UDP_SEQ_H
+
+#include "chap04.h"
+#include "../Common_Code/transform.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+#define SEQ_MAGIC 0xF1E2D3C4u
+#define SEQ_HEADER_SIZE 16
+
+struct seq_header {
+    uint32_t magic;         //ordem de rede
+    uint32_t seq;           //ordem de rede
+    uint64_t sent_ns;       //ordem da máquina do cliente
+};
+
+static inline void seq_write(char *p, uint32_t seq, uint64_t sent_ns) {
+    struct seq_header h;
+    h.magic = htonl(SEQ_MAGIC);
+    h.seq = htonl(seq);
+    h.sent_ns = sent_ns;
+    memcpy(p, &h, SEQ_HEADER_SIZE);
+}
+
+static inline int seq_read(const char *p, size_t len, struct seq_header *h) {
+    if (len < SEQ_HEADER_SIZE)
+        return -1;
+    memcpy(h, p, SEQ_HEADER_SIZE);
+    if (ntohl(h->magic) != SEQ_MAGIC)
+        return -1;
+    h->seq = ntohl(h->seq);
+    return 0;
+}
+
+/*
+Transformação do servidor (Common_Code/transform.h): aplica a cadeia a cada
+segmento de segment bytes (o buffer inteiro se segment for 0), pulando o
+cabeçalho dos que o tiverem. Com crc32c a cadeia acrescenta bytes e o buffer
+precisa ser um único datagrama, com ch->trailer bytes de folga. Retorna o
+novo tamanho.
+*/
+static inline size_t seq_transform(const struct xform_chain *ch, char *buf,
+        size_t len, size_t segment) {
+    if (!segment || segment > len)
+        segment = len;
+    size_t off;
+    for (off = 0; off < len; off += segment) {
+        size_t n = len - off < segment ? len - off : segment;
+        char *p = buf + off;
+        uint32_t magic;
+        size_t skip = 0;
+        if (n >= SEQ_HEADER_SIZE) {
+            memcpy(&magic, p, sizeof(magic));
+            if (ntohl(magic) == SEQ_MAGIC)
+                skip = SEQ_HEADER_SIZE;
+        }
+        if (ch->trailer)
+            return skip + xform_apply(ch, p + skip, n - skip);
+        xform_bytes(ch, p + skip, n - skip);
+    }
+    return len;
+}
+
+/*
+Contabilidade do cliente: um bit por número de sequência enviado.
+
+  unique      datagramas distintos que voltaram (perda = enviados - unique)
+  duplicates  o mesmo número de sequência mais de uma vez
+  reordered   chegou depois de um número maior; max_reorder é a maior
+              distância entre os dois
+  late        chegou depois que o cliente desistiu de esperar por ele
+              (sequência abaixo de late_before, mantido pelo chamador)
+  invalid     sem cabeçalho, sequência fora do que foi enviado ou conteúdo
+              diferente do esperado
+*/
+struct seq_tracker {
+    uint64_t *bits;
+    uint32_t capacity;
+    uint32_t late_before;
+    uint32_t highest;
+    int any;
+    long unique, duplicates, reordered, late, invalid;
+    uint32_t max_reorder;
+};
+
+static inline int seq_init(struct seq_tracker *t, uint32_t capacity) {
+    memset(t, 0, sizeof(*t));
+    t->capacity = capacity;
+    t->bits = (uint64_t*)calloc((capacity + 63) / 64, sizeof(uint64_t));
+    return t->bits ? 0 : -1;
+}
+
+static inline void seq_free(struct seq_tracker *t) {
+    free(t->bits);
+    t->bits = 0;
+}
+
+enum {SEQ_NEW, SEQ_DUPLICATE, SEQ_INVALID};
+
+/*
+Registra um datagrama recebido. expect_fill é o byte esperado depois do
+cabeçalho (0 para não conferir). Em SEQ_NEW, *h traz a sequência e o instante
+de envio.
+*/
+static inline int seq_track(struct seq_tracker *t, const char *p, size_t len,
+        char expect_fill, struct seq_header *h) {
+    if (seq_read(p, len, h) || h->seq >= t->capacity) {
+        t->invalid++;
+        return SEQ_INVALID;
+    }
+    if (expect_fill) {
+        size_t k;
+        for (k = SEQ_HEADER_SIZE; k < len; ++k) {
+            if (p[k] != expect_fill) {
+                t->invalid++;
+                return SEQ_INVALID;
+            }
+        }
+    }
+
+    uint64_t mask = (uint64_t)1 << (h->seq & 63);
+    uint64_t *word = &t->bits[h->seq >> 6];
+    if (*word & mask) {
+        t->duplicates++;
+        return SEQ_DUPLICATE;
+    }
+    *word |= mask;
+    t->unique++;
+
+    if (t->any && h->seq < t->highest) {
+        t->reordered++;
+        if (t->highest - h->seq > t->max_reorder)
+            t->max_reorder = t->highest - h->seq;
+    }
+    if (!t->any || h->seq > t->highest)
+        t->highest = h->seq;
+    t->any = 1;
+
+    if (h->seq < t->late_before)
+        t->late++;
+    return SEQ_NEW;
+}
+
+static inline void seq_print(const struct seq_tracker *t, long sent) {
+    long lost = sent - t->unique;
+    printf("Loss : %ld of %ld datagrams (%.3f %%)\n", lost, sent,
+            sent ? 100.0 * lost / sent : 0.0);
+    printf("Reordered : %ld (max distance %u), duplicates : %ld, "
+            "late : %ld, invalid : %ld\n", t->reordered, t->max_reorder,
+            t->duplicates, t->late, t->invalid);
+}
+
+#endif
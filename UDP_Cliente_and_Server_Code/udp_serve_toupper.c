@@ -22,61 +22,190 @@
  * SOFTWARE.
  */
 
+//necessário para recvmmsg(), sendmmsg() e sched_setaffinity()
+#if !defined(_GNU_SOURCE) && !defined(_WIN32)
+#define _GNU_SOURCE
+#endif
+
 #include "chap04.h"
-#include <ctype.h>
+#include "udp_server.h"
+#include "../Common_Code/mono_clock.h"
 
-/*
-inicia o main() e inicializa o Winsock.
-*/
-int main() {
 
+static void usage(void) {
+    fprintf(stderr, "usage: udp_serve_toupper [-b batch] [-g] [-t threads] [-a] [-x chain] [-B usec]\n"
+            "                         [-r bytes] [-R bytes] [-w bytes] [-S port] [-D seconds]\n");
+    fprintf(stderr, "  -b N   receive/send up to N datagrams per recvmmsg/sendmmsg\n");
+    fprintf(stderr, "  -g     coalesce with UDP_GRO and reply with UDP_SEGMENT\n");
+    fprintf(stderr, "  -t N   number of workers, one SO_REUSEPORT socket each (0 = one per online CPU)\n");
+    fprintf(stderr, "  -a     pin worker k to CPU k\n");
+    fprintf(stderr, "  -x S   payload transform chain, e.g. upper | rot13,xor:0x5a | lower,crc32c\n");
+    fprintf(stderr, "         stages: upper lower rot13 xor:N crc32c (default upper)\n");
+    fprintf(stderr, "  -B N   busy-poll N microseconds before sleeping, implies -a (0 = %d)\n",
+            BUSY_POLL_US);
+    fprintf(stderr, "  -r N   initial SO_RCVBUF in bytes (0 = kernel default)\n");
+    fprintf(stderr, "  -R N   grow SO_RCVBUF up to N bytes on receive drops (0 = never, default %d)\n",
+            RCVBUF_MAX);
+    fprintf(stderr, "  -w N   SO_SNDBUF in bytes (0 = kernel default)\n");
+    fprintf(stderr, "  -S N   serve a metrics snapshot on 127.0.0.1:N\n");
+    fprintf(stderr, "  -D N   print the metrics snapshot every N seconds\n");
+}
+
+static int online_cpus(void) {
 #if defined(_WIN32)
-    WSADATA d;
-    if (WSAStartup(MAKEWORD(2, 2), &d)) {
-        fprintf(stderr, "Failed to initialize.\n");
-        return 1;
-    }
+    return 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
 #endif
+}
 
-    /*
-    Em seguida, encontramos nosso endereço local em que devemos ouvir,
-    criar o soquete e vincular a ele.
-    A única diferença entre esse código e os servidores TCP é que
-    usamos SOCK_DGRAM em vez de SOCK_STREAM. SOCK_DGRAM especifica que queremos um soquete UDP.
-    Aqui está o código para definir o endereço e criar um novo soquete:
-    */
+static int parse_options(int argc, char *argv[], struct udp_options *opts) {
+    opts->batch = 1;
+    opts->gro = 0;
+    opts->threads = 1;
+    opts->pin_cpus = 0;
+    opts->busy_poll = 0;
+    opts->rcvbuf = 0;
+    opts->rcvbuf_max = RCVBUF_MAX;
+    opts->sndbuf = 0;
+    opts->stats.port = 0;
+    opts->stats.interval = 0;
+    const char *chain = "upper";
 
-    printf("Configuring local address...\n");
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_DGRAM;
-    hints.ai_flags = AI_PASSIVE;
+    int a;
+    for (a = 1; a < argc; ++a) {
+        if (!strcmp(argv[a], "-b") && a + 1 < argc) {
+            opts->batch = atoi(argv[++a]);
+            if (opts->batch < 1 || opts->batch > 1024) {
+                usage();
+                return -1;
+            }
+        } else if (!strcmp(argv[a], "-g")) {
+#if defined(HAVE_UDP_GSO)
+            opts->gro = 1;
+#else
+            fprintf(stderr, "UDP GSO/GRO not available.\n");
+#endif
+        } else if (!strcmp(argv[a], "-t") && a + 1 < argc) {
+            opts->threads = atoi(argv[++a]);
+            if (opts->threads < 0) {
+                usage();
+                return -1;
+            }
+            if (opts->threads == 0)
+                opts->threads = online_cpus();
+        } else if (!strcmp(argv[a], "-a")) {
+            opts->pin_cpus = 1;
+        } else if (!strcmp(argv[a], "-B") && a + 1 < argc) {
+            int n = atoi(argv[++a]);
+            if (n < 0) {
+                usage();
+                return -1;
+            }
+#if defined(HAVE_BUSY_POLL)
+            opts->busy_poll = n ? n : BUSY_POLL_US;
+            //um worker girando não divide o núcleo com outro
+            opts->pin_cpus = 1;
+#else
+            fprintf(stderr, "busy-poll not available.\n");
+#endif
+        } else if (!strcmp(argv[a], "-r") && a + 1 < argc) {
+            opts->rcvbuf = atoi(argv[++a]);
+            if (opts->rcvbuf < 0) {
+                usage();
+                return -1;
+            }
+        } else if (!strcmp(argv[a], "-R") && a + 1 < argc) {
+            opts->rcvbuf_max = atoi(argv[++a]);
+            if (opts->rcvbuf_max < 0) {
+                usage();
+                return -1;
+            }
+        } else if (!strcmp(argv[a], "-w") && a + 1 < argc) {
+            opts->sndbuf = atoi(argv[++a]);
+            if (opts->sndbuf < 0) {
+                usage();
+                return -1;
+            }
+        } else if (!strcmp(argv[a], "-x") && a + 1 < argc) {
+            chain = argv[++a];
+        } else if (!strcmp(argv[a], "-S") && a + 1 < argc) {
+            opts->stats.port = atoi(argv[++a]);
+            if (opts->stats.port <= 0 || opts->stats.port > 65535) {
+                usage();
+                return -1;
+            }
+        } else if (!strcmp(argv[a], "-D") && a + 1 < argc) {
+            opts->stats.interval = atoi(argv[++a]);
+            if (opts->stats.interval <= 0) {
+                usage();
+                return -1;
+            }
+        } else {
+            usage();
+            return -1;
+        }
+    }
 
-    struct addrinfo *bind_address;
-    getaddrinfo(0, "8080", &hints, &bind_address);
+    if (xform_parse(chain, &opts->xform)) {
+        usage();
+        return -1;
+    }
+    xform_build(&opts->xform);
+    printf("Transform: %s (%s)\n", chain, opts->xform.kernel_name);
+    //o crc32c vai no fim de cada datagrama; com GRO seria preciso remontar
+    //o buffer emendado
+    if (opts->xform.trailer && opts->gro) {
+        fprintf(stderr, "crc32c appends to each datagram, GRO disabled.\n");
+        opts->gro = 0;
+    }
 
+    //o giro só compensa se o cliente e as interrupções tiverem outro núcleo
+    if (opts->busy_poll && opts->threads >= online_cpus())
+        fprintf(stderr, "busy-poll with no spare CPU, expect higher latency.\n");
 
-    printf("Creating socket...\n");
-    SOCKET socket_listen;
-    socket_listen = socket(bind_address->ai_family,
-            bind_address->ai_socktype, bind_address->ai_protocol);
-    if (!ISVALIDSOCKET(socket_listen)) {
-        fprintf(stderr, "socket() failed. (%d)\n", GETSOCKETERRNO());
-        return 1;
+#if !defined(HAVE_MMSG)
+    if (opts->batch > 1) {
+        fprintf(stderr, "recvmmsg() not available, using batch 1.\n");
+        opts->batch = 1;
     }
+#endif
+#if !defined(HAVE_THREADS)
+    if (opts->threads > 1) {
+        fprintf(stderr, "threads not available, using 1 worker.\n");
+        opts->threads = 1;
+    }
+#endif
+    return 0;
+}
 
-    /*
-    A ligação do novo soquete ao endereço local é feita da seguinte maneira:
-    */
 
-    printf("Binding socket to local address...\n");
-    if (bind(socket_listen,
-                bind_address->ai_addr, bind_address->ai_addrlen)) {
-        fprintf(stderr, "bind() failed. (%d)\n", GETSOCKETERRNO());
-        return 1;
-    }
-    freeaddrinfo(bind_address);
+/*
+Loop principal : Copia o conjunto de soquetes para uma nova variável, lê,
+e então usa select() para esperar até que nosso soquete esteja pronto para ler.
+Lembre-se de que poderíamos transmitir um valor de tempo limite como o último
+parâmetro a select() se quisermos definir um valor máximo de tempo de espera para a próxima leitura. 
+
+Depois que select() retorna, usamos FD_ISSET() para saber se nosso soquete específico,
+socket_listen, está pronto para ser lido. Se tivéssemos soquetes adicionais, precisaríamos
+usar FD_ISSET() para cada soquete.
+
+Se FD_ISSET() retornar true, lemos do soquete usando recvfrom().
+recvfrom() nos fornece o endereço do remetente; portanto, devemos primeiro
+alocar uma variável para reter o endereço, para que é, client_address.
+Depois de ler uma string do soquete usando recvfrom(), nós convertemos
+a string em maiúscula usando ascii_toupper() (Common_Code/ascii_case.h),
+que dá o mesmo resultado da função C toupper() em blocos SIMD, ou pela cadeia
+escolhida com -x (Common_Code/transform.h); seq_transform() preserva o
+cabeçalho de sequência do udp_client (udp_seq.h). Em seguida, enviamos o
+texto modificado de volta ao remetente usando sendto(). Observe que os dois
+últimos parâmetros para sendto() são os endereços do cliente que obtemos de recvfrom().
+
+Cada worker roda este laço (ou serve_batch()) sobre o seu próprio socket.
+*/
+static int serve_plain(struct udp_worker *w) {
+    SOCKET socket_listen = w->socket;
 
     /*
     Como nosso servidor usa select(), precisamos criar um novo fd_set para armazenar nossa escuta.
@@ -88,58 +217,314 @@ int main() {
     FD_ZERO(&master);
     FD_SET(socket_listen, &master);
     SOCKET max_socket = socket_listen;
-
-    printf("Waiting for connections...\n");
+#if defined(HAVE_BUSY_POLL)
+    uint64_t spin_ns = (uint64_t)w->opts->busy_poll * 1000;
+#endif
 
     /*
-    Loop principal : Copia o conjunto de soquetes para uma nova variável, lê,
-    e então usa select() para esperar até que nosso soquete esteja pronto para ler.
-    Lembre-se de que poderíamos transmitir um valor de tempo limite como o último
-    parâmetro a select() se quisermos definir um valor máximo de tempo de espera para a próxima leitura. 
-
-    Depois que select() retorna, usamos FD_ISSET() para saber se nosso soquete específico,
-    socket_listen, está pronto para ser lido. Se tivéssemos soquetes adicionais, precisaríamos
-    usar FD_ISSET() para cada soquete.
-
-    Se FD_ISSET() retornar true, lemos do soquete usando recvfrom().
-    recvfrom() nos fornece o endereço do remetente; portanto, devemos primeiro
-    alocar uma variável para reter o endereço, para que é, client_address.
-    Depois de ler uma string do soquete usando recvfrom(), nós convertemos
-    a string em maiúscula usando a função C toupper(). Em seguida, enviamos o
-    texto modificado de volta ao remetente usando sendto(). Observe que os dois
-    últimos parâmetros para sendto() são os endereços do cliente que obtemos de recvfrom().
+    O buffer de recepção vem do pool e é reaproveitado a cada datagrama, em vez
+    de um vetor de 512000 bytes na pilha a cada iteração. Nenhum datagrama UDP
+    passa de 64 KB.
     */
+    size_t read_cap;
+    char *read = (char*)pool_alloc(&w->pool, TAM_DATAGRAM, &read_cap);
+    if (!read) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
 
     while(1) {
         fd_set reads;
         reads = master;
-        if (select(max_socket+1, &reads, 0, 0, 0) < 0) {
+        int ready = 0;
+#if defined(HAVE_BUSY_POLL)
+        //com -B, gira antes de dormir; reads já contém o socket
+        if (spin_ns) {
+            unsigned long polls = 0;
+            ready = spin_readable(socket_listen, spin_ns, &polls);
+            counter_add(&w->stats.spin_polls, polls);
+        }
+#endif
+        if (!ready && select(max_socket+1, &reads, 0, 0, 0) < 0) {
             fprintf(stderr, "select() failed. (%d)\n", GETSOCKETERRNO());
             return 1;
         }
+        uint64_t busy = mono_ns();
 
         if (FD_ISSET(socket_listen, &reads)) {
             struct sockaddr_storage client_address;
             socklen_t client_len = sizeof(client_address);
 
-            char read[512000];
-            int bytes_received = recvfrom(socket_listen, read, 512000, 0,
+#if defined(HAVE_RXQ_OVFL)
+            //recvmsg() em vez de recvfrom() para receber o contador de descartes
+            char ctrl[RXQ_CMSG_SPACE];
+            struct iovec iov;
+            iov.iov_base = read;
+            iov.iov_len = read_cap - w->opts->xform.trailer;
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_name = &client_address;
+            msg.msg_namelen = client_len;
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = ctrl;
+            msg.msg_controllen = sizeof(ctrl);
+            int bytes_received = recvmsg(socket_listen, &msg, 0);
+            client_len = msg.msg_namelen;
+            if (bytes_received > 0)
+                udp_note_drops(w, &msg);
+#else
+            int bytes_received = recvfrom(socket_listen, read,
+                    (int)(read_cap - w->opts->xform.trailer), 0,
                     (struct sockaddr *)&client_address, &client_len);
+#endif
+            counter_add(&w->stats.recv_calls, 1);
             if (bytes_received < 1) {
                 fprintf(stderr, "connection closed. (%d)\n",
                         GETSOCKETERRNO());
                 return 1;
             }
 
-            int j;
-            for (j = 0; j < bytes_received; ++j)
-                read[j] = toupper(read[j]);
-            sendto(socket_listen, read, bytes_received, 0,
-                    (struct sockaddr*)&client_address, client_len);
+            counter_add(&w->stats.bytes_in, bytes_received);
 
+            //transferência confiável (udp_reliable.h): responde com o ACK,
+            //ou com nada se o pacote foi rejeitado
+            int reliable = rdt_is_packet(read, bytes_received);
+            int reply = reliable ?
+                rdt_serve(&w->rdt, read, bytes_received, 0,
+                        (struct sockaddr*)&client_address, client_len) :
+                (int)seq_transform(&w->opts->xform, read, bytes_received, 0);
+            if (!reliable || reply > 0) {
+                int sent = sendto(socket_listen, read, reply, 0,
+                        (struct sockaddr*)&client_address, client_len);
+                counter_add(&w->stats.send_calls, 1);
+                if (sent < 0)
+                    counter_add(&w->stats.tx_drops, 1);
+                else
+                    counter_add(&w->stats.bytes_out, sent);
+                counter_add(&w->stats.messages, 1);
+            }
         } //if FD_ISSET
+        if (w->stats.rx_drops != w->drops_seen)
+            udp_grow_rcvbuf(w);
+        stats_loop(&w->stats, mono_ns() - busy);
     } //while(1)
 
+    pool_free(&w->pool, read, read_cap);
+    return 0;
+}
+
+static int run_worker(struct udp_worker *w) {
+#if defined(HAVE_AFFINITY)
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set))
+            fprintf(stderr, "sched_setaffinity(%d) failed. (%d)\n",
+                    w->cpu, GETSOCKETERRNO());
+    }
+#endif
+
+#if defined(HAVE_BUSY_POLL)
+    if (w->opts->busy_poll)
+        busy_poll_socket(w->socket, w->opts->busy_poll);
+#endif
+
+    //o pool é criado na thread do worker, já na CPU (e nó NUMA) dela
+    pool_init(&w->pool, 0);
+    int result;
+#if defined(HAVE_MMSG)
+    if (w->opts->batch > 1 || w->opts->gro)
+        result = serve_batch(w);
+    else
+#endif
+        result = serve_plain(w);
+    pool_destroy(&w->pool);
+    free(w->rdt);
+    return result;
+}
+
+#if defined(HAVE_THREADS)
+static void *worker_thread(void *arg) {
+    struct udp_worker *w = (struct udp_worker*)arg;
+    w->result = run_worker(w);
+    __atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+Relatório da thread principal: a cada REPORT_INTERVAL segundos, datagramas
+por segundo de cada worker e a soma. Um fluxo (mesmo endereço e porta de
+origem) cai sempre no mesmo socket, então a soma só cresce com o número de
+workers quando há vários clientes ou portas de origem.
+*/
+static void report_workers(struct udp_worker *workers, int nworkers) {
+    unsigned long *last = (unsigned long*)calloc(nworkers, sizeof(*last));
+    if (!last)
+        return;
+    uint64_t last_ns = mono_ns();
+
+    while (1) {
+        sleep(REPORT_INTERVAL);
+
+        int k, running = 0;
+        for (k = 0; k < nworkers; ++k)
+            running += !__atomic_load_n(&workers[k].done, __ATOMIC_ACQUIRE);
+        if (!running)
+            break;
+
+        uint64_t now = mono_ns();
+        double seconds = (now - last_ns) / 1e9;
+        unsigned long total = 0, total_bytes = 0;
+        for (k = 0; k < nworkers; ++k) {
+            unsigned long d = counter_read(&workers[k].stats.messages);
+            unsigned long delta = d - last[k];
+            last[k] = d;
+            total += delta;
+            total_bytes += counter_read(&workers[k].stats.bytes_in);
+            printf("  worker %d: %.0f datagrams/s\n", k, delta / seconds);
+        }
+        printf("Datagrams: %.0f/s across %d workers (%lu bytes total)\n",
+                total / seconds, nworkers, total_bytes);
+        fflush(stdout);
+        last_ns = now;
+    }
+    free(last);
+}
+#endif
+
+
+struct worker_set {
+    struct udp_worker *workers;
+    int n;
+};
+
+//Retrato das métricas: uma linha por worker e a soma
+static void snapshot_workers(void *arg, struct stats_text *out) {
+    const struct worker_set *set = (const struct worker_set*)arg;
+    struct server_stats total, one;
+    memset(&total, 0, sizeof(total));
+    int k;
+    for (k = 0; k < set->n; ++k) {
+        char label[32];
+        stats_read(&set->workers[k].stats, &one);
+        //o SO_RXQ_OVFL só chega com o próximo datagrama; o SO_MEMINFO é atual
+        unsigned long drops = udp_rx_drops(set->workers[k].socket);
+        if (drops > one.rx_drops)
+            one.rx_drops = drops;
+        snprintf(label, sizeof(label), "worker=%d", k);
+        stats_format(out, label, &one, 1);
+        stats_merge(&total, &one);
+    }
+    stats_format(out, "total", &total, 1);
+}
+
+
+/*
+inicia o main() e inicializa o Winsock.
+*/
+int main(int argc, char *argv[]) {
+
+    struct udp_options opts;
+    if (parse_options(argc, argv, &opts))
+        return 1;
+
+#if defined(_WIN32)
+    WSADATA d;
+    if (WSAStartup(MAKEWORD(2, 2), &d)) {
+        fprintf(stderr, "Failed to initialize.\n");
+        return 1;
+    }
+#endif
+
+    /*
+    Em seguida, encontramos nosso endereço local em que devemos ouvir,
+    criar o soquete e vincular a ele.
+    A única diferença entre esse código e os servidores TCP é que
+    usamos SOCK_DGRAM em vez de SOCK_STREAM. SOCK_DGRAM especifica que queremos um soquete UDP.
+    Aqui está o código para definir o endereço e criar um novo soquete:
+    */
+
+    printf("Configuring local address...\n");
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo *bind_address;
+    getaddrinfo(0, "8080", &hints, &bind_address);
+
+
+    /*
+    Um socket por worker, todos ligados à mesma porta com SO_REUSEPORT; o
+    kernel espalha os fluxos entre as filas de recepção. Os workers ficam
+    alinhados à linha de cache para que os contadores de um não dividam
+    linha com os do vizinho. Com um só worker o socket é o mesmo de antes.
+    */
+    int nworkers = opts.threads;
+    int ncpus = online_cpus();
+    struct udp_worker *workers;
+#if defined(HAVE_THREADS)
+    if (posix_memalign((void**)&workers, CACHE_LINE, nworkers * sizeof(*workers)))
+        workers = 0;
+#else
+    workers = (struct udp_worker*)malloc(nworkers * sizeof(*workers));
+#endif
+    if (!workers) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    memset(workers, 0, nworkers * sizeof(*workers));
+
+    printf("Creating socket...\n");
+    printf("Binding socket to local address...\n");
+    int k;
+    for (k = 0; k < nworkers; ++k) {
+        workers[k].id = k;
+        workers[k].cpu = opts.pin_cpus ? k % ncpus : -1;
+        workers[k].opts = &opts;
+        workers[k].socket = create_socket(bind_address, nworkers > 1);
+        if (!ISVALIDSOCKET(workers[k].socket))
+            return 1;
+        udp_setup_buffers(&workers[k]);
+    }
+    freeaddrinfo(bind_address);
+
+    struct worker_set set;
+    set.workers = workers;
+    set.n = nworkers;
+    opts.stats.snapshot = snapshot_workers;
+    opts.stats.arg = &set;
+    if (stats_start(&opts.stats))
+        return 1;
+    if (opts.stats.port)
+        printf("Metrics on 127.0.0.1:%d\n", opts.stats.port);
+
+    if (nworkers > 1)
+        printf("Serving with %d workers...\n", nworkers);
+    printf("Waiting for connections...\n");
+
+    int result = 0;
+#if defined(HAVE_THREADS)
+    if (nworkers > 1) {
+        for (k = 0; k < nworkers; ++k) {
+            if (pthread_create(&workers[k].thread, 0, worker_thread, &workers[k])) {
+                fprintf(stderr, "pthread_create() failed.\n");
+                return 1;
+            }
+        }
+        report_workers(workers, nworkers);
+        for (k = 0; k < nworkers; ++k) {
+            pthread_join(workers[k].thread, 0);
+            if (workers[k].result)
+                result = workers[k].result;
+        }
+    } else
+#endif
+        result = run_worker(&workers[0]);
+
     /*
     Podemos então fechar o soquete, limpar o Winsock e finalizar o programa.
     Note que este o código nunca é executado, porque o loop principal
@@ -148,7 +533,9 @@ int main() {
     */
 
     printf("Closing listening socket...\n");
-    CLOSESOCKET(socket_listen);
+    for (k = 0; k < nworkers; ++k)
+        CLOSESOCKET(workers[k].socket);
+    free(workers);
 
 #if defined(_WIN32)
     WSACleanup();
@@ -156,5 +543,5 @@ int main() {
 
     printf("Finished.\n");
 
-    return 0;
+    return result;
 }
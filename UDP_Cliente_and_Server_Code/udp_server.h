@@ -0,0 +1,496 @@
+/*
+ * Workers e modos alternativos do servidor UDP. O laço original (um
+ * recvfrom() e um sendto() por datagrama) continua em udp_serve_toupper.c.
+ */
+
+#ifndef UDP_SERVER_H
+#define UDP_SERVER_H
+
+#include "chap04.h"
+#include "../Common_Code/transform.h"
+#include "../Common_Code/buffer_pool.h"
+#include "../Common_Code/mono_clock.h"
+#include "../Common_Code/server_stats.h"
+#include "../Common_Code/busy_poll.h"
+#include "udp_gso.h"
+#include "udp_seq.h"
+#include "udp_reliable.h"
+#include <stdlib.h>
+#include <time.h>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#define HAVE_THREADS
+#if !defined(INVALID_SOCKET)
+#define INVALID_SOCKET (-1)
+#endif
+#endif
+
+#if defined(__linux__)
+#include <sched.h>
+#define HAVE_MMSG
+#define HAVE_AFFINITY
+#include <linux/sock_diag.h>
+#if defined(SO_MEMINFO)
+#define HAVE_MEMINFO
+#endif
+#if defined(SO_RXQ_OVFL)
+#define HAVE_RXQ_OVFL
+#endif
+#endif
+
+#if defined(HAVE_RXQ_OVFL)
+#define RXQ_CMSG_SPACE CMSG_SPACE(sizeof(uint32_t))
+#else
+#define RXQ_CMSG_SPACE 0
+#endif
+//controle de cada datagrama recebido: segmento do GRO e contador de descartes
+#if defined(HAVE_UDP_GSO)
+#define UDP_CMSG_SPACE (GRO_CMSG_SPACE + RXQ_CMSG_SPACE)
+#else
+#define UDP_CMSG_SPACE RXQ_CMSG_SPACE
+#endif
+
+#define TAM_DATAGRAM 65536 //maior datagrama UDP possível
+#define REPORT_INTERVAL 5  //segundos entre relatórios de estatística
+#define RCVBUF_MAX (8 * 1024 * 1024)    //teto padrão do crescimento de SO_RCVBUF
+#define RCVBUF_GROW_NS 100000000u       //no máximo um aumento a cada 100 ms
+
+struct udp_options {
+    int batch;      //datagramas por recvmmsg(); 1 = laço original
+    int gro;        //recebe com UDP_GRO e responde com UDP_SEGMENT
+    int threads;    //workers, cada um com seu socket SO_REUSEPORT
+    int pin_cpus;   //fixa o worker k na CPU k
+    struct xform_chain xform;   //transformação do conteúdo (-x)
+    struct stats_reporter stats;    //porta e intervalo do retrato (-S, -D)
+    int busy_poll;  //microssegundos de giro antes de dormir (0 = nunca)
+    int rcvbuf;     //SO_RCVBUF inicial (0 = o do kernel)
+    int rcvbuf_max; //teto do SO_RCVBUF quando há descartes (0 = não cresce)
+    int sndbuf;     //SO_SNDBUF (0 = o do kernel)
+};
+
+/*
+Os contadores (server_stats.h) ficam no início do worker, numa linha de
+cache própria; messages conta datagramas respondidos e batch_buffers as
+entradas preenchidas pelos recvmmsg().
+*/
+struct CACHE_ALIGNED udp_worker {
+    struct server_stats stats;
+    int id;
+    int cpu;                //-1 quando não há afinidade
+    SOCKET socket;
+    const struct udp_options *opts;
+    struct buffer_pool pool;
+#if defined(HAVE_THREADS)
+    pthread_t thread;
+#endif
+    int done;               //worker saiu do laço; lido pelo relatório
+    int result;
+    int rcvbuf;             //SO_RCVBUF atual, como o kernel informa
+    unsigned long drops_seen;   //rx_drops no último ajuste do SO_RCVBUF
+    uint64_t grown_ns;      //instante do último aumento
+    struct rdt_table *rdt;  //transferências confiáveis, criada no primeiro DATA
+};
+
+
+/*
+Cria o socket UDP e o liga ao endereço local. Com reuseport, vários sockets
+dividem a mesma porta e o kernel distribui os fluxos (hash da origem) entre
+eles; datagramas de um mesmo cliente vão sempre para o mesmo socket.
+*/
+static SOCKET create_socket(struct addrinfo *bind_address, int reuseport) {
+    SOCKET s;
+    s = socket(bind_address->ai_family,
+            bind_address->ai_socktype, bind_address->ai_protocol);
+    if (!ISVALIDSOCKET(s)) {
+        fprintf(stderr, "socket() failed. (%d)\n", GETSOCKETERRNO());
+        return INVALID_SOCKET;
+    }
+
+    if (reuseport) {
+#if defined(SO_REUSEPORT)
+        int yes = 1;
+        if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (void*)&yes, sizeof(yes))) {
+            fprintf(stderr, "setsockopt(SO_REUSEPORT) failed. (%d)\n",
+                    GETSOCKETERRNO());
+            CLOSESOCKET(s);
+            return INVALID_SOCKET;
+        }
+#else
+        fprintf(stderr, "SO_REUSEPORT not supported.\n");
+        CLOSESOCKET(s);
+        return INVALID_SOCKET;
+#endif
+    }
+
+    if (bind(s, bind_address->ai_addr, bind_address->ai_addrlen)) {
+        fprintf(stderr, "bind() failed. (%d)\n", GETSOCKETERRNO());
+        CLOSESOCKET(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+
+/*
+Datagramas que o kernel descartou porque a fila de recepção do socket estava
+cheia. O contador é do socket, não do worker, e é lido só quando se monta o
+retrato das métricas. Sem SO_MEMINFO devolve 0.
+*/
+static unsigned long udp_rx_drops(SOCKET s) {
+#if defined(HAVE_MEMINFO)
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t len = sizeof(meminfo);
+    if (!getsockopt(s, SOL_SOCKET, SO_MEMINFO, meminfo, &len) &&
+            len > SK_MEMINFO_DROPS * sizeof(uint32_t))
+        return meminfo[SK_MEMINFO_DROPS];
+#else
+    (void)s;
+#endif
+    return 0;
+}
+
+
+static int udp_buffer_size(SOCKET s, int opt) {
+    int size = 0;
+    socklen_t len = sizeof(size);
+    if (getsockopt(s, SOL_SOCKET, opt, (void*)&size, &len))
+        return -1;
+    return size;
+}
+
+/*
+Pede bytes para SO_RCVBUF/SO_SNDBUF e devolve o que o kernel informa. O Linux
+dobra o valor pedido (a folga para os metadados) e o limita a
+net.core.rmem_max/wmem_max; se o limite cortou o pedido, tenta a variante
+FORCE, que ignora o limite mas exige CAP_NET_ADMIN.
+*/
+static int udp_set_buffer(SOCKET s, int opt, int force, int bytes) {
+    setsockopt(s, SOL_SOCKET, opt, (void*)&bytes, sizeof(bytes));
+    int got = udp_buffer_size(s, opt);
+    if (force && got >= 0 && got < bytes)
+        if (!setsockopt(s, SOL_SOCKET, force, (void*)&bytes, sizeof(bytes)))
+            got = udp_buffer_size(s, opt);
+    return got;
+}
+
+#if defined(SO_RCVBUFFORCE)
+#define UDP_RCVBUFFORCE SO_RCVBUFFORCE
+#define UDP_SNDBUFFORCE SO_SNDBUFFORCE
+#else
+#define UDP_RCVBUFFORCE 0
+#define UDP_SNDBUFFORCE 0
+#endif
+
+/*
+Ajusta os buffers do socket do worker, liga o SO_RXQ_OVFL (cada datagrama
+recebido passa a trazer o total de descartes do socket até então, sem
+chamada de sistema extra) e registra os tamanhos que o kernel de fato deu.
+*/
+static void udp_setup_buffers(struct udp_worker *w) {
+    const struct udp_options *opts = w->opts;
+    if (opts->rcvbuf)
+        udp_set_buffer(w->socket, SO_RCVBUF, UDP_RCVBUFFORCE, opts->rcvbuf);
+    if (opts->sndbuf)
+        udp_set_buffer(w->socket, SO_SNDBUF, UDP_SNDBUFFORCE, opts->sndbuf);
+    const char *drops = "SO_MEMINFO only";
+#if defined(HAVE_RXQ_OVFL)
+    int one = 1;
+    if (setsockopt(w->socket, SOL_SOCKET, SO_RXQ_OVFL, (void*)&one, sizeof(one)))
+        fprintf(stderr, "setsockopt(SO_RXQ_OVFL) failed. (%d)\n", GETSOCKETERRNO());
+    else
+        drops = "SO_RXQ_OVFL";
+#endif
+    w->rcvbuf = udp_buffer_size(w->socket, SO_RCVBUF);
+    counter_set(&w->stats.rcvbuf, (unsigned long)w->rcvbuf);
+    printf("Worker %d: SO_RCVBUF %d bytes, SO_SNDBUF %d bytes, drops from %s\n",
+            w->id, w->rcvbuf, udp_buffer_size(w->socket, SO_SNDBUF), drops);
+    fflush(stdout);
+}
+
+#if defined(HAVE_RXQ_OVFL)
+//Lê o contador de descartes que acompanha o datagrama, se houver
+static void udp_note_drops(struct udp_worker *w, struct msghdr *msg) {
+    struct cmsghdr *cm;
+    for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(cm), sizeof(drops));
+            if (drops != w->stats.rx_drops)
+                counter_set(&w->stats.rx_drops, drops);
+        }
+    }
+}
+#endif
+
+/*
+Chamada quando rx_drops mudou: a fila de recepção transbordou, então o
+SO_RCVBUF dobra, até opts->rcvbuf_max e no máximo uma vez a cada
+RCVBUF_GROW_NS (o efeito de um aumento só aparece na rajada seguinte).
+Quando o kernel não dá mais (rmem_max sem CAP_NET_ADMIN) o crescimento pára.
+*/
+static void udp_grow_rcvbuf(struct udp_worker *w) {
+    int max = w->opts->rcvbuf_max;
+    if (w->rcvbuf < 0 || w->rcvbuf >= max) {
+        w->drops_seen = w->stats.rx_drops;
+        return;
+    }
+    uint64_t now = mono_ns();
+    if (now - w->grown_ns < RCVBUF_GROW_NS)
+        return;
+    //o kernel informa o dobro do pedido: pedir o valor atual o dobra
+    int want = w->rcvbuf < max / 2 ? w->rcvbuf : max / 2;
+    int got = udp_set_buffer(w->socket, SO_RCVBUF, UDP_RCVBUFFORCE, want);
+    printf("Worker %d: %lu drops, SO_RCVBUF %d -> %d bytes\n",
+            w->id, w->stats.rx_drops - w->drops_seen, w->rcvbuf, got);
+    if (got <= w->rcvbuf) {
+        printf("Worker %d: SO_RCVBUF capped by net.core.rmem_max\n", w->id);
+        got = max;
+    }
+    w->rcvbuf = got;
+    counter_set(&w->stats.rcvbuf, (unsigned long)udp_buffer_size(w->socket, SO_RCVBUF));
+    w->drops_seen = w->stats.rx_drops;
+    w->grown_ns = now;
+    fflush(stdout);
+}
+
+
+#if defined(HAVE_MMSG)
+#if defined(HAVE_UDP_GSO)
+//Reenvia um buffer GRO como datagramas separados, quando o GSO falha no envio
+static void send_segments(SOCKET s, struct msghdr *hdr, int segment) {
+    const char *data = (const char*)hdr->msg_iov[0].iov_base;
+    size_t len = hdr->msg_iov[0].iov_len;
+    size_t off;
+    for (off = 0; off < len; off += segment) {
+        size_t n = len - off < (size_t)segment ? len - off : (size_t)segment;
+        sendto(s, data + off, n, 0,
+                (struct sockaddr*)hdr->msg_name, hdr->msg_namelen);
+    }
+}
+#endif
+
+/*
+Modo em lote: cada recvmmsg() drena até batch datagramas da fila do socket,
+todos são convertidos e as respostas saem num único sendmmsg(), cada uma para
+o endereço de origem do seu datagrama. Uma chamada de sistema cobre o lote
+inteiro em vez de um datagrama.
+
+Com gro, cada entrada do lote pode trazer vários datagramas do mesmo cliente
+emendados. O buffer é convertido segmento a segmento (cada um pode ter o seu
+cabeçalho de sequência, udp_seq.h) e devolvido com UDP_SEGMENT, e o kernel o
+recorta de novo nos mesmos datagramas.
+
+Com um único worker o próprio laço imprime o aproveitamento dos lotes; com
+vários, o relatório fica com a thread principal.
+*/
+static int serve_batch(struct udp_worker *w) {
+    const struct udp_options *opts = w->opts;
+    SOCKET socket_listen = w->socket;
+    int batch = opts->batch;
+    int gro = 0;
+#if defined(HAVE_UDP_GSO)
+    if (opts->gro) {
+        if (udp_gso_probe(socket_listen) || udp_enable_gro(socket_listen))
+            fprintf(stderr, "UDP GSO/GRO not supported. (%d)\n",
+                    GETSOCKETERRNO());
+        else
+            gro = 1;
+    }
+    int *segments = (int*)calloc(batch, sizeof(int));
+    if (!segments) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+#endif
+    size_t ctrl_space = UDP_CMSG_SPACE;
+    char *ctrl = (char*)calloc(batch, ctrl_space ? ctrl_space : 1);
+    if (!ctrl) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+
+    struct mmsghdr *msgs = (struct mmsghdr*)calloc(batch, sizeof(*msgs));
+    struct iovec *iovs = (struct iovec*)calloc(batch, sizeof(*iovs));
+    struct sockaddr_storage *addrs =
+        (struct sockaddr_storage*)calloc(batch, sizeof(*addrs));
+    char **bufs = (char**)calloc(batch, sizeof(*bufs));
+    size_t cap = 0;
+    int k;
+    if (!msgs || !iovs || !addrs || !bufs) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    for (k = 0; k < batch; ++k) {
+        bufs[k] = (char*)pool_alloc(&w->pool, TAM_DATAGRAM, &cap);
+        if (!bufs[k]) {
+            fprintf(stderr, "Out of memory.\n");
+            return 1;
+        }
+    }
+
+    struct server_stats last = w->stats;
+    time_t last_report = time(0);
+    uint64_t spin_ns = (uint64_t)opts->busy_poll * 1000;
+
+    while(1) {
+        fd_set reads;
+        FD_ZERO(&reads);
+        FD_SET(socket_listen, &reads);
+        int ready = 0;
+        if (spin_ns) {
+            unsigned long polls = 0;
+            ready = spin_readable(socket_listen, spin_ns, &polls);
+            counter_add(&w->stats.spin_polls, polls);
+        }
+        if (!ready && select(socket_listen+1, &reads, 0, 0, 0) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "select() failed. (%d)\n", GETSOCKETERRNO());
+            return 1;
+        }
+        uint64_t busy = mono_ns();
+
+        //drena a fila: pára quando um lote volta incompleto
+        int n;
+        do {
+            for (k = 0; k < batch; ++k) {
+                iovs[k].iov_base = bufs[k];
+                iovs[k].iov_len = cap - opts->xform.trailer;
+                memset(&msgs[k].msg_hdr, 0, sizeof(msgs[k].msg_hdr));
+                msgs[k].msg_hdr.msg_name = &addrs[k];
+                msgs[k].msg_hdr.msg_namelen = sizeof(addrs[k]);
+                msgs[k].msg_hdr.msg_iov = &iovs[k];
+                msgs[k].msg_hdr.msg_iovlen = 1;
+                if (ctrl_space) {
+                    msgs[k].msg_hdr.msg_control = ctrl + k * ctrl_space;
+                    msgs[k].msg_hdr.msg_controllen = ctrl_space;
+                }
+            }
+
+            n = recvmmsg(socket_listen, msgs, batch, MSG_DONTWAIT, 0);
+            counter_add(&w->stats.recv_calls, 1);
+            if (n < 0) {
+                if (SOCKETWOULDBLOCK() || errno == EINTR)
+                    break;
+                fprintf(stderr, "recvmmsg() failed. (%d)\n", GETSOCKETERRNO());
+                return 1;
+            }
+
+            unsigned long datagrams = 0, bytes = 0, bytes_out = 0;
+            int replies = 0;
+            for (k = 0; k < n; ++k) {
+                bytes += msgs[k].msg_len;
+#if defined(HAVE_RXQ_OVFL)
+                udp_note_drops(w, &msgs[k].msg_hdr);
+#endif
+                int segment = 0;
+#if defined(HAVE_UDP_GSO)
+                if (gro)
+                    segment = udp_gro_segment(&msgs[k].msg_hdr);
+#endif
+                //a resposta não leva os cmsgs da recepção
+                msgs[k].msg_hdr.msg_control = 0;
+                msgs[k].msg_hdr.msg_controllen = 0;
+#if defined(HAVE_UDP_GSO)
+                segments[k] = 0;
+#endif
+                if (rdt_is_packet(bufs[k], msgs[k].msg_len)) {
+                    //transferência confiável: o ACK vai no lugar do eco, e
+                    //um pacote que ela rejeita fica sem resposta nenhuma
+                    int ack = rdt_serve(&w->rdt, bufs[k], msgs[k].msg_len,
+                            segment, (struct sockaddr*)&addrs[k],
+                            msgs[k].msg_hdr.msg_namelen);
+                    if (ack <= 0)
+                        continue;
+                    iovs[k].iov_len = ack;
+                    datagrams += segment > 0 ?
+                        (msgs[k].msg_len + segment - 1) / segment : 1;
+                } else {
+#if defined(HAVE_UDP_GSO)
+                    if (segment > 0 && (unsigned)segment < msgs[k].msg_len) {
+                        udp_set_segment(&msgs[k].msg_hdr, ctrl + k * ctrl_space,
+                                (uint16_t)segment);
+                        segments[k] = segment;
+                    }
+                    iovs[k].iov_len = seq_transform(&opts->xform, bufs[k],
+                            msgs[k].msg_len, segments[k]);
+                    datagrams += udp_segments(msgs[k].msg_len, segments[k]);
+#else
+                    iovs[k].iov_len = seq_transform(&opts->xform, bufs[k],
+                            msgs[k].msg_len, 0);
+                    datagrams++;
+#endif
+                }
+                bytes_out += iovs[k].iov_len;
+                //as respostas ficam contíguas no início de msgs
+                if (replies != k) {
+                    msgs[replies] = msgs[k];
+#if defined(HAVE_UDP_GSO)
+                    segments[replies] = segments[k];
+#endif
+                }
+                replies++;
+            }
+
+            //msg_namelen já traz o tamanho real de cada endereço de origem
+            int sent = 0;
+            while (sent < replies) {
+                int r = sendmmsg(socket_listen, msgs + sent, replies - sent, 0);
+                counter_add(&w->stats.send_calls, 1);
+                if (r < 0) {
+                    if (errno == EINTR)
+                        continue;
+#if defined(HAVE_UDP_GSO)
+                    //a interface não segmenta: desliga o GSO e manda em partes
+                    if (segments[sent] && (errno == EIO || errno == EINVAL)) {
+                        fprintf(stderr, "UDP GSO send failed, disabling GRO.\n");
+                        int zero = 0;
+                        setsockopt(socket_listen, SOL_UDP, UDP_GRO,
+                                &zero, sizeof(zero));
+                        gro = 0;
+                        send_segments(socket_listen, &msgs[sent].msg_hdr,
+                                segments[sent]);
+                    } else
+#endif
+                    {
+                        //descarta só o datagrama que falhou (ex.: ICMP unreachable)
+                        bytes_out -= msgs[sent].msg_hdr.msg_iov->iov_len;
+                        counter_add(&w->stats.tx_drops, 1);
+                    }
+                    r = 1;
+                }
+                sent += r;
+            }
+            counter_add(&w->stats.batches, 1);
+            counter_add(&w->stats.batch_buffers, n);
+            counter_add(&w->stats.messages, datagrams);
+            counter_add(&w->stats.bytes_in, bytes);
+            counter_add(&w->stats.bytes_out, bytes_out);
+        } while (n == batch);
+        if (w->stats.rx_drops != w->drops_seen)
+            udp_grow_rcvbuf(w);
+        stats_loop(&w->stats, mono_ns() - busy);
+
+        time_t now = time(0);
+        if (opts->threads == 1 && now - last_report >= REPORT_INTERVAL &&
+                w->stats.batches != last.batches) {
+            unsigned long batches = w->stats.batches - last.batches;
+            unsigned long buffers = w->stats.batch_buffers - last.batch_buffers;
+            unsigned long datagrams = w->stats.messages - last.messages;
+            printf("Batch fill: %.2f of %d buffers (%lu batches)\n",
+                    (double)buffers / batches, batch, batches);
+            printf("Datagrams: %.0f/s, %.2f per buffer\n",
+                    (double)datagrams / (now - last_report),
+                    (double)datagrams / buffers);
+            fflush(stdout);
+            last = w->stats;
+            last_report = now;
+        }
+    } //while(1)
+
+    return 0;
+}
+#endif
+
+#endif
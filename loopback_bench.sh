@@ -0,0 +1,191 @@
+#!/bin/sh
+#
+# Benchmark de ponta a ponta no loopback. Sobe cada variante dos servidores
+# (TCP com select, epoll e io_uring; UDP com laço simples e em lote), roda os
+# clientes variando tamanho de mensagem, número de conexões e profundidade do
+# pipeline, mede o kernel de transform.h com o xform_bench e grava tudo num
+# CSV, uma linha por ponto:
+#
+#   test,variant,size,connections,window,msgs_per_s,mb_per_s,p50_us,p99_us
+#
+# Com várias conexões rodam vários clientes ao mesmo tempo: msgs/s e MB/s são
+# a soma, p50 a média e p99 o pior entre eles. O cliente UDP espera cada eco
+# antes da próxima mensagem, então no UDP a janela é sempre 1. Cada ponto roda
+# RUNS vezes e fica a melhor vazão. Isso só tira o ruído do escalonador: os
+# três laços TCP ligam o TCP_NODELAY, e um p50 ou p99 perto de 40 ms (o Nagle
+# esperando o ACK atrasado do cliente) é defeito do servidor, não ruído.
+#
+# No fim compara o MB/s de cada ponto com o baseline guardado e marca como
+# REGRESSION o que caiu mais que TOLERANCE por cento (o script sai com 1). Se
+# o baseline não existe, esta rodada vira o baseline; apague o arquivo (ou
+# rode com UPDATE_BASELINE=1) depois de uma mudança intencional. Os números
+# só se comparam na mesma máquina.
+#
+# uso: ./loopback_bench.sh [diretório dos binários] [saída.csv]
+#   SIZES, CONNS, WINDOWS, COUNT, RUNS, TCP_ENGINES, UDP_BATCHES,
+#   XFORM_CHAINS, BASELINE, TOLERANCE e UPDATE_BASELINE mudam a varredura;
+#   SERVER_FLAGS vai para os dois servidores (ex.: SERVER_FLAGS="-B 50" para
+#   comparar o modo busy-poll com o padrão, com outro BASELINE).
+
+BIN=${1:-.}
+OUT=${2:-loopback_bench.csv}
+BASELINE=${BASELINE:-$(dirname "$0")/loopback_baseline.csv}
+SIZES=${SIZES:-"64 512 4096 16384 65536"}
+CONNS=${CONNS:-"1 4"}
+WINDOWS=${WINDOWS:-"1 16"}
+COUNT=${COUNT:-2000}
+RUNS=${RUNS:-3}
+TCP_ENGINES=${TCP_ENGINES:-"select epoll uring"}
+UDP_BATCHES=${UDP_BATCHES:-"1 32"}
+XFORM_CHAINS=${XFORM_CHAINS:-"upper upper,rot13,xor:0x5a,crc32c"}
+TOLERANCE=${TOLERANCE:-15}
+SERVER_FLAGS=${SERVER_FLAGS:-}
+PORT=8080
+UDP_MAX=65507   # maior datagrama UDP sobre IPv4
+
+tmp=$(mktemp -d)
+server=
+trap 'rm -rf "$tmp"' EXIT
+trap '[ -n "$server" ] && kill "$server"; exit 1' INT TERM
+
+start_server() {
+    "$@" >"$tmp/server.log" 2>&1 &
+    server=$!
+    sleep 0.5
+    if ! kill -0 "$server" 2>/dev/null; then
+        echo "skipping $*: $(tail -n 1 "$tmp/server.log")" >&2
+        server=
+        return 1
+    fi
+}
+
+stop_server() {
+    kill "$server"
+    wait "$server" 2>/dev/null
+    server=
+    sleep 0.3
+}
+
+# Roda $conns cópias do comando ao mesmo tempo, saídas em $tmp/client.*
+run_clients() {
+    conns=$1
+    shift
+    rm -f "$tmp"/client.*
+    pids=
+    k=0
+    while [ "$k" -lt "$conns" ]; do
+        "$@" >"$tmp/client.$k" 2>&1 &
+        pids="$pids $!"
+        k=$((k + 1))
+    done
+    wait $pids
+}
+
+# msgs/s, MB/s, p50 e p99 somados das saídas dos clientes
+summarize() {
+    cat "$tmp"/client.* | awk '
+        /^Window|^Throughput/ {
+            for (i = 1; i < NF; ++i) {
+                if ($(i+1) ~ /^msgs\/s/) msgs += $i
+                if ($(i+1) ~ /^MB\/s/) mb += $i
+            }
+        }
+        /RTT \(us/ {
+            for (i = 1; i < NF; ++i) {
+                if ($i == "p50") { p50 += $(i+1); n++ }
+                if ($i == "p99" && $(i+1) > p99) p99 = $(i+1)
+            }
+        }
+        END { printf "%.0f,%.2f,%.1f,%.1f\n", msgs, mb, (n ? p50 / n : 0), p99 }'
+}
+
+# Melhor de RUNS rodadas de um ponto; imprime a linha do CSV
+point() {
+    key=$1
+    conns=$2
+    shift 2
+    best=
+    run=0
+    while [ "$run" -lt "$RUNS" ]; do
+        run_clients "$conns" "$@"
+        row=$(summarize)
+        best=$(printf "%s\n%s\n" "$best" "$row" |
+            awk -F, 'NF && (!seen || $2 > mb) { seen = 1; mb = $2; line = $0 } END { print line }')
+        run=$((run + 1))
+    done
+    echo "$key,$best" | tee -a "$OUT"
+}
+
+echo "test,variant,size,connections,window,msgs_per_s,mb_per_s,p50_us,p99_us" > "$OUT"
+
+for engine in $TCP_ENGINES; do
+    start_server "$BIN/tcp_serve_toupper" -e "$engine" $SERVER_FLAGS || continue
+    for size in $SIZES; do
+        for conns in $CONNS; do
+            for window in $WINDOWS; do
+                point "tcp,$engine,$size,$conns,$window" "$conns" \
+                    "$BIN/tcp_client" 127.0.0.1 "$PORT" -w "$window" -n "$COUNT" -s "$size"
+            done
+        done
+    done
+    stop_server
+done
+
+for batch in $UDP_BATCHES; do
+    start_server "$BIN/udp_serve_toupper" -b "$batch" $SERVER_FLAGS || continue
+    for size in $SIZES; do
+        [ "$size" -gt "$UDP_MAX" ] && size=$UDP_MAX
+        for conns in $CONNS; do
+            point "udp,batch$batch,$size,$conns,1" "$conns" \
+                "$BIN/udp_client" 127.0.0.1 "$PORT" -n "$COUNT" -s "$size"
+        done
+    done
+    stop_server
+done
+
+# o kernel sozinho: GB/s da cadeia fundida, sem rede no caminho
+for chain in $XFORM_CHAINS; do
+    variant=$(echo "$chain" | tr , +)
+    for size in $SIZES; do
+        "$BIN/xform_bench" -x "$chain" -s "$size" |
+            awk -v chain="$chain" -v key="xform,$variant,$size,1,1" -v size="$size" '
+                # a cadeia fundida é a última linha com o nome dela (com um
+                # estágio só, o mesmo nome aparece antes entre os estágios)
+                $1 == chain {
+                    for (i = 1; i < NF; ++i)
+                        if ($(i+1) == "GB/s") gbs = $i
+                }
+                END { printf "%s,%.0f,%.2f,,\n", key, gbs * 1e9 / size, gbs * 1e3 }' |
+            tee -a "$OUT"
+    done
+done
+
+if [ ! -f "$BASELINE" ] || [ -n "$UPDATE_BASELINE" ]; then
+    cp "$OUT" "$BASELINE"
+    echo "Baseline saved to $BASELINE"
+    exit 0
+fi
+
+echo
+echo "Compared with $BASELINE (tolerance $TOLERANCE%):"
+awk -F, -v tol="$TOLERANCE" '
+    NR == FNR { if (FNR > 1) base[$1 "," $2 "," $3 "," $4 "," $5] = $7; next }
+    FNR == 1 { next }
+    {
+        key = $1 "," $2 "," $3 "," $4 "," $5
+        if (!(key in base) || base[key] <= 0) { fresh++; next }
+        ratio = $7 / base[key]
+        compared++
+        if (ratio < 1 - tol / 100) {
+            printf "  REGRESSION %-32s %10.2f -> %10.2f MB/s (%.2fx)\n", key, base[key], $7, ratio
+            bad++
+        } else if (ratio > 1 + tol / 100) {
+            printf "  faster     %-32s %10.2f -> %10.2f MB/s (%.2fx)\n", key, base[key], $7, ratio
+        }
+    }
+    END {
+        printf "%d points compared, %d regressions", compared, bad
+        if (fresh) printf ", %d not in the baseline", fresh
+        printf "\n"
+        exit bad > 0
+    }' "$BASELINE" "$OUT"